@@ -6,21 +6,60 @@
 
 #include "agent.h"
 #include "base64.h"
+#include "config.h"
 #include "ice.h"
 #include "ports.h"
 #include "socket.h"
 #include "stun.h"
 #include "utils.h"
 
+// turns: runs on the TLS transport of the signaling code
+#if CONFIG_TURN_TCP && !defined(DISABLE_PEER_SIGNALING)
+#define AGENT_TURN_TLS 1
+#include "ssl_transport.h"
+#else
+#define AGENT_TURN_TLS 0
+#endif
+
 #define AGENT_POLL_TIMEOUT 1
-#define AGENT_CONNCHECK_MAX 1000
-#define AGENT_CONNCHECK_PERIOD 100
-#define AGENT_STUN_RECV_MAXTIMES 1000
+// RFC 8445 14.2, pacing between new checks (ms)
+#define AGENT_CONNCHECK_TA 50
+// initial retransmission timeout of a check (ms), doubled up to AGENT_CONNCHECK_MAX_RTO
+#define AGENT_CONNCHECK_RTO 500
+#define AGENT_CONNCHECK_MAX_RTO 1000
+// binding requests sent per check before the pair fails
+#define AGENT_CONNCHECK_MAX 7
+// with nothing left to check, how long to wait for trickled candidates before failing (ms)
+#define AGENT_CHECKLIST_TIMEOUT 5000
+// RFC 5389 7.2.1 retransmission, Rc is lowered so one dead server cannot hold gathering for 39.5s
+#define AGENT_STUN_RTO 500
+#define AGENT_STUN_MAX_TRANSMISSIONS 4
+// ICE-lite gives up when no authenticated request arrives for this long (ms)
+#define AGENT_LITE_TIMEOUT 10000
+// give up on a server whose name does not resolve in time (ms)
+#define AGENT_DNS_TIMEOUT 5000
+// RFC 8656, permissions last 300s and channel bindings 600s, both are refreshed ahead of time (ms)
+#define AGENT_TURN_PERMISSION_REFRESH 240000
+// allocation lifetime assumed when the server does not send one (s)
+#define AGENT_TURN_DEFAULT_LIFETIME 600
+// wait before retrying a failed refresh (ms)
+#define AGENT_TURN_RETRY_INTERVAL 5000
+#define AGENT_TURN_CHANNEL_MIN 0x4000
+#define AGENT_TURN_CHANNEL_HEADER 4
+// largest relayed datagram including the TURN framing
+#define AGENT_TURN_PACKET_SIZE 1500
+// TCP/TLS connection and handshake to a TURN server (ms)
+#define AGENT_TURN_CONNECT_TIMEOUT 10000
+// holds a partly received frame plus the next one
+#define AGENT_TURN_STREAM_BUFFER_SIZE (2 * AGENT_TURN_PACKET_SIZE)
 
 void agent_clear_candidates(Agent* agent) {
   agent->local_candidates_count = 0;
   agent->remote_candidates_count = 0;
   agent->candidate_pairs_num = 0;
+  agent_clear_ice_servers(agent);
+  agent->selected_pair = NULL;
+  agent->nominated_pair = NULL;
 }
 
 int agent_create(Agent* agent) {
@@ -30,6 +69,7 @@ int agent_create(Agent* agent) {
     return ret;
   }
   LOGI("create IPv4 UDP socket: %d", agent->udp_sockets[0].fd);
+  agent->ice_servers_num = 0;
 
 #if CONFIG_IPV6
   if ((ret = udp_socket_open(&agent->udp_sockets[1], AF_INET6, 0)) < 0) {
@@ -42,10 +82,14 @@ int agent_create(Agent* agent) {
   agent_clear_candidates(agent);
   memset(agent->remote_ufrag, 0, sizeof(agent->remote_ufrag));
   memset(agent->remote_upwd, 0, sizeof(agent->remote_upwd));
+  stun_key_init(&agent->local_key, STUN_CREDENTIAL_SHORT_TERM, NULL, NULL, agent->local_upwd);
+  stun_key_init(&agent->remote_key, STUN_CREDENTIAL_SHORT_TERM, NULL, NULL, agent->remote_upwd);
   return 0;
 }
 
 void agent_destroy(Agent* agent) {
+  agent_clear_ice_servers(agent);
+
   if (agent->udp_sockets[0].fd > 0) {
     udp_socket_close(&agent->udp_sockets[0]);
   }
@@ -55,9 +99,219 @@ void agent_destroy(Agent* agent) {
     udp_socket_close(&agent->udp_sockets[1]);
   }
 #endif
+
+  utils_hmac_sha1_free(&agent->local_key);
+  utils_hmac_sha1_free(&agent->remote_key);
+}
+
+#if CONFIG_TURN_TCP
+struct AgentIceServerStream {
+  TcpSocket tcp_socket;
+#if AGENT_TURN_TLS
+  NetworkContext_t tls;  // turns: uses the socket inside the TLS context instead
+  int handshaking;
+#endif
+  uint8_t buf[AGENT_TURN_STREAM_BUFFER_SIZE];
+  int len;
+};
+
+static TcpSocket* agent_stream_socket(AgentIceServer* server) {
+#if AGENT_TURN_TLS
+  if (server->transport == AGENT_ICE_SERVER_TLS) {
+    return &server->stream->tls.tcp_socket;
+  }
+#endif
+  return &server->stream->tcp_socket;
+}
+
+static int agent_stream_ready(AgentIceServer* server) {
+  return server->stream != NULL &&
+         (server->state == AGENT_ICE_SERVER_INPROGRESS || server->state == AGENT_ICE_SERVER_DONE);
+}
+
+static int agent_stream_connect(AgentIceServer* server) {
+  TcpSocket* tcp_socket;
+
+  if ((server->stream = calloc(1, sizeof(AgentIceServerStream))) == NULL) {
+    return -1;
+  }
+
+  tcp_socket = agent_stream_socket(server);
+  if (tcp_socket_open(tcp_socket, server->addr.family) < 0 || tcp_socket_set_nonblocking(tcp_socket, 1) < 0 ||
+      tcp_socket_connect(tcp_socket, &server->addr) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int agent_stream_update_connect(AgentIceServer* server) {
+  int ret;
+  TcpSocket* tcp_socket = agent_stream_socket(server);
+
+#if AGENT_TURN_TLS
+  if (server->stream->handshaking) {
+    if ((ret = ssl_transport_handshake(&server->stream->tls)) == 0) {
+      server->stream->handshaking = 0;
+    }
+    return ret;
+  }
+#endif
+
+  if ((ret = tcp_socket_wait_connected(tcp_socket, 0)) != 0) {
+    return ret;
+  }
+
+  // reads only happen once select reports data, blocking writes never leave half a frame behind
+  tcp_socket_set_nonblocking(tcp_socket, 0);
+
+#if AGENT_TURN_TLS
+  if (server->transport == AGENT_ICE_SERVER_TLS) {
+    if (ssl_transport_start(&server->stream->tls, server->hostname) < 0) {
+      return -1;
+    }
+    server->stream->handshaking = 1;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+static void agent_stream_close(AgentIceServer* server) {
+  if (server->stream == NULL) {
+    return;
+  }
+
+  switch (server->transport) {
+#if AGENT_TURN_TLS
+    case AGENT_ICE_SERVER_TLS:
+      ssl_transport_disconnect(&server->stream->tls);
+      break;
+#endif
+    default:
+      tcp_socket_close(&server->stream->tcp_socket);
+      break;
+  }
+
+  free(server->stream);
+  server->stream = NULL;
+}
+
+static int agent_stream_send(AgentIceServer* server, const uint8_t* buf, int len) {
+  switch (server->transport) {
+#if AGENT_TURN_TLS
+    case AGENT_ICE_SERVER_TLS:
+      return ssl_transport_send(&server->stream->tls, buf, len);
+#endif
+    default:
+      return tcp_socket_send(&server->stream->tcp_socket, buf, len);
+  }
+}
+
+static int agent_stream_pending(AgentIceServer* server) {
+#if AGENT_TURN_TLS
+  if (server->transport == AGENT_ICE_SERVER_TLS) {
+    return ssl_transport_pending(&server->stream->tls) > 0;
+  }
+#endif
+  return 0;
+}
+
+static int agent_stream_read(AgentIceServer* server) {
+  int ret;
+  AgentIceServerStream* stream = server->stream;
+
+  if (stream->len >= sizeof(stream->buf)) {
+    return 0;
+  }
+
+  switch (server->transport) {
+#if AGENT_TURN_TLS
+    case AGENT_ICE_SERVER_TLS:
+      ret = ssl_transport_read(&stream->tls, stream->buf + stream->len, sizeof(stream->buf) - stream->len);
+      break;
+#endif
+    default:
+      ret = tcp_socket_recv(&stream->tcp_socket, stream->buf + stream->len, sizeof(stream->buf) - stream->len);
+      // select reported data, reading nothing means the server closed the connection
+      if (ret == 0) {
+        ret = -1;
+      }
+      break;
+  }
+
+  if (ret > 0) {
+    stream->len += ret;
+  }
+  return ret;
+}
+
+static int agent_stream_frame_size(uint8_t* buf, int len) {
+  if (len < AGENT_TURN_CHANNEL_HEADER) {
+    return 0;
+  }
+  // RFC 8656 12.5, ChannelData is padded to 4 bytes on a stream, a STUN message already is
+  if ((buf[0] & 0xc0) == 0x40) {
+    return AGENT_TURN_CHANNEL_HEADER + 4 * ((ntohs(*(uint16_t*)(buf + 2)) + 3) / 4);
+  }
+  return sizeof(StunHeader) + ntohs(*(uint16_t*)(buf + 2));
+}
+
+static int agent_stream_next_frame(AgentIceServer* server, uint8_t* buf, int len) {
+  AgentIceServerStream* stream = server->stream;
+  int size = agent_stream_frame_size(stream->buf, stream->len);
+
+  if (size > sizeof(stream->buf)) {
+    LOGE("Invalid frame from TURN server");
+    return -1;
+  }
+
+  if (size == 0 || size > stream->len) {
+    return 0;
+  }
+
+  if (size <= len) {
+    memcpy(buf, stream->buf, size);
+  } else {
+    LOGW("Drop TURN frame of %d bytes", size);
+  }
+  stream->len -= size;
+  memmove(stream->buf, stream->buf + size, stream->len);
+  return size <= len ? size : 0;
+}
+
+static int agent_stream_recv(Agent* agent, Address* addr, uint8_t* buf, int len, AgentIceServer** server, fd_set* rfds) {
+  int i, ret;
+  AgentIceServer* ice_server;
+
+  // without rfds only frames already buffered, or decrypted by TLS, are taken
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    ice_server = &agent->ice_servers[i];
+    if (!agent_stream_ready(ice_server)) {
+      continue;
+    }
+
+    ret = 0;
+    if (rfds ? FD_ISSET(agent_stream_socket(ice_server)->fd, rfds) : agent_stream_pending(ice_server)) {
+      ret = agent_stream_read(ice_server);
+    }
+
+    if (ret >= 0 && (ret = agent_stream_next_frame(ice_server, buf, len)) > 0) {
+      memcpy(addr, &ice_server->addr, sizeof(Address));
+      *server = ice_server;
+      return ret;
+    }
+
+    if (ret < 0) {
+      LOGE("Lost connection to TURN server %s", ice_server->hostname);
+      agent_stream_close(ice_server);
+      ice_server->state = AGENT_ICE_SERVER_FAILED;
+    }
+  }
+  return 0;
 }
+#endif
 
-static int agent_socket_recv(Agent* agent, Address* addr, uint8_t* buf, int len) {
+static int agent_socket_recv(Agent* agent, Address* addr, uint8_t* buf, int len, AgentIceServer** server) {
   int ret = -1;
   int i = 0;
   int maxfd = -1;
@@ -69,6 +323,14 @@ static int agent_socket_recv(Agent* agent, Address* addr, uint8_t* buf, int len)
 #endif
   };
 
+  *server = NULL;
+#if CONFIG_TURN_TCP
+  // buffered frames and decrypted TLS records do not wake up select
+  if ((ret = agent_stream_recv(agent, addr, buf, len, server, NULL)) > 0) {
+    return ret;
+  }
+#endif
+
   tv.tv_sec = 0;
   tv.tv_usec = AGENT_POLL_TIMEOUT * 1000;
   FD_ZERO(&rfds);
@@ -82,203 +344,780 @@ static int agent_socket_recv(Agent* agent, Address* addr, uint8_t* buf, int len)
     }
   }
 
-  ret = select(maxfd + 1, &rfds, NULL, NULL, &tv);
-  if (ret < 0) {
-    LOGE("select error");
-  } else if (ret == 0) {
-    // timeout
-  } else {
-    for (i = 0; i < 2; i++) {
-      if (FD_ISSET(agent->udp_sockets[i].fd, &rfds)) {
-        memset(buf, 0, len);
-        ret = udp_socket_recvfrom(&agent->udp_sockets[i], addr, buf, len);
-        break;
-      }
-    }
+#if CONFIG_TURN_TCP
+  // one connection per TCP/TLS server is polled together with the UDP sockets
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    if (agent_stream_ready(&agent->ice_servers[i])) {
+      FD_SET(agent_stream_socket(&agent->ice_servers[i])->fd, &rfds);
+      if (agent_stream_socket(&agent->ice_servers[i])->fd > maxfd) {
+        maxfd = agent_stream_socket(&agent->ice_servers[i])->fd;
+      }
+    }
+  }
+#endif
+
+  ret = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+  if (ret < 0) {
+    LOGE("select error");
+  } else if (ret == 0) {
+    // timeout
+  } else {
+    for (i = 0; i < 2; i++) {
+      if (FD_ISSET(agent->udp_sockets[i].fd, &rfds)) {
+        memset(buf, 0, len);
+        return udp_socket_recvfrom(&agent->udp_sockets[i], addr, buf, len);
+      }
+    }
+#if CONFIG_TURN_TCP
+    ret = agent_stream_recv(agent, addr, buf, len, server, &rfds);
+#endif
+  }
+
+  return ret;
+}
+
+static UdpSocket* agent_socket_for(Agent* agent, Address* addr) {
+  switch (addr->family) {
+    case AF_INET6:
+      return &agent->udp_sockets[1];
+    case AF_INET:
+    default:
+      return &agent->udp_sockets[0];
+  }
+}
+
+static int agent_socket_send(Agent* agent, Address* addr, const uint8_t* buf, int len) {
+  return udp_socket_sendto(agent_socket_for(agent, addr), addr, buf, len);
+}
+
+static int agent_server_send(Agent* agent, AgentIceServer* server, const uint8_t* buf, int len) {
+#if CONFIG_TURN_TCP
+  if (server->transport != AGENT_ICE_SERVER_UDP) {
+    return server->stream ? agent_stream_send(server, buf, len) : -1;
+  }
+#endif
+  return agent_socket_send(agent, &server->addr, buf, len);
+}
+
+static void agent_server_schedule(AgentIceServer* server, int* transmissions, uint32_t* next_send_time, uint32_t now) {
+  if (server->transport != AGENT_ICE_SERVER_UDP) {
+    // TCP retransmits by itself, the request gets as long as all UDP attempts would have had
+    *next_send_time = now + AGENT_STUN_RTO * ((1 << AGENT_STUN_MAX_TRANSMISSIONS) - 1);
+    *transmissions = AGENT_STUN_MAX_TRANSMISSIONS;
+    return;
+  }
+  // sent at 0, RTO, 3*RTO, 7*RTO, the last one times out after another 8*RTO
+  *next_send_time = now + (AGENT_STUN_RTO << *transmissions);
+  (*transmissions)++;
+}
+
+static int agent_create_host_addr(Agent* agent) {
+  int i, j;
+  const char* iface_prefx[] = {CONFIG_IFACE_PREFIX};
+  IceCandidate* ice_candidate;
+  int addr_type[] = { AF_INET,
+#if CONFIG_IPV6
+                      AF_INET6,
+#endif
+  };
+
+  for (i = 0; i < sizeof(addr_type) / sizeof(addr_type[0]); i++) {
+    for (j = 0; j < sizeof(iface_prefx) / sizeof(iface_prefx[0]); j++) {
+      ice_candidate = agent->local_candidates + agent->local_candidates_count;
+      // only copy port and family to addr of ice candidate
+      ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST,
+                           &agent->udp_sockets[i].bind_addr);
+      // if resolve host addr, add to local candidate
+      if (ports_get_host_addr(&ice_candidate->addr, iface_prefx[j])) {
+        agent->local_candidates_count++;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void agent_new_transaction_id(uint32_t* transaction_id) {
+  utils_random(NULL, (unsigned char*)transaction_id, 3 * sizeof(uint32_t));
+}
+
+static void agent_add_local_candidate(Agent* agent, IceCandidateType type, Address* addr) {
+  int i;
+  IceCandidate* ice_candidate;
+
+  for (i = 0; i < agent->local_candidates_count; i++) {
+    if (agent->local_candidates[i].type == type && addr_equal(&agent->local_candidates[i].addr, addr)) {
+      return;
+    }
+  }
+
+  if (agent->local_candidates_count >= AGENT_MAX_CANDIDATES) {
+    LOGW("Too many local candidates");
+    return;
+  }
+
+  ice_candidate = agent->local_candidates + agent->local_candidates_count++;
+  ice_candidate_create(ice_candidate, agent->local_candidates_count, type, addr);
+}
+
+static uint32_t agent_turn_refresh_interval(uint32_t lifetime) {
+  if (lifetime == 0) {
+    lifetime = AGENT_TURN_DEFAULT_LIFETIME;
+  }
+  // refresh a minute ahead of expiry, or halfway through a short lifetime
+  return (lifetime > 120 ? lifetime - 60 : lifetime / 2) * 1000;
+}
+
+static const char* agent_server_request_name(AgentIceServer* server) {
+  return server->type == AGENT_ICE_SERVER_TURN ? "TURN Allocate" : "STUN Binding";
+}
+
+static void agent_turn_set_realm(AgentIceServer* server, const char* realm) {
+  // the long-term key only depends on the realm, a new nonce alone keeps it
+  if (server->realm[0] != '\0' && strcmp(server->realm, realm) == 0) {
+    return;
+  }
+  snprintf(server->realm, sizeof(server->realm), "%s", realm);
+  stun_key_init(&server->key, STUN_CREDENTIAL_LONG_TERM, server->username, server->realm, server->credential);
+}
+
+static void agent_send_turn_request(Agent* agent, AgentIceServer* server, StunMethod method, uint32_t* transaction_id,
+                                    AgentTurnPeer* peer, int lifetime) {
+  uint32_t attr;
+  char peer_address[20];
+  uint8_t mask[16];
+  StunMessage msg;
+  StunHeader* header;
+  memset(&msg, 0, sizeof(msg));
+  memset(peer_address, 0, sizeof(peer_address));
+
+  stun_msg_create(&msg, STUN_CLASS_REQUEST | method);
+  header = (StunHeader*)msg.buf;
+  memcpy(header->transaction_id, transaction_id, sizeof(header->transaction_id));
+
+  if (method == STUN_METHOD_ALLOCATE) {
+    attr = ntohl(0x11000000);
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr);  // UDP
+  }
+
+  if (peer) {
+    *((uint32_t*)mask) = htonl(MAGIC_COOKIE);
+    memcpy(mask + 4, transaction_id, sizeof(header->transaction_id));
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_XOR_PEER_ADDRESS,
+                        stun_set_mapped_address(peer_address, mask, &peer->addr), peer_address);
+  }
+
+  if (method == STUN_METHOD_CHANNEL_BIND) {
+    // channel number followed by two reserved bytes
+    attr = htonl((uint32_t)peer->channel << 16);
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_CHANNEL_NUMBER, sizeof(attr), (char*)&attr);
+  }
+
+  if (lifetime >= 0) {
+    attr = htonl(lifetime);
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_LIFETIME, sizeof(attr), (char*)&attr);
+  }
+
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_USERNAME, strlen(server->username), server->username);
+  // the first Allocate goes out without credentials to learn the realm and nonce
+  if (server->nonce[0] != '\0') {
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_NONCE, strlen(server->nonce), server->nonce);
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_REALM, strlen(server->realm), server->realm);
+    stun_msg_finish(&msg, &server->key);
+  }
+
+  if (agent_server_send(agent, server, msg.buf, msg.size) < 0) {
+    LOGE("Failed to send TURN request 0x%04x.", method);
+  }
+}
+
+static void agent_send_server_request(Agent* agent, AgentIceServer* server, uint32_t now) {
+  StunMessage msg;
+  StunHeader* header;
+
+  if (server->type == AGENT_ICE_SERVER_TURN) {
+    agent_send_turn_request(agent, server, STUN_METHOD_ALLOCATE, server->transaction_id, NULL, -1);
+  } else {
+    memset(&msg, 0, sizeof(msg));
+    stun_msg_create(&msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+    header = (StunHeader*)msg.buf;
+    memcpy(header->transaction_id, server->transaction_id, sizeof(header->transaction_id));
+    if (agent_server_send(agent, server, msg.buf, msg.size) < 0) {
+      LOGE("Failed to send %s request.", agent_server_request_name(server));
+    }
+  }
+
+  agent_server_schedule(server, &server->transmissions, &server->next_send_time, now);
+}
+
+static void agent_start_server_transaction(Agent* agent, AgentIceServer* server) {
+  agent_new_transaction_id(server->transaction_id);
+  server->transmissions = 0;
+  server->state = AGENT_ICE_SERVER_INPROGRESS;
+  agent_send_server_request(agent, server, ports_get_epoch_time());
+}
+
+static AgentIceServer* agent_find_server_by_transaction(Agent* agent, uint32_t* transaction_id) {
+  int i;
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    if (agent->ice_servers[i].state == AGENT_ICE_SERVER_INPROGRESS &&
+        memcmp(agent->ice_servers[i].transaction_id, transaction_id, sizeof(agent->ice_servers[i].transaction_id)) == 0) {
+      return &agent->ice_servers[i];
+    }
+  }
+  return NULL;
+}
+
+static void agent_process_server_response(Agent* agent, AgentIceServer* server, StunMessage* msg) {
+  if (msg->stunclass == STUN_CLASS_ERROR) {
+    // the first Allocate is unauthenticated, the 401 (or a 438 stale nonce) carries the realm and nonce to retry with
+    if (server->type == AGENT_ICE_SERVER_TURN && (server->nonce[0] == '\0' || msg->error_code == 438) &&
+        msg->nonce[0] != '\0') {
+      snprintf(server->nonce, sizeof(server->nonce), "%s", msg->nonce);
+      agent_turn_set_realm(server, msg->realm);
+      agent_start_server_transaction(agent, server);
+    } else {
+      LOGE("%s request rejected.", agent_server_request_name(server));
+      server->state = AGENT_ICE_SERVER_FAILED;
+    }
+    return;
+  }
+
+  if (server->type == AGENT_ICE_SERVER_TURN) {
+    agent_add_local_candidate(agent, ICE_CANDIDATE_TYPE_RELAY, &msg->relayed_addr);
+    memcpy(&server->relayed_addr, &msg->relayed_addr, sizeof(Address));
+    server->method = 0;
+    server->peers_num = 0;
+    server->next_send_time = ports_get_epoch_time() + agent_turn_refresh_interval(msg->lifetime);
+  } else {
+    agent_add_local_candidate(agent, ICE_CANDIDATE_TYPE_SRFLX, &msg->mapped_addr);
+  }
+  server->state = AGENT_ICE_SERVER_DONE;
+}
+
+void agent_gather_candidate(Agent* agent, const char* urls, const char* username, const char* credential) {
+  char* pos;
+  const char* host;
+  int port;
+  size_t len;
+  AgentIceServer* server;
+
+  if (urls == NULL) {
+    agent_create_host_addr(agent);
+    return;
+  }
+
+  host = strncmp(urls, "turns:", 6) == 0 ? urls + 6 : urls + 5;
+  if ((pos = strstr(host, ":")) == NULL) {
+    LOGE("Invalid URL");
+    return;
+  }
+
+  port = atoi(pos + 1);
+  if (port <= 0) {
+    LOGE("Cannot parse port");
+    return;
+  }
+
+  if (agent->ice_servers_num >= AGENT_MAX_ICE_SERVERS) {
+    LOGW("Too many ICE servers");
+    return;
+  }
+
+  server = &agent->ice_servers[agent->ice_servers_num];
+  memset(server, 0, sizeof(AgentIceServer));
+  len = pos - host + 1;
+  snprintf(server->hostname, len < sizeof(server->hostname) ? len : sizeof(server->hostname), "%s", host);
+  server->port = port;
+
+  if (strncmp(urls, "stun:", 5) == 0) {
+    server->type = AGENT_ICE_SERVER_STUN;
+  } else if (strncmp(urls, "turn:", 5) == 0 || strncmp(urls, "turns:", 6) == 0) {
+    server->type = AGENT_ICE_SERVER_TURN;
+    snprintf(server->username, sizeof(server->username), "%s", username ? username : "");
+    snprintf(server->credential, sizeof(server->credential), "%s", credential ? credential : "");
+    if (urls[4] == 's') {
+      server->transport = AGENT_ICE_SERVER_TLS;
+    } else if (strstr(pos, "?transport=tcp") != NULL) {
+      server->transport = AGENT_ICE_SERVER_TCP;
+    }
+  } else {
+    LOGE("Unsupported ICE server: %s", urls);
+    return;
+  }
+
+  if ((server->transport == AGENT_ICE_SERVER_TCP && !CONFIG_TURN_TCP) ||
+      (server->transport == AGENT_ICE_SERVER_TLS && !AGENT_TURN_TLS)) {
+    LOGE("TURN over TCP/TLS is disabled: %s", urls);
+    return;
+  }
+
+  agent->ice_servers_num++;
+  agent->state = AGENT_STATE_GATHERING_STARTED;
+  // DNS runs in the background, the request goes out from agent_update_gathering once it resolves
+  server->state = AGENT_ICE_SERVER_RESOLVING;
+  server->next_send_time = ports_get_epoch_time() + AGENT_DNS_TIMEOUT;
+  agent_update_gathering(agent);
+}
+
+static void agent_connect_server(Agent* agent, AgentIceServer* server, uint32_t now) {
+#if CONFIG_TURN_TCP
+  switch (agent_stream_update_connect(server)) {
+    case 0:
+      agent_start_server_transaction(agent, server);
+      break;
+    case 1:
+      if ((int32_t)(now - server->next_send_time) >= 0) {
+        LOGW("Timed out connecting to %s", server->hostname);
+        agent_stream_close(server);
+        server->state = AGENT_ICE_SERVER_FAILED;
+      }
+      break;
+    default:
+      LOGE("Failed to connect to %s", server->hostname);
+      agent_stream_close(server);
+      server->state = AGENT_ICE_SERVER_FAILED;
+      break;
+  }
+#endif
+}
+
+static void agent_resolve_server(Agent* agent, AgentIceServer* server, uint32_t now) {
+  char addr_string[ADDRSTRLEN];
+
+  // ipv6 no need stun
+  switch (ports_resolve_addr_async(server->hostname, &server->addr)) {
+    case 0:
+      addr_set_port(&server->addr, server->port);
+      addr_to_string(&server->addr, addr_string, sizeof(addr_string));
+      LOGI("Resolved stun/turn server %s:%d", addr_string, server->port);
+#if CONFIG_TURN_TCP
+      if (server->transport != AGENT_ICE_SERVER_UDP) {
+        // the connection is polled from agent_update_gathering, the Allocate goes out once it is up
+        server->state = AGENT_ICE_SERVER_CONNECTING;
+        server->next_send_time = now + AGENT_TURN_CONNECT_TIMEOUT;
+        if (agent_stream_connect(server) < 0) {
+          LOGE("Failed to connect to %s", server->hostname);
+          agent_stream_close(server);
+          server->state = AGENT_ICE_SERVER_FAILED;
+        }
+        break;
+      }
+#endif
+      // every server gets its request right away, responses are matched in agent_recv
+      agent_start_server_transaction(agent, server);
+      break;
+    case 1:
+      if ((int32_t)(now - server->next_send_time) >= 0) {
+        LOGW("Timed out resolving %s", server->hostname);
+        server->state = AGENT_ICE_SERVER_FAILED;
+      }
+      break;
+    default:
+      LOGE("Failed to resolve %s", server->hostname);
+      server->state = AGENT_ICE_SERVER_FAILED;
+      break;
+  }
+}
+
+void agent_update_gathering(Agent* agent) {
+  int i;
+  int pending = 0;
+  uint32_t now = ports_get_epoch_time();
+  AgentIceServer* server;
+
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    server = &agent->ice_servers[i];
+    if (server->state == AGENT_ICE_SERVER_RESOLVING) {
+      agent_resolve_server(agent, server, now);
+    }
+    if (server->state == AGENT_ICE_SERVER_CONNECTING) {
+      agent_connect_server(agent, server, now);
+    }
+    if (server->state != AGENT_ICE_SERVER_INPROGRESS) {
+      pending += server->state == AGENT_ICE_SERVER_RESOLVING || server->state == AGENT_ICE_SERVER_CONNECTING;
+      continue;
+    }
+
+    if ((int32_t)(now - server->next_send_time) >= 0) {
+      if (server->transmissions >= AGENT_STUN_MAX_TRANSMISSIONS) {
+        LOGW("%s request timed out.", agent_server_request_name(server));
+        server->state = AGENT_ICE_SERVER_FAILED;
+        continue;
+      }
+      agent_send_server_request(agent, server, now);
+    }
+    pending++;
+  }
+
+  if (pending == 0 && agent->state == AGENT_STATE_GATHERING_STARTED) {
+    agent->state = AGENT_STATE_GATHERING_COMPLETED;
+  }
+}
+
+static AgentIceServer* agent_turn_find_server(Agent* agent, Address* addr) {
+  int i;
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    if (agent->ice_servers[i].type == AGENT_ICE_SERVER_TURN && agent->ice_servers[i].state == AGENT_ICE_SERVER_DONE &&
+        agent->ice_servers[i].transport == AGENT_ICE_SERVER_UDP && addr_equal(&agent->ice_servers[i].addr, addr)) {
+      return &agent->ice_servers[i];
+    }
+  }
+  return NULL;
+}
+
+static AgentIceServer* agent_turn_find_relay(Agent* agent, IceCandidate* local) {
+  int i;
+  if (local->type != ICE_CANDIDATE_TYPE_RELAY) {
+    return NULL;
+  }
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    if (agent->ice_servers[i].type == AGENT_ICE_SERVER_TURN && agent->ice_servers[i].state == AGENT_ICE_SERVER_DONE &&
+        addr_equal(&agent->ice_servers[i].relayed_addr, &local->addr)) {
+      return &agent->ice_servers[i];
+    }
+  }
+  return NULL;
+}
+
+static AgentTurnPeer* agent_turn_find_peer(AgentIceServer* server, Address* addr) {
+  int i;
+  for (i = 0; i < server->peers_num; i++) {
+    if (addr_equal(&server->peers[i].addr, addr)) {
+      return &server->peers[i];
+    }
+  }
+  return NULL;
+}
+
+static AgentTurnPeer* agent_turn_find_permission(AgentIceServer* server, Address* addr) {
+  int i;
+  Address ip;
+  // permissions are per IP address, any port of a permitted peer gets through
+  for (i = 0; i < server->peers_num; i++) {
+    memcpy(&ip, addr, sizeof(Address));
+    addr_set_port(&ip, server->peers[i].addr.port);
+    if (server->peers[i].state != AGENT_TURN_PEER_PERMISSION_PENDING &&
+        server->peers[i].state != AGENT_TURN_PEER_FAILED && addr_equal(&server->peers[i].addr, &ip)) {
+      return &server->peers[i];
+    }
+  }
+  return NULL;
+}
+
+static AgentTurnPeer* agent_turn_find_channel(AgentIceServer* server, uint16_t channel) {
+  int i;
+  for (i = 0; i < server->peers_num; i++) {
+    if (server->peers[i].channel == channel) {
+      return &server->peers[i];
+    }
+  }
+  return NULL;
+}
+
+static void agent_turn_send_peer_request(Agent* agent, AgentIceServer* server, AgentTurnPeer* peer, uint32_t now) {
+  agent_send_turn_request(agent, server, peer->method, peer->transaction_id, peer, -1);
+  agent_server_schedule(server, &peer->transmissions, &peer->next_send_time, now);
+}
+
+static void agent_turn_start_peer_request(Agent* agent, AgentIceServer* server, AgentTurnPeer* peer, StunMethod method) {
+  agent_new_transaction_id(peer->transaction_id);
+  peer->method = method;
+  peer->transmissions = 0;
+  agent_turn_send_peer_request(agent, server, peer, ports_get_epoch_time());
+}
+
+static void agent_turn_send_refresh(Agent* agent, AgentIceServer* server, uint32_t now) {
+  agent_send_turn_request(agent, server, STUN_METHOD_REFRESH, server->transaction_id, NULL, -1);
+  agent_server_schedule(server, &server->transmissions, &server->next_send_time, now);
+}
+
+static void agent_turn_start_refresh(Agent* agent, AgentIceServer* server) {
+  agent_new_transaction_id(server->transaction_id);
+  server->method = STUN_METHOD_REFRESH;
+  server->transmissions = 0;
+  agent_turn_send_refresh(agent, server, ports_get_epoch_time());
+}
+
+static void agent_turn_add_peer(Agent* agent, AgentIceServer* server, Address* addr) {
+  AgentTurnPeer* peer;
+
+  if (agent_turn_find_peer(server, addr) != NULL) {
+    return;
+  }
+
+  if (server->peers_num >= AGENT_MAX_TURN_PEERS) {
+    LOGW("Too many TURN peers");
+    return;
+  }
+
+  peer = &server->peers[server->peers_num];
+  memset(peer, 0, sizeof(AgentTurnPeer));
+  memcpy(&peer->addr, addr, sizeof(Address));
+  peer->channel = AGENT_TURN_CHANNEL_MIN + server->peers_num;
+  peer->state = AGENT_TURN_PEER_PERMISSION_PENDING;
+  server->peers_num++;
+  agent_turn_start_peer_request(agent, server, peer, STUN_METHOD_CREATE_PERMISSION);
+}
+
+static void agent_turn_bind_channel(Agent* agent, AgentIceServer* server, Address* addr) {
+  AgentTurnPeer* peer = agent_turn_find_peer(server, addr);
+  // data goes out as Send indications until the binding is confirmed
+  if (peer && peer->state == AGENT_TURN_PEER_PERMITTED) {
+    peer->state = AGENT_TURN_PEER_CHANNEL_PENDING;
+    agent_turn_start_peer_request(agent, server, peer, STUN_METHOD_CHANNEL_BIND);
+  }
+}
+
+static void agent_turn_peer_failed(AgentTurnPeer* peer, uint32_t now) {
+  LOGW("TURN request 0x%04x failed", peer->method);
+  switch (peer->state) {
+    case AGENT_TURN_PEER_PERMISSION_PENDING:
+      peer->state = AGENT_TURN_PEER_FAILED;
+      break;
+    case AGENT_TURN_PEER_CHANNEL_PENDING:
+      // the permission is still there, keep relaying with Send indications
+      peer->state = AGENT_TURN_PEER_PERMITTED;
+      break;
+    default:
+      break;
+  }
+  peer->method = 0;
+  peer->next_send_time = now + AGENT_TURN_RETRY_INTERVAL;
+}
+
+static int agent_turn_stale_nonce(AgentIceServer* server, StunMessage* msg) {
+  // the server rotates its nonce, the 438 answer carries the new one to retry with
+  if (msg->stunclass != STUN_CLASS_ERROR || msg->error_code != 438 || msg->nonce[0] == '\0') {
+    return 0;
+  }
+  snprintf(server->nonce, sizeof(server->nonce), "%s", msg->nonce);
+  if (msg->realm[0] != '\0') {
+    agent_turn_set_realm(server, msg->realm);
+  }
+  return 1;
+}
+
+static void agent_turn_process_peer_response(Agent* agent, AgentIceServer* server, AgentTurnPeer* peer, StunMessage* msg) {
+  uint32_t now = ports_get_epoch_time();
+
+  if (agent_turn_stale_nonce(server, msg)) {
+    agent_turn_start_peer_request(agent, server, peer, peer->method);
+    return;
+  }
+
+  if (msg->stunclass == STUN_CLASS_ERROR) {
+    LOGW("TURN request rejected: %d", msg->error_code);
+    agent_turn_peer_failed(peer, now);
+    return;
   }
 
-  return ret;
+  if (peer->method == STUN_METHOD_CHANNEL_BIND) {
+    peer->state = AGENT_TURN_PEER_BOUND;
+  } else if (peer->state == AGENT_TURN_PEER_PERMISSION_PENDING) {
+    peer->state = AGENT_TURN_PEER_PERMITTED;
+  }
+  peer->method = 0;
+  peer->next_send_time = now + AGENT_TURN_PERMISSION_REFRESH;
 }
 
-static int agent_socket_recv_attempts(Agent* agent, Address* addr, uint8_t* buf, int len, int maxtimes) {
-  int ret = -1;
-  int i = 0;
-  for (i = 0; i < maxtimes; i++) {
-    if ((ret = agent_socket_recv(agent, addr, buf, len)) != 0) {
-      break;
-    }
+static void agent_turn_process_refresh(Agent* agent, AgentIceServer* server, StunMessage* msg) {
+  uint32_t now = ports_get_epoch_time();
+
+  if (agent_turn_stale_nonce(server, msg)) {
+    agent_turn_start_refresh(agent, server);
+    return;
   }
-  return ret;
-}
 
-static int agent_socket_send(Agent* agent, Address* addr, const uint8_t* buf, int len) {
-  switch (addr->family) {
-    case AF_INET6:
-      return udp_socket_sendto(&agent->udp_sockets[1], addr, buf, len);
-    case AF_INET:
-    default:
-      return udp_socket_sendto(&agent->udp_sockets[0], addr, buf, len);
+  server->method = 0;
+  if (msg->stunclass == STUN_CLASS_ERROR) {
+    LOGW("TURN Refresh rejected: %d", msg->error_code);
+    server->next_send_time = now + AGENT_TURN_RETRY_INTERVAL;
+    return;
   }
-  return -1;
+  server->next_send_time = now + agent_turn_refresh_interval(msg->lifetime);
 }
 
-static int agent_create_host_addr(Agent* agent) {
+static int agent_turn_process_response(Agent* agent, StunMessage* msg) {
   int i, j;
-  const char* iface_prefx[] = {CONFIG_IFACE_PREFIX};
-  IceCandidate* ice_candidate;
-  int addr_type[] = { AF_INET,
-#if CONFIG_IPV6
-                      AF_INET6,
-#endif
-  };
+  AgentIceServer* server;
+  StunHeader* header = (StunHeader*)msg->buf;
 
-  for (i = 0; i < sizeof(addr_type) / sizeof(addr_type[0]); i++) {
-    for (j = 0; j < sizeof(iface_prefx) / sizeof(iface_prefx[0]); j++) {
-      ice_candidate = agent->local_candidates + agent->local_candidates_count;
-      // only copy port and family to addr of ice candidate
-      ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST,
-                           &agent->udp_sockets[i].bind_addr);
-      // if resolve host addr, add to local candidate
-      if (ports_get_host_addr(&ice_candidate->addr, iface_prefx[j])) {
-        agent->local_candidates_count++;
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    server = &agent->ice_servers[i];
+    if (server->type != AGENT_ICE_SERVER_TURN || server->state != AGENT_ICE_SERVER_DONE) {
+      continue;
+    }
+    if (server->method != 0 && memcmp(server->transaction_id, header->transaction_id, sizeof(server->transaction_id)) == 0) {
+      agent_turn_process_refresh(agent, server, msg);
+      return 1;
+    }
+    for (j = 0; j < server->peers_num; j++) {
+      if (server->peers[j].method != 0 &&
+          memcmp(server->peers[j].transaction_id, header->transaction_id, sizeof(server->peers[j].transaction_id)) == 0) {
+        agent_turn_process_peer_response(agent, server, &server->peers[j], msg);
+        return 1;
       }
     }
   }
-
   return 0;
 }
 
-static int agent_create_stun_addr(Agent* agent, Address* serv_addr) {
-  int ret = -1;
-  Address bind_addr;
-  StunMessage send_msg;
-  StunMessage recv_msg;
-  memset(&send_msg, 0, sizeof(send_msg));
-  memset(&recv_msg, 0, sizeof(recv_msg));
+static void agent_turn_update_peer(Agent* agent, AgentIceServer* server, AgentTurnPeer* peer, uint32_t now) {
+  if (peer->state == AGENT_TURN_PEER_FAILED || (int32_t)(now - peer->next_send_time) < 0) {
+    return;
+  }
 
-  stun_msg_create(&send_msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+  if (peer->method == 0) {
+    // a channel binding refreshes the permission as well
+    agent_turn_start_peer_request(agent, server, peer,
+                                  peer->state == AGENT_TURN_PEER_BOUND ? STUN_METHOD_CHANNEL_BIND : STUN_METHOD_CREATE_PERMISSION);
+  } else if (peer->transmissions < AGENT_STUN_MAX_TRANSMISSIONS) {
+    agent_turn_send_peer_request(agent, server, peer, now);
+  } else {
+    agent_turn_peer_failed(peer, now);
+  }
+}
 
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
+void agent_update_turn(Agent* agent) {
+  int i, j;
+  uint32_t now = ports_get_epoch_time();
+  AgentIceServer* server;
 
-  if (ret == -1) {
-    LOGE("Failed to send STUN Binding Request.");
-    return ret;
-  }
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    server = &agent->ice_servers[i];
+    if (server->type != AGENT_ICE_SERVER_TURN || server->state != AGENT_ICE_SERVER_DONE) {
+      continue;
+    }
 
-  ret = agent_socket_recv_attempts(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf), AGENT_STUN_RECV_MAXTIMES);
-  if (ret <= 0) {
-    LOGD("Failed to receive STUN Binding Response.");
-    return ret;
-  }
+    if ((int32_t)(now - server->next_send_time) >= 0) {
+      if (server->method == 0) {
+        agent_turn_start_refresh(agent, server);
+      } else if (server->transmissions < AGENT_STUN_MAX_TRANSMISSIONS) {
+        agent_turn_send_refresh(agent, server, now);
+      } else {
+        LOGW("TURN Refresh timed out.");
+        server->method = 0;
+        server->next_send_time = now + AGENT_TURN_RETRY_INTERVAL;
+      }
+    }
 
-  stun_parse_msg_buf(&recv_msg);
-  memcpy(&bind_addr, &recv_msg.mapped_addr, sizeof(Address));
-  IceCandidate* ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-  ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_SRFLX, &bind_addr);
-  return ret;
+    for (j = 0; j < server->peers_num; j++) {
+      agent_turn_update_peer(agent, server, &server->peers[j], now);
+    }
+  }
 }
 
-static int agent_create_turn_addr(Agent* agent, Address* serv_addr, const char* username, const char* credential) {
-  int ret = -1;
-  uint32_t attr = ntohl(0x11000000);
-  Address turn_addr;
-  StunMessage send_msg;
-  StunMessage recv_msg;
-  memset(&recv_msg, 0, sizeof(recv_msg));
-  memset(&send_msg, 0, sizeof(send_msg));
-  stun_msg_create(&send_msg, STUN_METHOD_ALLOCATE);
-  stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr);  // UDP
-  stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_USERNAME, strlen(username), (char*)username);
-
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
-  if (ret == -1) {
-    LOGE("Failed to send TURN Binding Request.");
-    return -1;
-  }
+void agent_clear_ice_servers(Agent* agent) {
+  int i;
+  uint32_t transaction_id[3];
 
-  ret = agent_socket_recv_attempts(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf), AGENT_STUN_RECV_MAXTIMES);
-  if (ret <= 0) {
-    LOGD("Failed to receive STUN Binding Response.");
-    return ret;
+  for (i = 0; i < agent->ice_servers_num; i++) {
+    if (agent->ice_servers[i].type == AGENT_ICE_SERVER_TURN && agent->ice_servers[i].state == AGENT_ICE_SERVER_DONE) {
+      // a zero lifetime deletes the allocation, nobody waits for the answer
+      agent_new_transaction_id(transaction_id);
+      agent_send_turn_request(agent, &agent->ice_servers[i], STUN_METHOD_REFRESH, transaction_id, NULL, 0);
+    }
+#if CONFIG_TURN_TCP
+    agent_stream_close(&agent->ice_servers[i]);
+#endif
+    utils_hmac_sha1_free(&agent->ice_servers[i].key);
   }
+  agent->ice_servers_num = 0;
+}
 
-  stun_parse_msg_buf(&recv_msg);
-
-  if (recv_msg.stunclass == STUN_CLASS_ERROR && recv_msg.stunmethod == STUN_METHOD_ALLOCATE) {
-    memset(&send_msg, 0, sizeof(send_msg));
-    stun_msg_create(&send_msg, STUN_METHOD_ALLOCATE);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr);  // UDP
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_USERNAME, strlen(username), (char*)username);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_NONCE, strlen(recv_msg.nonce), recv_msg.nonce);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REALM, strlen(recv_msg.realm), recv_msg.realm);
-    stun_msg_finish(&send_msg, STUN_CREDENTIAL_LONG_TERM, credential, strlen(credential));
-  } else {
-    LOGE("Invalid TURN Binding Response.");
-    return -1;
+static int agent_turn_send(Agent* agent, AgentIceServer* server, Address* addr, const uint8_t* buf, int len) {
+  uint8_t packet[AGENT_TURN_PACKET_SIZE];
+  uint8_t mask[16];
+  int size = sizeof(StunHeader);
+  int padded = 4 * ((len + 3) / 4);
+  StunHeader* header = (StunHeader*)packet;
+  StunAttribute* attr;
+  AgentTurnPeer* peer = agent_turn_find_peer(server, addr);
+
+  if (peer && peer->state == AGENT_TURN_PEER_BOUND) {
+    // ChannelData costs 4 bytes against 36 or more for a Send indication, it is only padded on a stream
+    size = AGENT_TURN_CHANNEL_HEADER + (server->transport == AGENT_ICE_SERVER_UDP ? len : padded);
+    if (size > sizeof(packet)) {
+      return -1;
+    }
+    *(uint16_t*)packet = htons(peer->channel);
+    *(uint16_t*)(packet + 2) = htons(len);
+    memcpy(packet + AGENT_TURN_CHANNEL_HEADER, buf, len);
+    memset(packet + AGENT_TURN_CHANNEL_HEADER + len, 0, size - AGENT_TURN_CHANNEL_HEADER - len);
+    return agent_server_send(agent, server, packet, size) < 0 ? -1 : len;
   }
 
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
-  if (ret < 0) {
-    LOGE("Failed to send TURN Binding Request.");
-    return -1;
+  if (peer == NULL || peer->state == AGENT_TURN_PEER_PERMISSION_PENDING || peer->state == AGENT_TURN_PEER_FAILED) {
+    if ((peer = agent_turn_find_permission(server, addr)) == NULL) {
+      return -1;
+    }
   }
 
-  agent_socket_recv_attempts(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf), AGENT_STUN_RECV_MAXTIMES);
-  if (ret <= 0) {
-    LOGD("Failed to receive TURN Binding Response.");
-    return ret;
+  // XOR-PEER-ADDRESS takes at most 24 bytes, DATA 4 plus the padded payload
+  if (size + 24 + sizeof(StunAttribute) + padded > sizeof(packet)) {
+    return -1;
   }
 
-  stun_parse_msg_buf(&recv_msg);
-  memcpy(&turn_addr, &recv_msg.relayed_addr, sizeof(Address));
-  IceCandidate* ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-  ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_RELAY, &turn_addr);
-  return ret;
+  header->type = htons(STUN_CLASS_INDICATION | STUN_METHOD_SEND);
+  header->magic_cookie = htonl(MAGIC_COOKIE);
+  agent_new_transaction_id(header->transaction_id);
+  *((uint32_t*)mask) = htonl(MAGIC_COOKIE);
+  memcpy(mask + 4, header->transaction_id, sizeof(header->transaction_id));
+
+  attr = (StunAttribute*)(packet + size);
+  attr->type = htons(STUN_ATTR_TYPE_XOR_PEER_ADDRESS);
+  attr->value[0] = 0;
+  attr->length = htons(stun_set_mapped_address(attr->value, mask, addr));
+  size += sizeof(StunAttribute) + ntohs(attr->length);
+
+  attr = (StunAttribute*)(packet + size);
+  attr->type = htons(STUN_ATTR_TYPE_DATA);
+  attr->length = htons(len);
+  memcpy(attr->value, buf, len);
+  memset(attr->value + len, 0, padded - len);
+  size += sizeof(StunAttribute) + padded;
+
+  header->length = htons(size - sizeof(StunHeader));
+  return agent_server_send(agent, server, packet, size) < 0 ? -1 : len;
 }
 
-void agent_gather_candidate(Agent* agent, const char* urls, const char* username, const char* credential) {
-  char* pos;
-  int port;
-  char hostname[64];
-  char addr_string[ADDRSTRLEN];
-  int i;
-  int addr_type[1] = {AF_INET};  // ipv6 no need stun
-  Address resolved_addr;
-  memset(hostname, 0, sizeof(hostname));
-
-  if (urls == NULL) {
-    agent_create_host_addr(agent);
-    return;
+static int agent_turn_unwrap(AgentIceServer* server, Address* addr, uint8_t* buf, int len) {
+  uint16_t length;
+  uint8_t mask[16];
+  uint8_t* value;
+  AgentTurnPeer* peer;
+  StunHeader* header = (StunHeader*)buf;
+
+  // ChannelData, the first two bits of a channel number are 01
+  if (len >= AGENT_TURN_CHANNEL_HEADER && (buf[0] & 0xc0) == 0x40) {
+    length = ntohs(*(uint16_t*)(buf + 2));
+    if ((peer = agent_turn_find_channel(server, ntohs(*(uint16_t*)buf))) == NULL ||
+        length + AGENT_TURN_CHANNEL_HEADER > len) {
+      return 0;
+    }
+    memcpy(addr, &peer->addr, sizeof(Address));
+    memmove(buf, buf + AGENT_TURN_CHANNEL_HEADER, length);
+    return length;
   }
 
-  if ((pos = strstr(urls + 5, ":")) == NULL) {
-    LOGE("Invalid URL");
-    return;
+  if (stun_probe(buf, len) != 0 || ntohs(header->type) != (STUN_CLASS_INDICATION | STUN_METHOD_DATA)) {
+    return -1;
   }
 
-  port = atoi(pos + 1);
-  if (port <= 0) {
-    LOGE("Cannot parse port");
-    return;
+  if ((value = stun_msg_find_attr(buf, len, STUN_ATTR_TYPE_XOR_PEER_ADDRESS, &length)) == NULL ||
+      length < (value[1] == STUN_FAMILY_IPV6 ? 20 : 8)) {
+    return 0;
   }
+  *((uint32_t*)mask) = htonl(MAGIC_COOKIE);
+  memcpy(mask + 4, header->transaction_id, sizeof(header->transaction_id));
+  stun_get_mapped_address((char*)value, mask, addr);
 
-  snprintf(hostname, pos - urls - 5 + 1, "%s", urls + 5);
-
-  for (i = 0; i < sizeof(addr_type) / sizeof(addr_type[0]); i++) {
-    if (ports_resolve_addr(hostname, &resolved_addr) == 0) {
-      addr_set_port(&resolved_addr, port);
-      addr_to_string(&resolved_addr, addr_string, sizeof(addr_string));
-      LOGI("Resolved stun/turn server %s:%d", addr_string, port);
-
-      if (strncmp(urls, "stun:", 5) == 0) {
-        LOGD("Create stun addr");
-        agent_create_stun_addr(agent, &resolved_addr);
-      } else if (strncmp(urls, "turn:", 5) == 0) {
-        LOGD("Create turn addr");
-        agent_create_turn_addr(agent, &resolved_addr, username, credential);
-      }
-    }
+  if ((value = stun_msg_find_attr(buf, len, STUN_ATTR_TYPE_DATA, &length)) == NULL) {
+    return 0;
   }
+  memmove(buf, value, length);
+  return length;
 }
 
 void agent_create_ice_credential(Agent* agent) {
@@ -287,6 +1126,11 @@ void agent_create_ice_credential(Agent* agent) {
 
   utils_random_string(agent->local_ufrag, 4);
   utils_random_string(agent->local_upwd, 24);
+  // RFC 8445 7.1.3, one value for the session, never 0
+  do {
+    utils_random(NULL, (unsigned char*)&agent->tie_breaker, sizeof(agent->tie_breaker));
+  } while (agent->tie_breaker == 0);
+  stun_key_init(&agent->local_key, STUN_CREDENTIAL_SHORT_TERM, NULL, NULL, agent->local_upwd);
 }
 
 void agent_get_local_description(Agent* agent, char* description, int length) {
@@ -299,8 +1143,42 @@ void agent_get_local_description(Agent* agent, char* description, int length) {
   LOGD("local description:\n%s", description);
 }
 
+static int agent_send_to_pair(Agent* agent, IceCandidatePair* pair, const uint8_t* buf, int len) {
+  AgentIceServer* server;
+
+  if (pair->local->type != ICE_CANDIDATE_TYPE_RELAY) {
+    return agent_socket_send(agent, &pair->remote->addr, buf, len);
+  }
+
+  if ((server = agent_turn_find_relay(agent, pair->local)) == NULL) {
+    return -1;
+  }
+  return agent_turn_send(agent, server, &pair->remote->addr, buf, len);
+}
+
 int agent_send(Agent* agent, const uint8_t* buf, int len) {
-  return agent_socket_send(agent, &agent->nominated_pair->remote->addr, buf, len);
+  // none between an ICE restart and its checks
+  if (agent->selected_pair == NULL) {
+    return -1;
+  }
+  return agent_send_to_pair(agent, agent->selected_pair, buf, len);
+}
+
+int agent_send_batch(Agent* agent, const uint8_t** bufs, const int* lens, int count) {
+  IceCandidatePair* pair = agent->selected_pair;
+  int sent = 0;
+
+  if (pair == NULL) {
+    return -1;
+  } else if (pair->local->type != ICE_CANDIDATE_TYPE_RELAY) {
+    return udp_socket_sendto_batch(agent_socket_for(agent, &pair->remote->addr), &pair->remote->addr, bufs, lens, count);
+  }
+
+  // TURN wraps each packet on its own
+  while (sent < count && agent_send_to_pair(agent, pair, bufs[sent], lens[sent]) >= 0) {
+    sent++;
+  }
+  return sent > 0 ? sent : -1;
 }
 
 static void agent_create_binding_response(Agent* agent, StunMessage* msg, Address* addr) {
@@ -318,40 +1196,141 @@ static void agent_create_binding_response(Agent* agent, StunMessage* msg, Addres
   size = stun_set_mapped_address(mapped_address, mask, addr);
   stun_msg_write_attr(msg, STUN_ATTR_TYPE_XOR_MAPPED_ADDRESS, size, mapped_address);
   stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(username), username);
-  stun_msg_finish(msg, STUN_CREDENTIAL_SHORT_TERM, agent->local_upwd, strlen(agent->local_upwd));
+  stun_msg_finish(msg, &agent->local_key);
 }
 
-static void agent_create_binding_request(Agent* agent, StunMessage* msg) {
-  // Generate random tie-breaker (RFC 8445 requires 64-bit random value)
-  uint64_t tie_breaker = ((uint64_t)rand() << 32) | (uint64_t)rand();
-  if (tie_breaker == 0) tie_breaker = 1;  // Avoid zero value
+static void agent_create_binding_request(Agent* agent, IceCandidatePair* pair, StunMessage* msg) {
+  uint64_t tie_breaker = agent->tie_breaker;
+  uint32_t priority = htonl(ice_candidate_get_prflx_priority(pair->local));
+  StunHeader* header;
   // send binding request
   stun_msg_create(msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+  // retransmissions reuse the transaction ID so a late response still matches the pair
+  header = (StunHeader*)msg->buf;
+  memcpy(header->transaction_id, pair->transaction_id, sizeof(header->transaction_id));
   char username[584];
   memset(username, 0, sizeof(username));
   snprintf(username, sizeof(username), "%s:%s", agent->remote_ufrag, agent->local_ufrag);
   stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(username), username);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_PRIORITY, 4, (char*)&agent->nominated_pair->priority);
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_PRIORITY, 4, (char*)&priority);
   if (agent->mode == AGENT_MODE_CONTROLLING) {
     stun_msg_write_attr(msg, STUN_ATTR_TYPE_USE_CANDIDATE, 0, NULL);
     stun_msg_write_attr(msg, STUN_ATTR_TYPE_ICE_CONTROLLING, 8, (char*)&tie_breaker);
   } else {
     stun_msg_write_attr(msg, STUN_ATTR_TYPE_ICE_CONTROLLED, 8, (char*)&tie_breaker);
   }
-  stun_msg_finish(msg, STUN_CREDENTIAL_SHORT_TERM, agent->remote_upwd, strlen(agent->remote_upwd));
+  stun_msg_finish(msg, &agent->remote_key);
+}
+
+static IceCandidatePair* agent_find_pair_by_remote(Agent* agent, Address* addr, AgentIceServer* relay) {
+  int i;
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (addr_equal(&agent->candidate_pairs[i].remote->addr, addr) &&
+        agent_turn_find_relay(agent, agent->candidate_pairs[i].local) == relay) {
+      return &agent->candidate_pairs[i];
+    }
+  }
+  return NULL;
+}
+
+static IceCandidatePair* agent_find_pair_by_transaction(Agent* agent, uint32_t* transaction_id) {
+  int i;
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].conncheck > 0 &&
+        memcmp(agent->candidate_pairs[i].transaction_id, transaction_id, sizeof(agent->candidate_pairs[i].transaction_id)) == 0) {
+      return &agent->candidate_pairs[i];
+    }
+  }
+  return NULL;
+}
+
+static void agent_unfreeze_foundation(Agent* agent, IceCandidatePair* pair) {
+  int i;
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FROZEN &&
+        strcmp(agent->candidate_pairs[i].local->foundation, pair->local->foundation) == 0 &&
+        strcmp(agent->candidate_pairs[i].remote->foundation, pair->remote->foundation) == 0) {
+      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_WAITING;
+    }
+  }
+}
+
+static IceCandidatePair* agent_add_prflx_pair(Agent* agent, Address* addr) {
+  int i;
+  IceCandidate* remote;
+  IceCandidatePair* pair;
+
+  if (agent->remote_candidates_count >= AGENT_MAX_CANDIDATES || agent->candidate_pairs_num >= AGENT_MAX_CANDIDATE_PAIRS) {
+    return NULL;
+  }
+
+  for (i = 0; i < agent->local_candidates_count; i++) {
+    if (agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_HOST && agent->local_candidates[i].addr.family == addr->family) {
+      break;
+    }
+  }
+
+  if (i == agent->local_candidates_count) {
+    return NULL;
+  }
+
+  // RFC 8445 7.3.1.3, a request from an address nobody signaled is a peer reflexive candidate
+  remote = &agent->remote_candidates[agent->remote_candidates_count++];
+  ice_candidate_create(remote, agent->remote_candidates_count, ICE_CANDIDATE_TYPE_PRFLX, addr);
+  pair = &agent->candidate_pairs[agent->candidate_pairs_num++];
+  ice_candidate_pair_create(pair, &agent->local_candidates[i], remote, agent->mode == AGENT_MODE_CONTROLLING);
+  return pair;
+}
+
+static void agent_lite_process_request(Agent* agent, StunMessage* stun_msg, Address* addr) {
+  uint16_t length;
+  IceCandidatePair* pair;
+
+  agent->last_check_time = ports_get_epoch_time();
+
+  // the first nomination wins, a lite agent has no checks of its own to compare it with
+  if (agent->nominated_pair != NULL ||
+      stun_msg_find_attr(stun_msg->buf, stun_msg->size, STUN_ATTR_TYPE_USE_CANDIDATE, &length) == NULL) {
+    return;
+  }
+
+  if ((pair = agent_find_pair_by_remote(agent, addr, NULL)) == NULL && (pair = agent_add_prflx_pair(agent, addr)) == NULL) {
+    LOGW("No room for a nominated pair");
+    return;
+  }
+
+  pair->state = ICE_CANDIDATE_STATE_SUCCEEDED;
+  agent->selected_pair = pair;
+  agent->nominated_pair = pair;
 }
 
-void agent_process_stun_request(Agent* agent, StunMessage* stun_msg, Address* addr) {
+void agent_process_stun_request(Agent* agent, StunMessage* stun_msg, Address* addr, AgentIceServer* relay) {
   StunMessage msg;
   StunHeader* header;
+  IceCandidatePair* pair;
   switch (stun_msg->stunmethod) {
     case STUN_METHOD_BINDING:
-      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, agent->local_upwd) == 0) {
+      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, &agent->local_key) == 0) {
         header = (StunHeader*)stun_msg->buf;
         memcpy(agent->transaction_id, header->transaction_id, sizeof(header->transaction_id));
         agent_create_binding_response(agent, &msg, addr);
-        agent_socket_send(agent, addr, msg.buf, msg.size);
+        if (relay) {
+          agent_turn_send(agent, relay, addr, msg.buf, msg.size);
+        } else {
+          agent_socket_send(agent, addr, msg.buf, msg.size);
+        }
         agent->binding_request_time = ports_get_epoch_time();
+
+        if (agent->lite) {
+          agent_lite_process_request(agent, stun_msg, addr);
+          break;
+        }
+
+        // triggered check, the remote side just proved this path works towards us
+        pair = agent_find_pair_by_remote(agent, addr, relay);
+        if (pair && (pair->state == ICE_CANDIDATE_STATE_FROZEN || pair->state == ICE_CANDIDATE_STATE_FAILED)) {
+          pair->state = ICE_CANDIDATE_STATE_WAITING;
+        }
       }
       break;
     default:
@@ -359,11 +1338,38 @@ void agent_process_stun_request(Agent* agent, StunMessage* stun_msg, Address* ad
   }
 }
 
-void agent_process_stun_response(Agent* agent, StunMessage* stun_msg) {
+void agent_process_stun_response(Agent* agent, StunMessage* stun_msg, Address* addr, AgentIceServer* relay) {
+  StunHeader* header = (StunHeader*)stun_msg->buf;
+  IceCandidatePair* pair;
+  AgentIceServer* server;
+
+  if ((server = agent_find_server_by_transaction(agent, header->transaction_id)) != NULL) {
+    agent_process_server_response(agent, server, stun_msg);
+    return;
+  }
+
+  if (agent_turn_process_response(agent, stun_msg)) {
+    return;
+  }
+
+  if (stun_msg->stunclass != STUN_CLASS_RESPONSE) {
+    return;
+  }
+
   switch (stun_msg->stunmethod) {
     case STUN_METHOD_BINDING:
-      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, agent->remote_upwd) == 0) {
-        agent->nominated_pair->state = ICE_CANDIDATE_STATE_SUCCEEDED;
+      pair = agent_find_pair_by_transaction(agent, header->transaction_id);
+      if (pair == NULL || pair->state != ICE_CANDIDATE_STATE_INPROGRESS) {
+        break;
+      }
+      // RFC 8445 7.2.5.2.1, the response must come back from where the request went
+      if (!addr_equal(&pair->remote->addr, addr) || agent_turn_find_relay(agent, pair->local) != relay) {
+        LOGW("Drop non-symmetric binding response");
+        break;
+      }
+      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, &agent->remote_key) == 0) {
+        pair->state = ICE_CANDIDATE_STATE_SUCCEEDED;
+        agent_unfreeze_foundation(agent, pair);
       }
       break;
     default:
@@ -373,20 +1379,37 @@ void agent_process_stun_response(Agent* agent, StunMessage* stun_msg) {
 
 int agent_recv(Agent* agent, uint8_t* buf, int len) {
   int ret = -1;
+  int size;
   StunMessage stun_msg;
   Address addr;
-  if ((ret = agent_socket_recv(agent, &addr, buf, len)) > 0 && stun_probe(buf, len) == 0) {
-    memcpy(stun_msg.buf, buf, ret);
-    stun_msg.size = ret;
-    stun_parse_msg_buf(&stun_msg);
+  AgentIceServer* relay = NULL;
+
+  if ((ret = agent_socket_recv(agent, &addr, buf, len, &relay)) <= 0) {
+    return ret;
+  }
+
+  // relayed packets come wrapped from the TURN server, anything else it sends is an answer to our requests
+  if (relay == NULL) {
+    relay = agent_turn_find_server(agent, &addr);
+  }
+  if (relay && relay->state == AGENT_ICE_SERVER_DONE && (size = agent_turn_unwrap(relay, &addr, buf, ret)) >= 0) {
+    ret = size;
+  } else {
+    relay = NULL;
+  }
+
+  if (ret > 0 && stun_probe(buf, ret) == 0) {
+    if (stun_msg_parse(&stun_msg, buf, ret) != 0) {
+      LOGW("Drop malformed STUN message: %d", ret);
+      return 0;
+    }
     switch (stun_msg.stunclass) {
       case STUN_CLASS_REQUEST:
-        agent_process_stun_request(agent, &stun_msg, &addr);
+        agent_process_stun_request(agent, &stun_msg, &addr, relay);
         break;
       case STUN_CLASS_RESPONSE:
-        agent_process_stun_response(agent, &stun_msg);
-        break;
       case STUN_CLASS_ERROR:
+        agent_process_stun_response(agent, &stun_msg, &addr, relay);
         break;
       default:
         break;
@@ -411,9 +1434,12 @@ void agent_set_remote_description(Agent* agent, char* description) {
 
   while ((line_end = strstr(line_start, "\r\n")) != NULL) {
     if (strncmp(line_start, "a=ice-ufrag:", strlen("a=ice-ufrag:")) == 0) {
+      // an ICE restart may bring shorter credentials
+      memset(agent->remote_ufrag, 0, sizeof(agent->remote_ufrag));
       strncpy(agent->remote_ufrag, line_start + strlen("a=ice-ufrag:"), line_end - line_start - strlen("a=ice-ufrag:"));
 
     } else if (strncmp(line_start, "a=ice-pwd:", strlen("a=ice-pwd:")) == 0) {
+      memset(agent->remote_upwd, 0, sizeof(agent->remote_upwd));
       strncpy(agent->remote_upwd, line_start + strlen("a=ice-pwd:"), line_end - line_start - strlen("a=ice-pwd:"));
 
     } else if (strncmp(line_start, "a=candidate:", strlen("a=candidate:")) == 0) {
@@ -434,48 +1460,152 @@ void agent_set_remote_description(Agent* agent, char* description) {
 
   LOGD("remote ufrag: %s", agent->remote_ufrag);
   LOGD("remote upwd: %s", agent->remote_upwd);
+  stun_key_init(&agent->remote_key, STUN_CREDENTIAL_SHORT_TERM, NULL, NULL, agent->remote_upwd);
+}
+
+static int agent_has_candidate_pair(Agent* agent, IceCandidate* local, IceCandidate* remote) {
+  int i;
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].local == local && agent->candidate_pairs[i].remote == remote) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static IceCandidateState agent_initial_pair_state(Agent* agent, IceCandidatePair* pair) {
+  int i;
+  // the first pair of each foundation starts waiting, the rest stay frozen until it succeeds
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state != ICE_CANDIDATE_STATE_FAILED &&
+        strcmp(agent->candidate_pairs[i].local->foundation, pair->local->foundation) == 0 &&
+        strcmp(agent->candidate_pairs[i].remote->foundation, pair->remote->foundation) == 0) {
+      return ICE_CANDIDATE_STATE_FROZEN;
+    }
+  }
+  return ICE_CANDIDATE_STATE_WAITING;
 }
 
 void agent_update_candidate_pairs(Agent* agent) {
   int i, j;
-  // Please set gather candidates before set remote description
+  IceCandidatePair* pair;
+  AgentIceServer* relay;
+
+  if (agent->candidate_pairs_num == 0) {
+    // first check goes out right away, the checklist timeout counts from here
+    agent->last_check_time = ports_get_epoch_time() - AGENT_CONNCHECK_TA;
+  }
+
+  // pairs only get appended, candidates may trickle in while checks are running
   for (i = 0; i < agent->local_candidates_count; i++) {
+    // a server reflexive candidate shares its socket with the host candidate, checking both is redundant
+    if (agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_SRFLX) {
+      continue;
+    }
+    relay = agent_turn_find_relay(agent, &agent->local_candidates[i]);
+    if (agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_RELAY && relay == NULL) {
+      continue;
+    }
     for (j = 0; j < agent->remote_candidates_count; j++) {
-      if (agent->local_candidates[i].addr.family == agent->remote_candidates[j].addr.family) {
-        agent->candidate_pairs[agent->candidate_pairs_num].local = &agent->local_candidates[i];
-        agent->candidate_pairs[agent->candidate_pairs_num].remote = &agent->remote_candidates[j];
-        agent->candidate_pairs[agent->candidate_pairs_num].priority = agent->local_candidates[i].priority + agent->remote_candidates[j].priority;
-        agent->candidate_pairs[agent->candidate_pairs_num].state = ICE_CANDIDATE_STATE_FROZEN;
-        agent->candidate_pairs_num++;
+      if (agent->candidate_pairs_num >= AGENT_MAX_CANDIDATE_PAIRS) {
+        LOGW("Too many candidate pairs");
+        return;
+      }
+      if (agent->local_candidates[i].addr.family != agent->remote_candidates[j].addr.family ||
+          agent_has_candidate_pair(agent, &agent->local_candidates[i], &agent->remote_candidates[j])) {
+        continue;
+      }
+      pair = &agent->candidate_pairs[agent->candidate_pairs_num];
+      ice_candidate_pair_create(pair, &agent->local_candidates[i], &agent->remote_candidates[j],
+                                agent->mode == AGENT_MODE_CONTROLLING);
+      pair->state = agent_initial_pair_state(agent, pair);
+      agent->candidate_pairs_num++;
+      // the server drops anything from a peer without a permission, checks included
+      if (relay) {
+        agent_turn_add_peer(agent, relay, &pair->remote->addr);
       }
     }
   }
   LOGD("candidate pairs num: %d", agent->candidate_pairs_num);
 }
 
-int agent_connectivity_check(Agent* agent) {
+static void agent_send_check(Agent* agent, IceCandidatePair* pair, uint32_t now) {
   char addr_string[ADDRSTRLEN];
-  uint8_t buf[1400];
   StunMessage msg;
+  uint32_t rto = AGENT_CONNCHECK_RTO << (pair->conncheck < 4 ? pair->conncheck : 4);
 
-  if (agent->nominated_pair->state != ICE_CANDIDATE_STATE_INPROGRESS) {
-    LOGI("nominated pair is not in progress");
-    return -1;
+  memset(&msg, 0, sizeof(msg));
+  addr_to_string(&pair->remote->addr, addr_string, sizeof(addr_string));
+  LOGD("send binding request to remote ip: %s, port: %d", addr_string, pair->remote->addr.port);
+  agent_create_binding_request(agent, pair, &msg);
+  agent_send_to_pair(agent, pair, msg.buf, msg.size);
+
+  pair->conncheck++;
+  pair->next_check_time = now + (rto < AGENT_CONNCHECK_MAX_RTO ? rto : AGENT_CONNCHECK_MAX_RTO);
+}
+
+static IceCandidatePair* agent_find_best_pair(Agent* agent, IceCandidateState state) {
+  int i;
+  IceCandidatePair* best = NULL;
+  // the check list is not kept sorted, pointers to pairs must stay valid while candidates trickle in
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state == state && (best == NULL || agent->candidate_pairs[i].priority > best->priority)) {
+      best = &agent->candidate_pairs[i];
+    }
   }
+  return best;
+}
 
-  memset(&msg, 0, sizeof(msg));
+static IceCandidatePair* agent_next_check(Agent* agent) {
+  IceCandidatePair* pair = agent_find_best_pair(agent, ICE_CANDIDATE_STATE_WAITING);
+  if (pair == NULL) {
+    pair = agent_find_best_pair(agent, ICE_CANDIDATE_STATE_FROZEN);
+  }
+  return pair;
+}
+
+int agent_connectivity_check(Agent* agent) {
+  int i;
+  uint8_t buf[1400];
+  uint32_t now = ports_get_epoch_time();
+  IceCandidatePair* pair;
+  AgentIceServer* relay;
+
+  if (agent->lite) {
+    // requests are answered and nominations taken in agent_recv
+    agent_recv(agent, buf, sizeof(buf));
+    return agent->nominated_pair ? 0 : -1;
+  }
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    pair = &agent->candidate_pairs[i];
+    if (pair->state != ICE_CANDIDATE_STATE_INPROGRESS || (int32_t)(now - pair->next_check_time) < 0) {
+      continue;
+    }
+    if (pair->conncheck >= AGENT_CONNCHECK_MAX) {
+      pair->state = ICE_CANDIDATE_STATE_FAILED;
+      continue;
+    }
+    agent_send_check(agent, pair, now);
+  }
 
-  if (agent->nominated_pair->conncheck % AGENT_CONNCHECK_PERIOD == 0) {
-    addr_to_string(&agent->nominated_pair->remote->addr, addr_string, sizeof(addr_string));
-    LOGD("send binding request to remote ip: %s, port: %d", addr_string, agent->nominated_pair->remote->addr.port);
-    agent_create_binding_request(agent, &msg);
-    agent_socket_send(agent, &agent->nominated_pair->remote->addr, msg.buf, msg.size);
+  if (now - agent->last_check_time >= AGENT_CONNCHECK_TA && (pair = agent_next_check(agent)) != NULL) {
+    agent_new_transaction_id(pair->transaction_id);
+    pair->conncheck = 0;
+    pair->state = ICE_CANDIDATE_STATE_INPROGRESS;
+    agent_send_check(agent, pair, now);
+    agent->last_check_time = now;
   }
 
   agent_recv(agent, buf, sizeof(buf));
 
-  if (agent->nominated_pair->state == ICE_CANDIDATE_STATE_SUCCEEDED) {
-    agent->selected_pair = agent->nominated_pair;
+  // take the best pair that works without waiting for slower paths
+  if ((pair = agent_find_best_pair(agent, ICE_CANDIDATE_STATE_SUCCEEDED)) != NULL) {
+    if ((relay = agent_turn_find_relay(agent, pair->local)) != NULL) {
+      agent_turn_bind_channel(agent, relay, &pair->remote->addr);
+    }
+    agent->selected_pair = pair;
+    agent->nominated_pair = pair;
     return 0;
   }
 
@@ -484,25 +1614,22 @@ int agent_connectivity_check(Agent* agent) {
 
 int agent_select_candidate_pair(Agent* agent) {
   int i;
+
+  if (agent->lite) {
+    return ports_get_epoch_time() - agent->last_check_time < AGENT_LITE_TIMEOUT ? 0 : -1;
+  }
   for (i = 0; i < agent->candidate_pairs_num; i++) {
-    if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FROZEN) {
-      // nominate this pair
-      agent->nominated_pair = &agent->candidate_pairs[i];
-      agent->candidate_pairs[i].conncheck = 0;
-      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_INPROGRESS;
-      return 0;
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_INPROGRESS) {
-      agent->candidate_pairs[i].conncheck++;
-      if (agent->candidate_pairs[i].conncheck < AGENT_CONNCHECK_MAX) {
-        return 0;
-      }
-      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_FAILED;
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FAILED) {
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_SUCCEEDED) {
-      agent->selected_pair = &agent->candidate_pairs[i];
+    if (agent->candidate_pairs[i].state != ICE_CANDIDATE_STATE_FAILED) {
       return 0;
     }
   }
+
+  // more candidates may still be gathered or trickled in
+  if (agent->state == AGENT_STATE_GATHERING_STARTED ||
+      ports_get_epoch_time() - agent->last_check_time < AGENT_CHECKLIST_TIMEOUT) {
+    return 0;
+  }
+
   // all candidate pairs are failed
   return -1;
 }
@@ -24,6 +24,14 @@
 #define AGENT_MAX_CANDIDATE_PAIRS 100
 #endif
 
+#ifndef AGENT_MAX_ICE_SERVERS
+#define AGENT_MAX_ICE_SERVERS 5
+#endif
+
+#ifndef AGENT_MAX_TURN_PEERS
+#define AGENT_MAX_TURN_PEERS 8
+#endif
+
 typedef enum AgentState {
 
   AGENT_STATE_GATHERING_ENDED = 0,
@@ -39,6 +47,79 @@ typedef enum AgentMode {
 
 } AgentMode;
 
+typedef enum AgentIceServerType {
+
+  AGENT_ICE_SERVER_STUN = 0,
+  AGENT_ICE_SERVER_TURN,
+
+} AgentIceServerType;
+
+typedef enum AgentIceServerTransport {
+
+  AGENT_ICE_SERVER_UDP = 0,
+  AGENT_ICE_SERVER_TCP,
+  AGENT_ICE_SERVER_TLS,
+
+} AgentIceServerTransport;
+
+typedef enum AgentIceServerState {
+
+  AGENT_ICE_SERVER_RESOLVING = 0,
+  AGENT_ICE_SERVER_CONNECTING,
+  AGENT_ICE_SERVER_INPROGRESS,
+  AGENT_ICE_SERVER_DONE,
+  AGENT_ICE_SERVER_FAILED,
+
+} AgentIceServerState;
+
+typedef enum AgentTurnPeerState {
+
+  AGENT_TURN_PEER_PERMISSION_PENDING = 0,
+  AGENT_TURN_PEER_PERMITTED,
+  AGENT_TURN_PEER_CHANNEL_PENDING,
+  AGENT_TURN_PEER_BOUND,
+  AGENT_TURN_PEER_FAILED,
+
+} AgentTurnPeerState;
+
+typedef struct AgentTurnPeer {
+  AgentTurnPeerState state;
+  Address addr;
+  uint16_t channel;
+  StunMethod method;  // request in flight, 0 when idle
+  uint32_t transaction_id[3];
+  int transmissions;
+  uint32_t next_send_time;  // next retransmission, or the next refresh when idle
+
+} AgentTurnPeer;
+
+// TCP/TLS connection to a TURN server, allocated only for stream transports
+typedef struct AgentIceServerStream AgentIceServerStream;
+
+typedef struct AgentIceServer {
+  AgentIceServerType type;
+  AgentIceServerTransport transport;
+  AgentIceServerState state;
+  char hostname[64];
+  uint16_t port;
+  Address addr;
+  char username[128];
+  char credential[128];
+  char realm[64];
+  char nonce[64];
+  UtilsHmacSha1 key;  // long-term MESSAGE-INTEGRITY key, derived whenever the realm changes
+  uint32_t transaction_id[3];
+  int transmissions;
+  uint32_t next_send_time;
+  // TURN allocation, the transaction fields above are reused for Refresh once it is DONE
+  Address relayed_addr;
+  StunMethod method;
+  AgentTurnPeer peers[AGENT_MAX_TURN_PEERS];
+  int peers_num;
+  AgentIceServerStream* stream;
+
+} AgentIceServer;
+
 typedef struct Agent Agent;
 
 struct Agent {
@@ -47,6 +128,11 @@ struct Agent {
 
   char local_ufrag[ICE_UFRAG_LENGTH + 1];
   char local_upwd[ICE_UPWD_LENGTH + 1];
+  uint64_t tie_breaker;
+
+  // MESSAGE-INTEGRITY keys, rebuilt whenever the passwords change
+  UtilsHmacSha1 local_key;
+  UtilsHmacSha1 remote_key;
 
   IceCandidate local_candidates[AGENT_MAX_CANDIDATES];
   IceCandidate remote_candidates[AGENT_MAX_CANDIDATES];
@@ -63,6 +149,9 @@ struct Agent {
 
   AgentMode mode;
 
+  AgentIceServer ice_servers[AGENT_MAX_ICE_SERVERS];
+  int ice_servers_num;
+
   IceCandidatePair candidate_pairs[AGENT_MAX_CANDIDATE_PAIRS];
   IceCandidatePair* selected_pair;
   IceCandidatePair* nominated_pair;
@@ -70,22 +159,56 @@ struct Agent {
   int candidate_pairs_num;
   int use_candidate;
   uint32_t transaction_id[3];
+  uint32_t last_check_time;
+  int lite;  // RFC 8445 ICE-lite, no checks of our own, the controlling agent nominates with USE-CANDIDATE
 };
 
+/**
+ * @brief add host candidates when urls is NULL, otherwise send the first request to the STUN/TURN server
+ */
 void agent_gather_candidate(Agent* agent, const char* urls, const char* username, const char* credential);
 
+/**
+ * @brief retransmit or time out pending server requests, responses are handled by agent_recv
+ */
+void agent_update_gathering(Agent* agent);
+
+/**
+ * @brief refresh TURN allocations, permissions and channel bindings before they expire
+ */
+void agent_update_turn(Agent* agent);
+
+/**
+ * @brief release TURN allocations and forget every ICE server
+ */
+void agent_clear_ice_servers(Agent* agent);
+
 void agent_create_ice_credential(Agent* agent);
 
 void agent_get_local_description(Agent* agent, char* description, int length);
 
 int agent_send(Agent* agent, const uint8_t* buf, int len);
 
+/**
+ * @brief send packets on the selected pair, batched into one system call when it is not relayed
+ * @return the number sent, -1 if none was
+ */
+int agent_send_batch(Agent* agent, const uint8_t** bufs, const int* lens, int count);
+
 int agent_recv(Agent* agent, uint8_t* buf, int len);
 
 void agent_set_remote_description(Agent* agent, char* description);
 
+/**
+ * @brief check the state of the check list
+ * @return -1 if every candidate pair failed, 0 otherwise
+ */
 int agent_select_candidate_pair(Agent* agent);
 
+/**
+ * @brief start the next check every Ta, retransmit pending checks and process responses
+ * @return 0 once a candidate pair succeeded and was selected
+ */
 int agent_connectivity_check(Agent* agent);
 
 void agent_clear_candidates(Agent* agent);
@@ -0,0 +1,324 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bwe.h"
+#include "rtcp.h"
+#include "utils.h"
+
+// packets sent within this time (ms) form one arrival group
+#define BWE_BURST_TIME 5
+#define BWE_SMOOTHING_COEF 0.9f
+#define BWE_THRESHOLD_GAIN 4.0f
+#define BWE_MAX_NUM_DELTAS 60
+// ms of sustained overuse before reacting
+#define BWE_OVERUSE_TIME 10.0f
+#define BWE_K_UP 0.0087f
+#define BWE_K_DOWN 0.039f
+#define BWE_MIN_THRESHOLD 6.0f
+#define BWE_MAX_THRESHOLD 600.0f
+#define BWE_BETA 0.85f
+// at most one decrease per interval (ms), roughly a round trip
+#define BWE_DECREASE_INTERVAL 200
+// increase additively for this long (ms) after a decrease, we are close to the capacity
+#define BWE_CONVERGENCE_TIME 2000
+// bps per second, about one packet per response time
+#define BWE_ADDITIVE_INCREASE 48000
+// us of arrivals per throughput sample
+#define BWE_ACKED_WINDOW 100000
+
+static float bwe_abs(float x) {
+  return x < 0 ? -x : x;
+}
+
+static uint32_t bwe_clamp(Bwe* bwe, uint32_t bitrate) {
+  if (bitrate < bwe->min_bitrate)
+    return bwe->min_bitrate;
+  if (bitrate > bwe->max_bitrate)
+    return bwe->max_bitrate;
+  return bitrate;
+}
+
+void bwe_init(Bwe* bwe, uint32_t start_bitrate, uint32_t min_bitrate, uint32_t max_bitrate) {
+  memset(bwe, 0, sizeof(Bwe));
+  bwe->min_bitrate = min_bitrate;
+  bwe->max_bitrate = max_bitrate;
+  bwe->delay_based_bitrate = bwe_clamp(bwe, start_bitrate);
+  bwe->loss_based_bitrate = bwe->delay_based_bitrate;
+  bwe->target_bitrate = bwe->delay_based_bitrate;
+  bwe->threshold = 12.5f;
+  bwe->time_over_using = -1;
+}
+
+uint16_t bwe_on_packet_sent(Bwe* bwe, size_t size, uint32_t now) {
+  BweSentPacket* sent = &bwe->history[bwe->seq_number % BWE_HISTORY_SIZE];
+
+  sent->send_time = now;
+  sent->seq_number = bwe->seq_number;
+  sent->size = size;
+  return bwe->seq_number++;
+}
+
+static void bwe_update_threshold(Bwe* bwe, float modified_trend, int64_t now) {
+  float k;
+  float dt;
+
+  if (bwe->last_threshold_update == 0) {
+    bwe->last_threshold_update = now;
+  }
+
+  // do not adapt to sudden spikes
+  if (bwe_abs(modified_trend) > bwe->threshold + 15.0f) {
+    bwe->last_threshold_update = now;
+    return;
+  }
+
+  k = bwe_abs(modified_trend) < bwe->threshold ? BWE_K_DOWN : BWE_K_UP;
+  dt = (now - bwe->last_threshold_update) / 1000.0f;
+  if (dt > 100.0f)
+    dt = 100.0f;
+
+  bwe->threshold += k * (bwe_abs(modified_trend) - bwe->threshold) * dt;
+  if (bwe->threshold < BWE_MIN_THRESHOLD)
+    bwe->threshold = BWE_MIN_THRESHOLD;
+  else if (bwe->threshold > BWE_MAX_THRESHOLD)
+    bwe->threshold = BWE_MAX_THRESHOLD;
+
+  bwe->last_threshold_update = now;
+}
+
+static void bwe_detect(Bwe* bwe, float send_delta, int64_t arrival_time) {
+  int num_deltas = bwe->num_deltas < BWE_MAX_NUM_DELTAS ? bwe->num_deltas : BWE_MAX_NUM_DELTAS;
+  float modified_trend = num_deltas * bwe->trend * BWE_THRESHOLD_GAIN;
+
+  if (modified_trend > bwe->threshold) {
+    if (bwe->time_over_using < 0) {
+      bwe->time_over_using = send_delta / 2;
+    } else {
+      bwe->time_over_using += send_delta;
+    }
+    bwe->overuse_count++;
+
+    if (bwe->time_over_using > BWE_OVERUSE_TIME && bwe->overuse_count > 1 && bwe->trend >= bwe->prev_trend) {
+      bwe->time_over_using = 0;
+      bwe->overuse_count = 0;
+      bwe->usage = BWE_USAGE_OVERUSING;
+    }
+  } else if (modified_trend < -bwe->threshold) {
+    bwe->time_over_using = -1;
+    bwe->overuse_count = 0;
+    bwe->usage = BWE_USAGE_UNDERUSING;
+  } else {
+    bwe->time_over_using = -1;
+    bwe->overuse_count = 0;
+    bwe->usage = BWE_USAGE_NORMAL;
+  }
+
+  bwe->prev_trend = bwe->trend;
+  bwe_update_threshold(bwe, modified_trend, arrival_time);
+}
+
+// least squares slope of the smoothed accumulated delay over arrival time
+static void bwe_update_trendline(Bwe* bwe, float delay_variation, float send_delta, int64_t arrival_time) {
+  int i;
+  float x_avg = 0;
+  float y_avg = 0;
+  float numerator = 0;
+  float denominator = 0;
+
+  bwe->num_deltas++;
+  bwe->accumulated_delay += delay_variation;
+  bwe->smoothed_delay = BWE_SMOOTHING_COEF * bwe->smoothed_delay + (1 - BWE_SMOOTHING_COEF) * bwe->accumulated_delay;
+
+  if (bwe->trend_count == BWE_TRENDLINE_WINDOW) {
+    memmove(bwe->trend_x, bwe->trend_x + 1, (BWE_TRENDLINE_WINDOW - 1) * sizeof(float));
+    memmove(bwe->trend_y, bwe->trend_y + 1, (BWE_TRENDLINE_WINDOW - 1) * sizeof(float));
+  } else {
+    bwe->trend_count++;
+  }
+
+  bwe->trend_x[bwe->trend_count - 1] = (arrival_time - bwe->first_arrival_time) / 1000.0f;
+  bwe->trend_y[bwe->trend_count - 1] = bwe->smoothed_delay;
+
+  if (bwe->trend_count < BWE_TRENDLINE_WINDOW) {
+    return;
+  }
+
+  for (i = 0; i < bwe->trend_count; i++) {
+    x_avg += bwe->trend_x[i];
+    y_avg += bwe->trend_y[i];
+  }
+  x_avg /= bwe->trend_count;
+  y_avg /= bwe->trend_count;
+
+  for (i = 0; i < bwe->trend_count; i++) {
+    numerator += (bwe->trend_x[i] - x_avg) * (bwe->trend_y[i] - y_avg);
+    denominator += (bwe->trend_x[i] - x_avg) * (bwe->trend_x[i] - x_avg);
+  }
+
+  if (denominator != 0) {
+    bwe->trend = numerator / denominator;
+  }
+
+  bwe_detect(bwe, send_delta, arrival_time);
+}
+
+static void bwe_start_group(Bwe* bwe, BweSentPacket* sent, int64_t arrival_time) {
+  bwe->current_group.valid = 1;
+  bwe->current_group.first_send_time = sent->send_time;
+  bwe->current_group.send_time = sent->send_time;
+  bwe->current_group.arrival_time = arrival_time;
+  bwe->current_group.size = sent->size;
+}
+
+static void bwe_on_twcc_packet(uint16_t seq_number, int received, int64_t arrival_time, void* user_data) {
+  Bwe* bwe = (Bwe*)user_data;
+  BweSentPacket* sent = &bwe->history[seq_number % BWE_HISTORY_SIZE];
+  BweArrivalGroup* group = &bwe->current_group;
+  float send_delta;
+  float arrival_delta;
+
+  if (!received || sent->seq_number != seq_number || sent->size == 0) {
+    return;
+  }
+
+  if (bwe->acked_bytes == 0) {
+    bwe->acked_start_time = arrival_time;
+  }
+  bwe->acked_bytes += sent->size;
+  if (arrival_time > bwe->acked_end_time) {
+    bwe->acked_end_time = arrival_time;
+  }
+
+  if (!group->valid) {
+    bwe->first_arrival_time = arrival_time;
+    bwe_start_group(bwe, sent, arrival_time);
+    return;
+  }
+
+  // reordered, belongs to a finished group
+  if ((int32_t)(sent->send_time - group->first_send_time) < 0) {
+    return;
+  }
+
+  if (sent->send_time - group->first_send_time <= BWE_BURST_TIME) {
+    group->send_time = sent->send_time;
+    if (arrival_time > group->arrival_time) {
+      group->arrival_time = arrival_time;
+    }
+    group->size += sent->size;
+    return;
+  }
+
+  if (bwe->prev_group.valid) {
+    send_delta = (float)(int32_t)(group->send_time - bwe->prev_group.send_time);
+    arrival_delta = (group->arrival_time - bwe->prev_group.arrival_time) / 1000.0f;
+    bwe_update_trendline(bwe, arrival_delta - send_delta, send_delta, group->arrival_time);
+  }
+
+  memcpy(&bwe->prev_group, group, sizeof(BweArrivalGroup));
+  bwe_start_group(bwe, sent, arrival_time);
+}
+
+static void bwe_update_acked_bitrate(Bwe* bwe) {
+  uint32_t bitrate;
+  int64_t duration = bwe->acked_end_time - bwe->acked_start_time;
+
+  if (duration < BWE_ACKED_WINDOW) {
+    return;
+  }
+
+  bitrate = (uint32_t)((uint64_t)bwe->acked_bytes * 8 * 1000000 / duration);
+  if (bwe->acked_bitrate == 0) {
+    bwe->acked_bitrate = bitrate;
+  } else {
+    bwe->acked_bitrate = (uint32_t)(0.7f * bwe->acked_bitrate + 0.3f * bitrate);
+  }
+
+  bwe->acked_bytes = 0;
+}
+
+static void bwe_update_delay_based(Bwe* bwe, uint32_t now) {
+  float dt;
+  uint32_t bitrate = bwe->delay_based_bitrate;
+
+  if (bwe->last_update_time == 0) {
+    bwe->last_update_time = now;
+  }
+
+  dt = (now - bwe->last_update_time) / 1000.0f;
+  if (dt > 1.0f)
+    dt = 1.0f;
+
+  switch (bwe->usage) {
+    case BWE_USAGE_OVERUSING:
+      // back off below what actually got through
+      if (now - bwe->last_decrease_time >= BWE_DECREASE_INTERVAL) {
+        bitrate = (uint32_t)(BWE_BETA * (bwe->acked_bitrate ? bwe->acked_bitrate : bitrate));
+        bwe->last_decrease_time = now;
+      }
+      break;
+    case BWE_USAGE_UNDERUSING:
+      // queues are draining, wait
+      break;
+    default:
+      // do not run away from the throughput the encoder really produces
+      if (bwe->acked_bitrate && bitrate > 1.5f * bwe->acked_bitrate + 10000) {
+        break;
+      }
+
+      if (bwe->last_decrease_time && now - bwe->last_decrease_time < BWE_CONVERGENCE_TIME) {
+        bitrate += (uint32_t)(BWE_ADDITIVE_INCREASE * dt);
+      } else {
+        bitrate += (uint32_t)(bitrate * 0.08f * dt);
+      }
+      break;
+  }
+
+  bwe->delay_based_bitrate = bwe_clamp(bwe, bitrate);
+  bwe->last_update_time = now;
+}
+
+static void bwe_update_target(Bwe* bwe) {
+  uint32_t bitrate = bwe->loss_based_bitrate;
+
+  if (bwe->feedback_received && bwe->delay_based_bitrate < bitrate) {
+    bitrate = bwe->delay_based_bitrate;
+  }
+
+  if (bitrate != bwe->target_bitrate) {
+    LOGD("target bitrate %" PRIu32 " (delay %" PRIu32 ", loss %" PRIu32 ", acked %" PRIu32 ")",
+         bitrate, bwe->delay_based_bitrate, bwe->loss_based_bitrate, bwe->acked_bitrate);
+  }
+
+  bwe->target_bitrate = bitrate;
+}
+
+void bwe_on_feedback(Bwe* bwe, uint8_t* packet, int len, uint32_t now) {
+  if (rtcp_parse_twcc(packet, len, bwe_on_twcc_packet, bwe) <= 0) {
+    return;
+  }
+
+  bwe->feedback_received = 1;
+  bwe_update_acked_bitrate(bwe);
+  bwe_update_delay_based(bwe, now);
+  bwe_update_target(bwe);
+}
+
+void bwe_on_receiver_report(Bwe* bwe, uint8_t fraction_lost, uint32_t now) {
+  uint32_t bitrate = bwe->loss_based_bitrate;
+
+  // below 2% probe up, above 10% back off in proportion to the loss
+  if (fraction_lost < 5) {
+    bitrate = (uint32_t)(bitrate * 1.05f) + 1000;
+  } else if (fraction_lost > 26) {
+    bitrate = (uint32_t)(bitrate * (1.0f - 0.5f * fraction_lost / 256.0f));
+  }
+
+  bwe->loss_based_bitrate = bwe_clamp(bwe, bitrate);
+  bwe_update_target(bwe);
+}
+
+uint32_t bwe_get_target_bitrate(Bwe* bwe) {
+  return bwe->target_bitrate;
+}
@@ -0,0 +1,100 @@
+#ifndef BWE_H_
+#define BWE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+#define BWE_HISTORY_SIZE 512
+#define BWE_TRENDLINE_WINDOW 20
+
+typedef enum BweUsage {
+
+  BWE_USAGE_NORMAL = 0,
+  BWE_USAGE_OVERUSING,
+  BWE_USAGE_UNDERUSING,
+
+} BweUsage;
+
+typedef struct BweSentPacket {
+  uint32_t send_time;
+  uint16_t seq_number;
+  uint16_t size;
+
+} BweSentPacket;
+
+typedef struct BweArrivalGroup {
+  int valid;
+  uint32_t first_send_time;
+  uint32_t send_time;
+  int64_t arrival_time;
+  uint32_t size;
+
+} BweArrivalGroup;
+
+typedef struct Bwe {
+  BweSentPacket history[BWE_HISTORY_SIZE];
+  uint16_t seq_number;
+
+  /* packets sent in the same burst form a group */
+  BweArrivalGroup current_group;
+  BweArrivalGroup prev_group;
+  int64_t first_arrival_time;
+
+  /* trendline filter of the delay gradient */
+  float accumulated_delay;
+  float smoothed_delay;
+  float trend_x[BWE_TRENDLINE_WINDOW];
+  float trend_y[BWE_TRENDLINE_WINDOW];
+  int trend_count;
+  int num_deltas;
+  float trend;
+  float prev_trend;
+
+  /* overuse detector */
+  float threshold;
+  int64_t last_threshold_update;
+  float time_over_using;
+  int overuse_count;
+  BweUsage usage;
+
+  /* acknowledged throughput */
+  uint32_t acked_bytes;
+  int64_t acked_start_time;
+  int64_t acked_end_time;
+  uint32_t acked_bitrate;
+
+  /* rate control */
+  int feedback_received;
+  uint32_t delay_based_bitrate;
+  uint32_t loss_based_bitrate;
+  uint32_t target_bitrate;
+  uint32_t min_bitrate;
+  uint32_t max_bitrate;
+  uint32_t last_update_time;
+  uint32_t last_decrease_time;
+
+} Bwe;
+
+void bwe_init(Bwe* bwe, uint32_t start_bitrate, uint32_t min_bitrate, uint32_t max_bitrate);
+
+/**
+ * @brief remember an outgoing packet
+ * @return transport-wide sequence number to put in the packet
+ */
+uint16_t bwe_on_packet_sent(Bwe* bwe, size_t size, uint32_t now);
+
+/**
+ * @brief update the delay based estimate from a transport-cc feedback
+ */
+void bwe_on_feedback(Bwe* bwe, uint8_t* packet, int len, uint32_t now);
+
+/**
+ * @brief update the loss based estimate from the fraction lost of a receiver report (0-255)
+ */
+void bwe_on_receiver_report(Bwe* bwe, uint8_t fraction_lost, uint32_t now);
+
+uint32_t bwe_get_target_bitrate(Bwe* bwe);
+
+#endif  // BWE_H_
@@ -1,9 +1,6 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
-// uncomment this if you want to handshake with a aiortc
-// #define CONFIG_DTLS_USE_ECDSA 1
-
 #define SCTP_MTU (1200)
 #define CONFIG_MTU (1300)
 
@@ -25,8 +22,9 @@
 #define RSA_KEY_LENGTH 1024
 #endif
 
+// default DTLS key, ECDSA P-256 or RSA_KEY_LENGTH bits RSA, peer_set_identity_key() picks at runtime
 #ifndef CONFIG_DTLS_USE_ECDSA
-#define CONFIG_DTLS_USE_ECDSA 0
+#define CONFIG_DTLS_USE_ECDSA 1
 #endif
 
 #ifndef CONFIG_USE_USRSCTP
@@ -61,6 +59,147 @@
 #define CONFIG_MAX_NALU_SIZE (10 * 1024)  // 10KB
 #endif
 
+// number of sent video packets kept for retransmission, 0 to disable NACK/RTX
+#ifndef CONFIG_RTP_HISTORY_SIZE
+#define CONFIG_RTP_HISTORY_SIZE 128
+#endif
+
+// sent packets older than this (ms) are not retransmitted anymore
+#ifndef CONFIG_RTP_HISTORY_DURATION
+#define CONFIG_RTP_HISTORY_DURATION 1000
+#endif
+
+// give up requesting a lost packet after this (ms)
+#ifndef CONFIG_NACK_MAX_DELAY
+#define CONFIG_NACK_MAX_DELAY 500
+#endif
+
+// FlexFEC (RFC 8627) for video, one XOR repair packet per group of media packets
+#ifndef CONFIG_FEC
+#define CONFIG_FEC 1
+#endif
+
+// group size adapts to the reported loss between these bounds, at most 15
+#ifndef CONFIG_FEC_MIN_GROUP_SIZE
+#define CONFIG_FEC_MIN_GROUP_SIZE 2
+#endif
+
+#ifndef CONFIG_FEC_MAX_GROUP_SIZE
+#define CONFIG_FEC_MAX_GROUP_SIZE 15
+#endif
+
+// received packets kept (ms) to recover a lost one
+#ifndef CONFIG_FEC_REPAIR_WINDOW
+#define CONFIG_FEC_REPAIR_WINDOW 200
+#endif
+
+// average interval (ms) between RTCP sender/receiver reports
+#ifndef CONFIG_RTCP_INTERVAL
+#define CONFIG_RTCP_INTERVAL 1000
+#endif
+
+// bandwidth estimation bounds (bps) for on_bitrate_estimate, senders without it and without
+// transport-cc feedback are paced at the max
+#ifndef CONFIG_BWE_MIN_BITRATE
+#define CONFIG_BWE_MIN_BITRATE 100000
+#endif
+
+#ifndef CONFIG_BWE_START_BITRATE
+#define CONFIG_BWE_START_BITRATE 500000
+#endif
+
+#ifndef CONFIG_BWE_MAX_BITRATE
+#define CONFIG_BWE_MAX_BITRATE 5000000
+#endif
+
+// queued video older than this (ms) is dropped by the pacer, whole frames at a time
+#ifndef CONFIG_PACER_MAX_QUEUE_DELAY
+#define CONFIG_PACER_MAX_QUEUE_DELAY 500
+#endif
+
+// bytes the pacer may hold before dropping video
+#ifndef CONFIG_PACER_MAX_QUEUE_SIZE
+#define CONFIG_PACER_MAX_QUEUE_SIZE (256 * 1024)
+#endif
+
+// resolved hosts are reused for this long (ms), getaddrinfo does not report the record TTL
+#ifndef CONFIG_DNS_CACHE_TTL
+#define CONFIG_DNS_CACHE_TTL 300000
+#endif
+
+#ifndef CONFIG_DNS_CACHE_SIZE
+#define CONFIG_DNS_CACHE_SIZE 8
+#endif
+
+// pthread locks for state shared between threads, 0 on single threaded targets compiles them away
+#ifndef CONFIG_THREADS
+#ifdef __RP2040_BM__
+#define CONFIG_THREADS 0
+#else
+#define CONFIG_THREADS 1
+#endif
+#endif
+
+// resolve ICE server hosts on a helper thread so creating a description never waits on DNS
+#ifndef CONFIG_DNS_ASYNC
+#if defined(__RP2040_BM__) || !CONFIG_THREADS
+#define CONFIG_DNS_ASYNC 0
+#else
+#define CONFIG_DNS_ASYNC 1
+#endif
+#endif
+
+// TURN over TCP (turn:...?transport=tcp) and TLS (turns:) for networks that block UDP,
+// TLS also needs the signaling transports so it is off with DISABLE_PEER_SIGNALING
+#ifndef CONFIG_TURN_TCP
+#ifdef __RP2040_BM__
+#define CONFIG_TURN_TCP 0
+#else
+#define CONFIG_TURN_TCP 1
+#endif
+#endif
+
+// libsrtp crypto backend, set by SRTP_CRYPTO in CMakeLists.txt and reported by the startup check
+#ifndef CONFIG_SRTP_CRYPTO
+#define CONFIG_SRTP_CRYPTO "builtin"
+#endif
+
+// threads that run DTLS handshakes, key generation and CONFIG_SRTP_PARALLEL batches,
+// 0 runs them on the connection's loop
+#ifndef CONFIG_DTLS_HANDSHAKE_WORKERS
+#define CONFIG_DTLS_HANDSHAKE_WORKERS 0
+#endif
+
+// RTP packets the pacer releases that are protected and sent in one go, 1 sends each as it comes
+#ifndef CONFIG_RTP_SEND_BATCH
+#ifdef __RP2040_BM__
+#define CONFIG_RTP_SEND_BATCH 1
+#else
+#define CONFIG_RTP_SEND_BATCH 8
+#endif
+#endif
+
+// protect and send each connection's RTP batches on the workers, for one thread driving many
+// connections, each connection keeps a single batch in flight so its packets stay in order,
+// batches to a TURN relay are sent from the loop, needs CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+#ifndef CONFIG_SRTP_PARALLEL
+#define CONFIG_SRTP_PARALLEL 0
+#endif
+
+// seconds before connections get a new DTLS certificate, 0 keeps one for the life of the process
+#ifndef CONFIG_DTLS_IDENTITY_LIFETIME
+#define CONFIG_DTLS_IDENTITY_LIFETIME 0
+#endif
+
+// 16 KB of CRC tables for STUN and SCTP checksums on CPUs without CRC instructions
+#ifndef CONFIG_CRC_SLICING_BY_8
+#ifdef __RP2040_BM__
+#define CONFIG_CRC_SLICING_BY_8 0
+#else
+#define CONFIG_CRC_SLICING_BY_8 1
+#endif
+#endif
+
 #define CONFIG_IPV6 0
 // empty will use first active interface
 #define CONFIG_IFACE_PREFIX ""
@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "utils.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__GNUC__) && (defined(__ARM_FEATURE_CRC32) || defined(__linux__))
+#define CRC_ARM64 1
+#include <arm_acle.h>
+#ifndef __ARM_FEATURE_CRC32
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#ifdef __clang__
+#define CRC_ARM64_TARGET __attribute__((target("crc")))
+#else
+#define CRC_ARM64_TARGET __attribute__((target("+crc")))
+#endif
+#endif
+
+// bit-reflected generator polynomials
+#define CRC32_POLY 0xedb88320
+#define CRC32C_POLY 0x82f63b78
+
+// slicing-by-8 loads little-endian words, other hosts use one table
+#if CONFIG_CRC_SLICING_BY_8 && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC_SLICES 8
+#else
+#define CRC_SLICES 1
+#endif
+
+typedef uint32_t (*CrcUpdate)(uint32_t crc, const uint8_t* data, size_t len);
+
+static uint32_t crc32_table[CRC_SLICES][256];
+static uint32_t crc32c_table[CRC_SLICES][256];
+
+static int crc_ready = 0;
+static CrcBackend crc_backend = CRC_BACKEND_TABLE;
+// implementations work on the raw register, the public functions invert it on the way in and out
+static CrcUpdate crc32_impl;
+static CrcUpdate crc32c_impl;
+// the best software loop, also what the PCLMULQDQ path uses for short buffers and tails
+static CrcUpdate crc32_software;
+static CrcUpdate crc32c_software;
+// NULL when the CPU has no instructions for the polynomial
+static CrcUpdate crc32_hardware;
+static CrcUpdate crc32c_hardware;
+
+static void crc_make_table(uint32_t table[][256], uint32_t poly) {
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+    }
+    table[0][i] = c;
+  }
+
+  for (j = 1; j < CRC_SLICES; j++) {
+    for (i = 0; i < 256; i++) {
+      table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+    }
+  }
+}
+
+static uint32_t crc_table_update(uint32_t table[][256], uint32_t crc, const uint8_t* data, size_t len) {
+  while (len--) {
+    crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if CRC_SLICES == 8
+static uint32_t crc_slicing_update(uint32_t table[][256], uint32_t crc, const uint8_t* data, size_t len) {
+  uint32_t lo, hi;
+
+  while (len > 0 && ((uintptr_t)data & 3)) {
+    crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+  while (len >= 8) {
+    memcpy(&lo, data, sizeof(lo));
+    memcpy(&hi, data + 4, sizeof(hi));
+    lo ^= crc;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    data += 8;
+    len -= 8;
+  }
+
+  return crc_table_update(table, crc, data, len);
+}
+
+static uint32_t crc32_slicing(uint32_t crc, const uint8_t* data, size_t len) {
+  return crc_slicing_update(crc32_table, crc, data, len);
+}
+
+static uint32_t crc32c_slicing(uint32_t crc, const uint8_t* data, size_t len) {
+  return crc_slicing_update(crc32c_table, crc, data, len);
+}
+#endif
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* data, size_t len) {
+  return crc_table_update(crc32_table, crc, data, len);
+}
+
+static uint32_t crc32c_bytewise(uint32_t crc, const uint8_t* data, size_t len) {
+  return crc_table_update(crc32c_table, crc, data, len);
+}
+
+#if CRC_X86
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len) {
+  uint32_t v32;
+#if defined(__x86_64__)
+  uint64_t v64;
+  uint64_t crc64;
+#endif
+
+  while (len > 0 && ((uintptr_t)data & 7)) {
+    crc = _mm_crc32_u8(crc, *data++);
+    len--;
+  }
+
+#if defined(__x86_64__)
+  crc64 = crc;
+  while (len >= 8) {
+    memcpy(&v64, data, sizeof(v64));
+    crc64 = _mm_crc32_u64(crc64, v64);
+    data += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+
+  while (len >= 4) {
+    memcpy(&v32, data, sizeof(v32));
+    crc = _mm_crc32_u32(crc, v32);
+    data += 4;
+    len -= 4;
+  }
+
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+  return crc;
+}
+
+// Intel, Fast CRC Computation for Generic Polynomials Using PCLMULQDQ, 4x128-bit folding then Barrett reduction
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t* data, size_t len) {
+  static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+  static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+  static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+  static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  // len is a multiple of 16 and at least 64
+  x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128((const __m128i*)k1k2);
+  data += 64;
+  len -= 64;
+
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    data += 64;
+    len -= 64;
+  }
+
+  // fold the four lanes into one
+  x0 = _mm_load_si128((const __m128i*)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i*)data);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    data += 16;
+    len -= 16;
+  }
+
+  // 128 to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128((const __m128i*)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t len) {
+  size_t folded = len & ~(size_t)15;
+
+  // short buffers, most STUN messages among them, are faster without the fold setup
+  if (len < 64) {
+    return crc32_software(crc, data, len);
+  }
+
+  crc = crc32_pclmul_fold(crc, data, folded);
+  return crc32_software(crc, data + folded, len - folded);
+}
+
+static void crc_detect_hardware(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_hardware = crc32c_sse42;
+    if (__builtin_cpu_supports("pclmul")) {
+      crc32_hardware = crc32_pclmul;
+    }
+  }
+}
+#elif CRC_ARM64
+CRC_ARM64_TARGET static uint32_t crc32_armv8(uint32_t crc, const uint8_t* data, size_t len) {
+  uint64_t v;
+
+  while (len > 0 && ((uintptr_t)data & 7)) {
+    crc = __crc32b(crc, *data++);
+    len--;
+  }
+
+  while (len >= 8) {
+    memcpy(&v, data, sizeof(v));
+    crc = __crc32d(crc, v);
+    data += 8;
+    len -= 8;
+  }
+
+  while (len--) {
+    crc = __crc32b(crc, *data++);
+  }
+
+  return crc;
+}
+
+CRC_ARM64_TARGET static uint32_t crc32c_armv8(uint32_t crc, const uint8_t* data, size_t len) {
+  uint64_t v;
+
+  while (len > 0 && ((uintptr_t)data & 7)) {
+    crc = __crc32cb(crc, *data++);
+    len--;
+  }
+
+  while (len >= 8) {
+    memcpy(&v, data, sizeof(v));
+    crc = __crc32cd(crc, v);
+    data += 8;
+    len -= 8;
+  }
+
+  while (len--) {
+    crc = __crc32cb(crc, *data++);
+  }
+
+  return crc;
+}
+
+static void crc_detect_hardware(void) {
+#ifndef __ARM_FEATURE_CRC32
+  if ((getauxval(AT_HWCAP) & HWCAP_CRC32) == 0) {
+    return;
+  }
+#endif
+  crc32_hardware = crc32_armv8;
+  crc32c_hardware = crc32c_armv8;
+}
+#endif
+
+static int crc_select(CrcBackend backend) {
+  switch (backend) {
+    case CRC_BACKEND_TABLE:
+      crc32_impl = crc32_bytewise;
+      crc32c_impl = crc32c_bytewise;
+      break;
+#if CRC_SLICES == 8
+    case CRC_BACKEND_SLICING_BY_8:
+      crc32_impl = crc32_slicing;
+      crc32c_impl = crc32c_slicing;
+      break;
+#endif
+    case CRC_BACKEND_HARDWARE:
+      if (crc32_hardware == NULL && crc32c_hardware == NULL) {
+        return -1;
+      }
+      // a polynomial without instructions keeps the best software loop
+      crc32_impl = crc32_hardware ? crc32_hardware : crc32_software;
+      crc32c_impl = crc32c_hardware ? crc32c_hardware : crc32c_software;
+      break;
+    default:
+      return -1;
+  }
+
+  crc_backend = backend;
+  return 0;
+}
+
+static void crc_init(void) {
+  crc_make_table(crc32_table, CRC32_POLY);
+  crc_make_table(crc32c_table, CRC32C_POLY);
+#if CRC_SLICES == 8
+  crc32_software = crc32_slicing;
+  crc32c_software = crc32c_slicing;
+#else
+  crc32_software = crc32_bytewise;
+  crc32c_software = crc32c_bytewise;
+#endif
+
+#if CRC_X86 || CRC_ARM64
+  crc_detect_hardware();
+#endif
+
+  if (crc_select(CRC_BACKEND_HARDWARE) != 0 && crc_select(CRC_BACKEND_SLICING_BY_8) != 0) {
+    crc_select(CRC_BACKEND_TABLE);
+  }
+  LOGD("CRC backend: %s", crc_backend_to_string(crc_backend));
+  crc_ready = 1;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+  if (!crc_ready) {
+    crc_init();
+  }
+  return ~crc32_impl(~crc, data, len);
+}
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t* data, size_t len) {
+  if (!crc_ready) {
+    crc_init();
+  }
+  return ~crc32c_impl(~crc, data, len);
+}
+
+CrcBackend crc_get_backend(void) {
+  if (!crc_ready) {
+    crc_init();
+  }
+  return crc_backend;
+}
+
+int crc_set_backend(CrcBackend backend) {
+  if (!crc_ready) {
+    crc_init();
+  }
+  return crc_select(backend);
+}
+
+const char* crc_backend_to_string(CrcBackend backend) {
+  switch (backend) {
+    case CRC_BACKEND_TABLE:
+      return "table";
+    case CRC_BACKEND_SLICING_BY_8:
+      return "slicing-by-8";
+    case CRC_BACKEND_HARDWARE:
+      return "hardware";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+typedef enum CrcBackend {
+
+  CRC_BACKEND_TABLE = 0,
+  CRC_BACKEND_SLICING_BY_8,
+  CRC_BACKEND_HARDWARE,  // SSE4.2 and PCLMULQDQ on x86, the CRC32 extension on ARMv8
+
+} CrcBackend;
+
+/**
+ * @brief CRC-32 (ISO-HDLC) as used by the STUN FINGERPRINT
+ * @param[in] crc 0 to start, or the result over the preceding bytes
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+/**
+ * @brief CRC-32C (Castagnoli) as used by the SCTP checksum
+ * @param[in] crc 0 to start, or the result over the preceding bytes
+ */
+uint32_t crc32c_update(uint32_t crc, const uint8_t* data, size_t len);
+
+/**
+ * @brief the backend in use, the fastest one the CPU supports unless set otherwise
+ */
+CrcBackend crc_get_backend(void);
+
+/**
+ * @return -1 if the backend is not supported on this CPU or build
+ */
+int crc_set_backend(CrcBackend backend);
+
+const char* crc_backend_to_string(CrcBackend backend);
+
+#endif  // CRC32_H_
@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,126 @@
 #if CONFIG_MBEDTLS_DEBUG
 #include "mbedtls/debug.h"
 #endif
+#include "mbedtls/pem.h"
+#include "mbedtls/platform_util.h"
 #include "mbedtls/sha256.h"
 #include "mbedtls/ssl.h"
 #include "ports.h"
 #include "socket.h"
 #include "utils.h"
+#include "worker.h"
+
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+#include <pthread.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DTLS_SRTP_X86 1
+#elif defined(__aarch64__) && defined(__linux__)
+#define DTLS_SRTP_ARM64 1
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+
+// mbedtls 3 hides the certificate's public key behind this
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+// RFC 7714, mbedtls only negotiates them with its profile check patched by our CMakeLists.txt
+#ifndef MBEDTLS_TLS_SRTP_AEAD_AES_128_GCM
+#define MBEDTLS_TLS_SRTP_AEAD_AES_128_GCM ((uint16_t)0x0007)
+#endif
+#ifndef MBEDTLS_TLS_SRTP_AEAD_AES_256_GCM
+#define MBEDTLS_TLS_SRTP_AEAD_AES_256_GCM ((uint16_t)0x0008)
+#endif
+
+typedef struct DtlsSrtpProfile {
+  uint16_t id;
+  const char* name;
+  int key_length;
+  int salt_length;
+  void (*set_rtp)(srtp_crypto_policy_t* policy);
+  void (*set_rtcp)(srtp_crypto_policy_t* policy);
+
+} DtlsSrtpProfile;
+
+// GCM first, one AES pass with a GHASH tag is cheaper per byte than AES-CTR plus HMAC-SHA1
+static const DtlsSrtpProfile dtls_srtp_profiles[] = {
+    {MBEDTLS_TLS_SRTP_AEAD_AES_128_GCM, "AEAD_AES_128_GCM", 16, 12,
+     srtp_crypto_policy_set_aes_gcm_128_16_auth, srtp_crypto_policy_set_aes_gcm_128_16_auth},
+    {MBEDTLS_TLS_SRTP_AEAD_AES_256_GCM, "AEAD_AES_256_GCM", 32, 12,
+     srtp_crypto_policy_set_aes_gcm_256_16_auth, srtp_crypto_policy_set_aes_gcm_256_16_auth},
+    {MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_80, "AES_CM_128_HMAC_SHA1_80", 16, 14,
+     srtp_crypto_policy_set_rtp_default, srtp_crypto_policy_set_rtcp_default},
+    // RFC 5764 keeps the 80-bit tag for SRTCP
+    {MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_32, "AES_CM_128_HMAC_SHA1_32", 16, 14,
+     srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32, srtp_crypto_policy_set_rtcp_default},
+};
+
+#define DTLS_SRTP_PROFILE_COUNT (sizeof(dtls_srtp_profiles) / sizeof(dtls_srtp_profiles[0]))
+
+// the usable ones in order, filled by dtls_srtp_profiles_probe, mbedtls keeps a pointer to the list
+static mbedtls_ssl_srtp_profile g_srtp_profiles[DTLS_SRTP_PROFILE_COUNT + 1];
+
+// each profile protects and unprotects one packet this big in dtls_srtp_self_check,
+// tests/bench_srtp measures their cost
+#define DTLS_SRTP_SELF_CHECK_PAYLOAD 1200
+
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+// datagrams waiting in each direction while a worker has the handshake
+#define DTLS_SRTP_OFFLOAD_QUEUE_SIZE 8
+
+typedef struct DtlsSrtpQueue {
+  uint8_t buf[DTLS_SRTP_OFFLOAD_QUEUE_SIZE][CONFIG_MTU];
+  int len[DTLS_SRTP_OFFLOAD_QUEUE_SIZE];
+  int head;
+  int count;
+
+} DtlsSrtpQueue;
+
+// the worker side of a handshake, mbedtls reads and writes the queues and the owning loop moves them to the socket
+typedef struct DtlsSrtpOffload {
+  WorkerJob job;
+  DtlsSrtp* dtls_srtp;
+  DtlsSrtpQueue inbox;
+  DtlsSrtpQueue outbox;
+  int busy;       // queued or running on a worker
+  int result;     // of the last run, as returned by dtls_srtp_handshake_step
+  int connected;  // keys derived on the worker, the loop moves it to dtls_srtp->state
+  uint8_t buf[CONFIG_MTU];
+
+} DtlsSrtpOffload;
+#endif
+
+// below the path MTU of most tunnels, a P-256 handshake flight still fits in one datagram
+#define DTLS_SRTP_HANDSHAKE_MTU 1200
+
+// AEAD with ECDHE first, the server skips the ones its certificate cannot sign for.
+// Plain RSA key exchange is last for mbedtls builds without ECDHE
+static const int dtls_srtp_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+    0};
+
+// X25519 is the cheapest key exchange, P-256 is what every WebRTC stack has
+#if CONFIG_MBEDTLS_2_X
+static const mbedtls_ecp_group_id dtls_srtp_groups[] = {
+    MBEDTLS_ECP_DP_CURVE25519,
+    MBEDTLS_ECP_DP_SECP256R1,
+    MBEDTLS_ECP_DP_NONE};
+#else
+static const uint16_t dtls_srtp_groups[] = {
+    MBEDTLS_SSL_IANA_TLS_GROUP_X25519,
+    MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1,
+    MBEDTLS_SSL_IANA_TLS_GROUP_NONE};
+#endif
 
 int dtls_srtp_udp_send(void* ctx, const uint8_t* buf, size_t len) {
   DtlsSrtp* dtls_srtp = (DtlsSrtp*)ctx;
@@ -66,7 +182,34 @@ static int dtls_srtp_cert_verify(void* data, mbedtls_x509_crt* crt, int depth, u
   return 0;
 }
 
-static int dtls_srtp_selfsign_cert(DtlsSrtp* dtls_srtp) {
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+// guards the offload queues and flags of every connection
+static pthread_mutex_t g_offload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_offload_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static PortsMutex g_identity_mutex = PORTS_MUTEX_INITIALIZER;
+// the cache holds one reference, connections hold one each
+static DtlsSrtpIdentity* g_identity = NULL;
+static char g_identity_path[DTLS_SRTP_IDENTITY_PATH_LENGTH];
+static DtlsSrtpKeyType g_identity_key_type = CONFIG_DTLS_USE_ECDSA ? DTLS_SRTP_KEY_ECDSA_P256 : DTLS_SRTP_KEY_RSA;
+static WorkerJob g_identity_job;
+static int g_identity_rotating = 0;
+
+static void dtls_srtp_identity_free(DtlsSrtpIdentity* identity) {
+  mbedtls_x509_crt_free(&identity->cert);
+  mbedtls_pk_free(&identity->pkey);
+  free(identity);
+}
+
+// must be called with g_identity_mutex held
+static void dtls_srtp_identity_unref(DtlsSrtpIdentity* identity) {
+  if (--identity->refs == 0) {
+    dtls_srtp_identity_free(identity);
+  }
+}
+
+static int dtls_srtp_identity_generate(DtlsSrtpIdentity* identity, DtlsSrtpKeyType key_type) {
   int ret;
 
   mbedtls_x509write_cert crt;
@@ -77,35 +220,39 @@ static int dtls_srtp_selfsign_cert(DtlsSrtp* dtls_srtp) {
 #else
   const char* serial = "peer";
 #endif
-  const char* pers = "dtls_srtp";
 
-  cert_buf = (unsigned char*)malloc(RSA_KEY_LENGTH * 2);
+  // zeroed so the PEM text is terminated wherever it ends, the parser needs that
+  cert_buf = (unsigned char*)calloc(1, RSA_KEY_LENGTH * 2);
   if (cert_buf == NULL) {
     LOGE("malloc failed");
     return -1;
   }
 
-  mbedtls_ctr_drbg_seed(&dtls_srtp->ctr_drbg, mbedtls_entropy_func, &dtls_srtp->entropy, (const unsigned char*)pers, strlen(pers));
+  if (key_type == DTLS_SRTP_KEY_ECDSA_P256) {
+    if ((ret = mbedtls_pk_setup(&identity->pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) == 0) {
+      ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(identity->pkey), utils_random, NULL);
+    }
+  } else {
+    if ((ret = mbedtls_pk_setup(&identity->pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA))) == 0) {
+      ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(identity->pkey), utils_random, NULL, RSA_KEY_LENGTH, 65537);
+    }
+  }
 
-#if CONFIG_DTLS_USE_ECDSA
-  mbedtls_pk_setup(&dtls_srtp->pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
-  mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(dtls_srtp->pkey), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
-#else
-  mbedtls_pk_setup(&dtls_srtp->pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA));
-  mbedtls_rsa_gen_key(mbedtls_pk_rsa(dtls_srtp->pkey), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg, RSA_KEY_LENGTH, 65537);
-#endif
+  if (ret != 0) {
+    LOGE("DTLS key generation failed -0x%.4x", (unsigned int)-ret);
+    free(cert_buf);
+    return ret;
+  }
 
   mbedtls_x509write_crt_init(&crt);
 
-  mbedtls_x509write_crt_set_subject_key(&crt, &dtls_srtp->pkey);
+  mbedtls_x509write_crt_set_subject_key(&crt, &identity->pkey);
 
   mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
 
   mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
 
-  mbedtls_x509write_crt_set_subject_key(&crt, &dtls_srtp->pkey);
-
-  mbedtls_x509write_crt_set_issuer_key(&crt, &dtls_srtp->pkey);
+  mbedtls_x509write_crt_set_issuer_key(&crt, &identity->pkey);
 
   mbedtls_x509write_crt_set_subject_name(&crt, "CN=dtls_srtp");
 
@@ -113,25 +260,26 @@ static int dtls_srtp_selfsign_cert(DtlsSrtp* dtls_srtp) {
 
 #if CONFIG_MBEDTLS_2_X
   mbedtls_mpi_init(&serial);
-  mbedtls_mpi_fill_random(&serial, 16, mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+  mbedtls_mpi_fill_random(&serial, 16, utils_random, NULL);
   ret = mbedtls_x509write_crt_set_serial(&crt, &serial);
   if (ret < 0) {
     LOGE("mbedtls_x509write_crt_set_serial failed -0x%.4x", (unsigned int)-ret);
   }
+  mbedtls_mpi_free(&serial);
 #else
   mbedtls_x509write_crt_set_serial_raw(&crt, (unsigned char*)serial, strlen(serial));
 #endif
 
   mbedtls_x509write_crt_set_validity(&crt, "20180101000000", "20280101000000");
 
-  ret = mbedtls_x509write_crt_pem(&crt, cert_buf, 2 * RSA_KEY_LENGTH, mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+  ret = mbedtls_x509write_crt_pem(&crt, cert_buf, 2 * RSA_KEY_LENGTH, utils_random, NULL);
 
   if (ret < 0) {
     LOGE("mbedtls_x509write_crt_pem failed -0x%.4x", (unsigned int)-ret);
+  } else if ((ret = mbedtls_x509_crt_parse(&identity->cert, cert_buf, 2 * RSA_KEY_LENGTH)) != 0) {
+    LOGE("mbedtls_x509_crt_parse failed -0x%.4x", (unsigned int)-ret);
   }
 
-  mbedtls_x509_crt_parse(&dtls_srtp->cert, cert_buf, 2 * RSA_KEY_LENGTH);
-
   mbedtls_x509write_crt_free(&crt);
 
   free(cert_buf);
@@ -139,6 +287,477 @@ static int dtls_srtp_selfsign_cert(DtlsSrtp* dtls_srtp) {
   return ret;
 }
 
+static int dtls_srtp_identity_load(DtlsSrtpIdentity* identity, const char* path) {
+  int ret = -1;
+  long size = 0;
+  unsigned char* buf = NULL;
+  FILE* fp;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    return -1;
+  }
+
+  if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && size < DTLS_SRTP_IDENTITY_PEM_SIZE &&
+      fseek(fp, 0, SEEK_SET) == 0 && (buf = (unsigned char*)calloc(1, size + 1)) != NULL &&
+      fread(buf, 1, size, fp) == (size_t)size) {
+    // the key and the certificate are both in the file, each parser picks its own PEM block
+#if CONFIG_MBEDTLS_2_X
+    ret = mbedtls_pk_parse_key(&identity->pkey, buf, size + 1, NULL, 0);
+#else
+    ret = mbedtls_pk_parse_key(&identity->pkey, buf, size + 1, NULL, 0, utils_random, NULL);
+#endif
+    if (ret == 0) {
+      ret = mbedtls_x509_crt_parse(&identity->cert, buf, size + 1);
+    }
+    if (ret == 0) {
+#if CONFIG_MBEDTLS_2_X
+      ret = mbedtls_pk_check_pair(&identity->cert.MBEDTLS_PRIVATE(pk), &identity->pkey);
+#else
+      ret = mbedtls_pk_check_pair(&identity->cert.MBEDTLS_PRIVATE(pk), &identity->pkey, utils_random, NULL);
+#endif
+    }
+    if (ret != 0) {
+      LOGE("Invalid DTLS identity %s -0x%.4x", path, (unsigned int)-ret);
+    }
+  }
+
+  if (buf) {
+    mbedtls_platform_zeroize(buf, size);
+    free(buf);
+  }
+  fclose(fp);
+  return ret;
+}
+
+static int dtls_srtp_identity_save(DtlsSrtpIdentity* identity, const char* path) {
+  int ret = -1;
+  int fd;
+  size_t olen;
+  unsigned char* buf;
+  FILE* fp = NULL;
+
+  if ((buf = (unsigned char*)malloc(DTLS_SRTP_IDENTITY_PEM_SIZE)) == NULL) {
+    return -1;
+  }
+
+  // the private key is in there, keep it to the owner
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 && (fp = fdopen(fd, "w")) != NULL &&
+      mbedtls_pk_write_key_pem(&identity->pkey, buf, DTLS_SRTP_IDENTITY_PEM_SIZE) == 0 &&
+      fputs((char*)buf, fp) >= 0 &&
+      mbedtls_pem_write_buffer("-----BEGIN CERTIFICATE-----\n", "-----END CERTIFICATE-----\n", identity->cert.raw.p,
+                               identity->cert.raw.len, buf, DTLS_SRTP_IDENTITY_PEM_SIZE, &olen) == 0 &&
+      fputs((char*)buf, fp) >= 0) {
+    ret = 0;
+  }
+
+  if (fp) {
+    if (fclose(fp) != 0) {
+      ret = -1;
+    }
+  } else if (fd >= 0) {
+    close(fd);
+  }
+
+  if (ret != 0) {
+    LOGE("Failed to save DTLS identity to %s", path);
+  }
+
+  mbedtls_platform_zeroize(buf, DTLS_SRTP_IDENTITY_PEM_SIZE);
+  free(buf);
+  return ret;
+}
+
+// called with g_identity_mutex held so concurrent callers wait for one result,
+// except by the rotation job which passes copies of the path and key type
+static DtlsSrtpIdentity* dtls_srtp_identity_create(const char* path, DtlsSrtpKeyType key_type, int load) {
+  int ret = -1;
+  DtlsSrtpIdentity* identity;
+
+  if ((identity = (DtlsSrtpIdentity*)calloc(1, sizeof(DtlsSrtpIdentity))) == NULL) {
+    return NULL;
+  }
+
+  mbedtls_x509_crt_init(&identity->cert);
+  mbedtls_pk_init(&identity->pkey);
+
+  if (load && path[0] != '\0' && dtls_srtp_identity_load(identity, path) == 0) {
+    LOGI("Loaded DTLS identity from %s", path);
+    ret = 0;
+  } else {
+    // a file that failed to parse leaves partial state behind
+    mbedtls_x509_crt_free(&identity->cert);
+    mbedtls_pk_free(&identity->pkey);
+    mbedtls_x509_crt_init(&identity->cert);
+    mbedtls_pk_init(&identity->pkey);
+    if ((ret = dtls_srtp_identity_generate(identity, key_type)) == 0 && path[0] != '\0') {
+      dtls_srtp_identity_save(identity, path);
+    }
+  }
+
+  if (ret != 0) {
+    dtls_srtp_identity_free(identity);
+    return NULL;
+  }
+
+  dtls_srtp_x509_digest(&identity->cert, identity->fingerprint);
+  identity->created_time = ports_get_ntp_time() >> 32;
+  identity->refs = 1;
+  return identity;
+}
+
+// must be called with g_identity_mutex held
+static void dtls_srtp_identity_replace(DtlsSrtpIdentity* identity) {
+  if (g_identity) {
+    dtls_srtp_identity_unref(g_identity);
+  }
+  g_identity = identity;
+}
+
+static void dtls_srtp_identity_rotate_run(WorkerJob* job) {
+  char path[DTLS_SRTP_IDENTITY_PATH_LENGTH];
+  DtlsSrtpKeyType key_type;
+  DtlsSrtpIdentity* identity;
+
+  ports_mutex_lock(&g_identity_mutex);
+  snprintf(path, sizeof(path), "%s", g_identity_path);
+  key_type = g_identity_key_type;
+  ports_mutex_unlock(&g_identity_mutex);
+
+  identity = dtls_srtp_identity_create(path, key_type, 0);
+
+  ports_mutex_lock(&g_identity_mutex);
+  if (identity) {
+    dtls_srtp_identity_replace(identity);
+  }
+  g_identity_rotating = 0;
+  ports_mutex_unlock(&g_identity_mutex);
+}
+
+DtlsSrtpIdentity* dtls_srtp_identity_acquire() {
+  DtlsSrtpIdentity* identity;
+  uint32_t now = ports_get_ntp_time() >> 32;
+
+  ports_mutex_lock(&g_identity_mutex);
+  if (g_identity && CONFIG_DTLS_IDENTITY_LIFETIME > 0 && now - g_identity->created_time >= CONFIG_DTLS_IDENTITY_LIFETIME &&
+      !g_identity_rotating) {
+    LOGI("DTLS identity expired, rotating");
+    // connections keep getting the expired one until a worker has the new one ready
+    g_identity_job.run = dtls_srtp_identity_rotate_run;
+    g_identity_rotating = worker_pool_size() > 0 && worker_pool_submit(&g_identity_job) == 0;
+
+    if (!g_identity_rotating && (identity = dtls_srtp_identity_create(g_identity_path, g_identity_key_type, 0)) != NULL) {
+      dtls_srtp_identity_replace(identity);
+    }
+  }
+
+  if (g_identity == NULL) {
+    g_identity = dtls_srtp_identity_create(g_identity_path, g_identity_key_type, 1);
+  }
+
+  if ((identity = g_identity) != NULL) {
+    identity->refs++;
+  }
+  ports_mutex_unlock(&g_identity_mutex);
+  return identity;
+}
+
+void dtls_srtp_identity_release(DtlsSrtpIdentity* identity) {
+  if (identity == NULL) {
+    return;
+  }
+  ports_mutex_lock(&g_identity_mutex);
+  dtls_srtp_identity_unref(identity);
+  ports_mutex_unlock(&g_identity_mutex);
+}
+
+int dtls_srtp_identity_rotate() {
+  DtlsSrtpIdentity* identity;
+
+  ports_mutex_lock(&g_identity_mutex);
+  if ((identity = dtls_srtp_identity_create(g_identity_path, g_identity_key_type, 0)) != NULL) {
+    dtls_srtp_identity_replace(identity);
+  }
+  ports_mutex_unlock(&g_identity_mutex);
+  return identity ? 0 : -1;
+}
+
+int dtls_srtp_identity_set_file(const char* path) {
+  DtlsSrtpIdentity* identity;
+
+  if (path == NULL || strlen(path) >= sizeof(g_identity_path)) {
+    return -1;
+  }
+
+  ports_mutex_lock(&g_identity_mutex);
+  snprintf(g_identity_path, sizeof(g_identity_path), "%s", path);
+  if ((identity = dtls_srtp_identity_create(g_identity_path, g_identity_key_type, 1)) != NULL) {
+    dtls_srtp_identity_replace(identity);
+  }
+  ports_mutex_unlock(&g_identity_mutex);
+  return identity ? 0 : -1;
+}
+
+int dtls_srtp_identity_set_key_type(DtlsSrtpKeyType key_type) {
+  DtlsSrtpIdentity* identity = NULL;
+  int ret = 0;
+
+  ports_mutex_lock(&g_identity_mutex);
+  if (key_type != g_identity_key_type) {
+    g_identity_key_type = key_type;
+    // only an identity already in use needs replacing, otherwise the first connection creates one
+    if (g_identity) {
+      if ((identity = dtls_srtp_identity_create(g_identity_path, g_identity_key_type, 0)) != NULL) {
+        dtls_srtp_identity_replace(identity);
+      } else {
+        ret = -1;
+      }
+    }
+  }
+  ports_mutex_unlock(&g_identity_mutex);
+  return ret;
+}
+
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+static int dtls_srtp_queue_push(DtlsSrtpQueue* queue, const uint8_t* buf, size_t len) {
+  int i;
+
+  if (queue->count >= DTLS_SRTP_OFFLOAD_QUEUE_SIZE || len > sizeof(queue->buf[0])) {
+    return -1;
+  }
+
+  i = (queue->head + queue->count) % DTLS_SRTP_OFFLOAD_QUEUE_SIZE;
+  memcpy(queue->buf[i], buf, len);
+  queue->len[i] = len;
+  queue->count++;
+  return 0;
+}
+
+static int dtls_srtp_queue_pop(DtlsSrtpQueue* queue, uint8_t* buf, size_t len) {
+  int ret;
+
+  if (queue->count == 0) {
+    return -1;
+  }
+
+  ret = queue->len[queue->head];
+  if (ret <= len) {
+    memcpy(buf, queue->buf[queue->head], ret);
+  } else {
+    ret = 0;
+  }
+  queue->head = (queue->head + 1) % DTLS_SRTP_OFFLOAD_QUEUE_SIZE;
+  queue->count--;
+  return ret;
+}
+
+// mbedtls on the worker writes here, a full queue loses the flight like the network would and the timer resends it
+static int dtls_srtp_offload_send(void* ctx, const uint8_t* buf, size_t len) {
+  DtlsSrtp* dtls_srtp = (DtlsSrtp*)ctx;
+
+  pthread_mutex_lock(&g_offload_mutex);
+  if (dtls_srtp_queue_push(&dtls_srtp->offload->outbox, buf, len) != 0) {
+    LOGW("Drop outgoing handshake datagram (%d)", (int)len);
+  }
+  pthread_mutex_unlock(&g_offload_mutex);
+  return len;
+}
+
+static int dtls_srtp_offload_recv(void* ctx, uint8_t* buf, size_t len) {
+  DtlsSrtp* dtls_srtp = (DtlsSrtp*)ctx;
+  int ret;
+
+  pthread_mutex_lock(&g_offload_mutex);
+  ret = dtls_srtp_queue_pop(&dtls_srtp->offload->inbox, buf, len);
+  pthread_mutex_unlock(&g_offload_mutex);
+  return ret <= 0 ? MBEDTLS_ERR_SSL_WANT_READ : ret;
+}
+
+// waits for a running job, after this the connection owns its mbedtls context again
+static void dtls_srtp_offload_free(DtlsSrtp* dtls_srtp) {
+  DtlsSrtpOffload* offload = dtls_srtp->offload;
+
+  if (offload == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_offload_mutex);
+  if (offload->busy && worker_pool_cancel(&offload->job) == 0) {
+    offload->busy = 0;
+  }
+  while (offload->busy) {
+    pthread_cond_wait(&g_offload_cond, &g_offload_mutex);
+  }
+  pthread_mutex_unlock(&g_offload_mutex);
+
+  // so dtls_srtp_reset_session releases the SRTP sessions of a run that was not published
+  if (offload->connected) {
+    dtls_srtp->state = DTLS_SRTP_STATE_CONNECTED;
+  }
+
+  mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp->udp_send, dtls_srtp->udp_recv, NULL);
+  dtls_srtp->offload = NULL;
+  free(offload);
+}
+#endif
+
+static const DtlsSrtpProfile* dtls_srtp_profile_find(uint16_t id) {
+  int i;
+
+  for (i = 0; i < DTLS_SRTP_PROFILE_COUNT; i++) {
+    if (dtls_srtp_profiles[i].id == id) {
+      return &dtls_srtp_profiles[i];
+    }
+  }
+  return NULL;
+}
+
+// libsrtp only has GCM when it is built against a crypto library, try a session once to find out
+static int dtls_srtp_profile_usable(const DtlsSrtpProfile* profile) {
+  unsigned char key[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH] = {0};
+  srtp_policy_t policy;
+  srtp_t srtp;
+
+  memset(&policy, 0, sizeof(policy));
+  profile->set_rtp(&policy.rtp);
+  profile->set_rtcp(&policy.rtcp);
+  policy.ssrc.type = ssrc_any_outbound;
+  policy.key = key;
+
+  if (srtp_create(&srtp, &policy) != srtp_err_status_ok) {
+    LOGI("SRTP profile %s not available", profile->name);
+    return 0;
+  }
+  srtp_dealloc(srtp);
+  return 1;
+}
+
+void dtls_srtp_profiles_probe() {
+  int i, count = 0;
+
+  for (i = 0; i < DTLS_SRTP_PROFILE_COUNT; i++) {
+    if (dtls_srtp_profile_usable(&dtls_srtp_profiles[i])) {
+      g_srtp_profiles[count++] = dtls_srtp_profiles[i].id;
+    }
+  }
+  g_srtp_profiles[count] = MBEDTLS_TLS_SRTP_UNSET;
+}
+
+static void dtls_srtp_conf_profiles(DtlsSrtp* dtls_srtp) {
+  static const mbedtls_ssl_srtp_profile fallback_profiles[] = {
+      MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_80,
+      MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_32,
+      MBEDTLS_TLS_SRTP_UNSET};
+
+  // an unpatched mbedtls rejects the whole list when it sees a GCM profile, and without
+  // peer_init the profiles were never probed
+  if (g_srtp_profiles[0] == MBEDTLS_TLS_SRTP_UNSET ||
+      mbedtls_ssl_conf_dtls_srtp_protection_profiles(&dtls_srtp->conf, g_srtp_profiles) != 0) {
+    mbedtls_ssl_conf_dtls_srtp_protection_profiles(&dtls_srtp->conf, fallback_profiles);
+  }
+}
+
+static int dtls_srtp_cpu_has_aes() {
+#if DTLS_SRTP_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes");
+#elif DTLS_SRTP_ARM64
+  return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+  return 0;
+#endif
+}
+
+// round trip through one profile, -1 if it is not available, -2 if the packet came back wrong
+static int dtls_srtp_self_check_profile(const DtlsSrtpProfile* profile, uint8_t* packet, const uint8_t* payload) {
+  unsigned char key[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH];
+  srtp_policy_t policy;
+  srtp_t out, in;
+  int size, ret = 0;
+
+  memset(key, 0x5a, sizeof(key));
+  memset(&policy, 0, sizeof(policy));
+  profile->set_rtp(&policy.rtp);
+  profile->set_rtcp(&policy.rtcp);
+  policy.key = key;
+
+  policy.ssrc.type = ssrc_any_outbound;
+  if (srtp_create(&out, &policy) != srtp_err_status_ok) {
+    return -1;
+  }
+  policy.ssrc.type = ssrc_any_inbound;
+  if (srtp_create(&in, &policy) != srtp_err_status_ok) {
+    srtp_dealloc(out);
+    return -1;
+  }
+
+  // V=2, PT 96, sequence number 1, SSRC 1
+  memset(packet, 0, 12);
+  packet[0] = 0x80;
+  packet[1] = 96;
+  packet[3] = 1;
+  packet[11] = 1;
+  memcpy(packet + 12, payload, DTLS_SRTP_SELF_CHECK_PAYLOAD);
+  size = 12 + DTLS_SRTP_SELF_CHECK_PAYLOAD;
+
+  if (srtp_protect(out, packet, &size) != srtp_err_status_ok ||
+      memcmp(packet + 12, payload, DTLS_SRTP_SELF_CHECK_PAYLOAD) == 0 ||
+      srtp_unprotect(in, packet, &size) != srtp_err_status_ok ||
+      size != 12 + DTLS_SRTP_SELF_CHECK_PAYLOAD || memcmp(packet + 12, payload, DTLS_SRTP_SELF_CHECK_PAYLOAD) != 0) {
+    ret = -2;
+  }
+
+  srtp_dealloc(out);
+  srtp_dealloc(in);
+  return ret;
+}
+
+int dtls_srtp_self_check() {
+  uint8_t* packet;
+  uint8_t* payload;
+  int i, ret = 0, has_aes = dtls_srtp_cpu_has_aes();
+
+  packet = (uint8_t*)malloc(12 + DTLS_SRTP_SELF_CHECK_PAYLOAD + SRTP_MAX_TRAILER_LEN);
+  payload = (uint8_t*)malloc(DTLS_SRTP_SELF_CHECK_PAYLOAD);
+  if (packet == NULL || payload == NULL) {
+    free(packet);
+    free(payload);
+    return -1;
+  }
+
+  for (i = 0; i < DTLS_SRTP_SELF_CHECK_PAYLOAD; i++) {
+    payload[i] = i * 7;
+  }
+
+  LOGI("SRTP crypto %s, %s, CPU AES instructions %s", CONFIG_SRTP_CRYPTO, srtp_get_version_string(), has_aes ? "yes" : "no");
+
+  for (i = 0; i < DTLS_SRTP_PROFILE_COUNT; i++) {
+    switch (dtls_srtp_self_check_profile(&dtls_srtp_profiles[i], packet, payload)) {
+      case 0:
+        LOGD("SRTP %s ok", dtls_srtp_profiles[i].name);
+        break;
+      case -1:
+        LOGI("SRTP %s not available", dtls_srtp_profiles[i].name);
+        // every DTLS-SRTP peer has to support it
+        if (dtls_srtp_profiles[i].id == MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_80) {
+          ret = -1;
+        }
+        break;
+      default:
+        LOGE("SRTP %s self check failed", dtls_srtp_profiles[i].name);
+        ret = -1;
+        break;
+    }
+  }
+
+  if (has_aes && strcmp(CONFIG_SRTP_CRYPTO, "builtin") == 0) {
+    LOGW("libsrtp uses its portable AES, build with -DSRTP_CRYPTO=mbedtls or openssl to use the CPU's");
+  }
+
+  free(packet);
+  free(payload);
+  return ret;
+}
+
 #if CONFIG_MBEDTLS_DEBUG
 static void dtls_srtp_debug(void* ctx, int level, const char* file, int line, const char* str) {
   LOGD("%s:%04d: %s", file, line, str);
@@ -146,41 +765,37 @@ static void dtls_srtp_debug(void* ctx, int level, const char* file, int line, co
 #endif
 
 int dtls_srtp_init(DtlsSrtp* dtls_srtp, DtlsSrtpRole role, void* user_data) {
-  static const mbedtls_ssl_srtp_profile default_profiles[] = {
-      MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_80,
-      MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_32,
-      MBEDTLS_TLS_SRTP_NULL_HMAC_SHA1_80,
-      MBEDTLS_TLS_SRTP_NULL_HMAC_SHA1_32,
-      MBEDTLS_TLS_SRTP_UNSET};
 
   dtls_srtp->role = role;
   dtls_srtp->state = DTLS_SRTP_STATE_INIT;
   dtls_srtp->user_data = user_data;
   dtls_srtp->udp_send = dtls_srtp_udp_send;
   dtls_srtp->udp_recv = dtls_srtp_udp_recv;
+  dtls_srtp->offload = NULL;
 
   mbedtls_ssl_config_init(&dtls_srtp->conf);
   mbedtls_ssl_init(&dtls_srtp->ssl);
 
-  mbedtls_x509_crt_init(&dtls_srtp->cert);
-  mbedtls_pk_init(&dtls_srtp->pkey);
-  mbedtls_entropy_init(&dtls_srtp->entropy);
-  mbedtls_ctr_drbg_init(&dtls_srtp->ctr_drbg);
 #if CONFIG_MBEDTLS_DEBUG
   mbedtls_debug_set_threshold(3);
   mbedtls_ssl_conf_dbg(&dtls_srtp->conf, dtls_srtp_debug, NULL);
 #endif
-  dtls_srtp_selfsign_cert(dtls_srtp);
+
+  if ((dtls_srtp->identity = dtls_srtp_identity_acquire()) == NULL) {
+    LOGE("Failed to create DTLS identity");
+    return -1;
+  }
 
   mbedtls_ssl_conf_verify(&dtls_srtp->conf, dtls_srtp_cert_verify, NULL);
 
   mbedtls_ssl_conf_authmode(&dtls_srtp->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
 
-  mbedtls_ssl_conf_ca_chain(&dtls_srtp->conf, &dtls_srtp->cert, NULL);
+  mbedtls_ssl_conf_ca_chain(&dtls_srtp->conf, &dtls_srtp->identity->cert, NULL);
 
-  mbedtls_ssl_conf_own_cert(&dtls_srtp->conf, &dtls_srtp->cert, &dtls_srtp->pkey);
+  mbedtls_ssl_conf_own_cert(&dtls_srtp->conf, &dtls_srtp->identity->cert, &dtls_srtp->identity->pkey);
 
-  mbedtls_ssl_conf_rng(&dtls_srtp->conf, mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+  // one DRBG for the process instead of seeding one per connection
+  mbedtls_ssl_conf_rng(&dtls_srtp->conf, utils_random, NULL);
 
   mbedtls_ssl_conf_read_timeout(&dtls_srtp->conf, 1000);
 
@@ -192,7 +807,7 @@ int dtls_srtp_init(DtlsSrtp* dtls_srtp, DtlsSrtpRole role, void* user_data) {
 
     mbedtls_ssl_cookie_init(&dtls_srtp->cookie_ctx);
 
-    mbedtls_ssl_cookie_setup(&dtls_srtp->cookie_ctx, mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+    mbedtls_ssl_cookie_setup(&dtls_srtp->cookie_ctx, utils_random, NULL);
 
     mbedtls_ssl_conf_dtls_cookies(&dtls_srtp->conf, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check, &dtls_srtp->cookie_ctx);
 
@@ -203,11 +818,19 @@ int dtls_srtp_init(DtlsSrtp* dtls_srtp, DtlsSrtpRole role, void* user_data) {
                                 MBEDTLS_SSL_PRESET_DEFAULT);
   }
 
-  dtls_srtp_x509_digest(&dtls_srtp->cert, dtls_srtp->local_fingerprint);
+  snprintf(dtls_srtp->local_fingerprint, sizeof(dtls_srtp->local_fingerprint), "%s", dtls_srtp->identity->fingerprint);
 
   LOGD("local fingerprint: %s", dtls_srtp->local_fingerprint);
 
-  mbedtls_ssl_conf_dtls_srtp_protection_profiles(&dtls_srtp->conf, default_profiles);
+  dtls_srtp_conf_profiles(dtls_srtp);
+
+  // after the defaults, which would replace them
+  mbedtls_ssl_conf_ciphersuites(&dtls_srtp->conf, dtls_srtp_ciphersuites);
+#if CONFIG_MBEDTLS_2_X
+  mbedtls_ssl_conf_curves(&dtls_srtp->conf, dtls_srtp_groups);
+#else
+  mbedtls_ssl_conf_groups(&dtls_srtp->conf, dtls_srtp_groups);
+#endif
 
   mbedtls_ssl_conf_srtp_mki_value_supported(&dtls_srtp->conf, MBEDTLS_SSL_DTLS_SRTP_MKI_UNSUPPORTED);
 
@@ -215,17 +838,22 @@ int dtls_srtp_init(DtlsSrtp* dtls_srtp, DtlsSrtpRole role, void* user_data) {
 
   mbedtls_ssl_setup(&dtls_srtp->ssl, &dtls_srtp->conf);
 
+  // records of a flight are packed into as few datagrams as fit
+  mbedtls_ssl_set_mtu(&dtls_srtp->ssl, DTLS_SRTP_HANDSHAKE_MTU);
+
   return 0;
 }
 
 void dtls_srtp_deinit(DtlsSrtp* dtls_srtp) {
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  dtls_srtp_offload_free(dtls_srtp);
+#endif
   mbedtls_ssl_free(&dtls_srtp->ssl);
   mbedtls_ssl_config_free(&dtls_srtp->conf);
 
-  mbedtls_x509_crt_free(&dtls_srtp->cert);
-  mbedtls_pk_free(&dtls_srtp->pkey);
-  mbedtls_entropy_free(&dtls_srtp->entropy);
-  mbedtls_ctr_drbg_free(&dtls_srtp->ctr_drbg);
+  // after the config that points at its certificate and key
+  dtls_srtp_identity_release(dtls_srtp->identity);
+  dtls_srtp->identity = NULL;
 
   if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
     mbedtls_ssl_cookie_free(&dtls_srtp->cookie_ctx);
@@ -241,9 +869,20 @@ static int dtls_srtp_key_derivation(DtlsSrtp* dtls_srtp, const unsigned char* ma
   int ret;
   const char* dtls_srtp_label = "EXTRACTOR-dtls_srtp";
   uint8_t key_material[DTLS_SRTP_KEY_MATERIAL_LENGTH];
-  // Export keying material
+  mbedtls_dtls_srtp_info negotiated;
+  const DtlsSrtpProfile* profile;
+
+  mbedtls_ssl_get_dtls_srtp_negotiation_result(&dtls_srtp->ssl, &negotiated);
+  if ((profile = dtls_srtp_profile_find(negotiated.MBEDTLS_PRIVATE(chosen_dtls_srtp_profile))) == NULL) {
+    LOGE("No SRTP profile negotiated");
+    return -1;
+  }
+  dtls_srtp->srtp_profile = profile->id;
+  LOGI("SRTP profile %s", profile->name);
+
+  // Export keying material, both keys then both salts at the profile's lengths
   if ((ret = mbedtls_ssl_tls_prf(tls_prf_type, master_secret, secret_len, dtls_srtp_label,
-                                 randbytes, randbytes_len, key_material, sizeof(key_material))) != 0) {
+                                 randbytes, randbytes_len, key_material, 2 * (profile->key_length + profile->salt_length))) != 0) {
     LOGE("mbedtls_ssl_tls_prf failed(%d)", ret);
     return ret;
   }
@@ -271,9 +910,9 @@ static int dtls_srtp_key_derivation(DtlsSrtp* dtls_srtp, const unsigned char* ma
 #endif
 
   const uint8_t* client_key = key_material;
-  const uint8_t* server_key = client_key + SRTP_MASTER_KEY_LENGTH;
-  const uint8_t* client_salt = server_key + SRTP_MASTER_KEY_LENGTH;
-  const uint8_t* server_salt = client_salt + SRTP_MASTER_SALT_LENGTH;
+  const uint8_t* server_key = client_key + profile->key_length;
+  const uint8_t* client_salt = server_key + profile->key_length;
+  const uint8_t* server_salt = client_salt + profile->salt_length;
   uint8_t *local_key, *remote_key, *local_salt, *remote_salt;
   if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
     local_key = server_key;
@@ -290,11 +929,11 @@ static int dtls_srtp_key_derivation(DtlsSrtp* dtls_srtp, const unsigned char* ma
 
   memset(&dtls_srtp->remote_policy, 0, sizeof(dtls_srtp->remote_policy));
 
-  srtp_crypto_policy_set_rtp_default(&dtls_srtp->remote_policy.rtp);
-  srtp_crypto_policy_set_rtcp_default(&dtls_srtp->remote_policy.rtcp);
+  profile->set_rtp(&dtls_srtp->remote_policy.rtp);
+  profile->set_rtcp(&dtls_srtp->remote_policy.rtcp);
 
-  memcpy(dtls_srtp->remote_policy_key, remote_key, SRTP_MASTER_KEY_LENGTH);
-  memcpy(dtls_srtp->remote_policy_key + SRTP_MASTER_KEY_LENGTH, remote_salt, SRTP_MASTER_SALT_LENGTH);
+  memcpy(dtls_srtp->remote_policy_key, remote_key, profile->key_length);
+  memcpy(dtls_srtp->remote_policy_key + profile->key_length, remote_salt, profile->salt_length);
 
   dtls_srtp->remote_policy.ssrc.type = ssrc_any_inbound;
   dtls_srtp->remote_policy.key = dtls_srtp->remote_policy_key;
@@ -310,11 +949,11 @@ static int dtls_srtp_key_derivation(DtlsSrtp* dtls_srtp, const unsigned char* ma
   // derive outbounds keys
   memset(&dtls_srtp->local_policy, 0, sizeof(dtls_srtp->local_policy));
 
-  srtp_crypto_policy_set_rtp_default(&dtls_srtp->local_policy.rtp);
-  srtp_crypto_policy_set_rtcp_default(&dtls_srtp->local_policy.rtcp);
+  profile->set_rtp(&dtls_srtp->local_policy.rtp);
+  profile->set_rtcp(&dtls_srtp->local_policy.rtcp);
 
-  memcpy(dtls_srtp->local_policy_key, local_key, SRTP_MASTER_KEY_LENGTH);
-  memcpy(dtls_srtp->local_policy_key + SRTP_MASTER_KEY_LENGTH, local_salt, SRTP_MASTER_SALT_LENGTH);
+  memcpy(dtls_srtp->local_policy_key, local_key, profile->key_length);
+  memcpy(dtls_srtp->local_policy_key + profile->key_length, local_salt, profile->salt_length);
 
   dtls_srtp->local_policy.ssrc.type = ssrc_any_outbound;
   dtls_srtp->local_policy.key = dtls_srtp->local_policy_key;
@@ -326,6 +965,13 @@ static int dtls_srtp_key_derivation(DtlsSrtp* dtls_srtp, const unsigned char* ma
   }
 
   LOGI("Created outbound SRTP session");
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  // other threads read the state, the loop publishes it once the run is over
+  if (dtls_srtp->offload) {
+    dtls_srtp->offload->connected = 1;
+    return 0;
+  }
+#endif
   dtls_srtp->state = DTLS_SRTP_STATE_CONNECTED;
   return 0;
 }
@@ -366,12 +1012,45 @@ static void dtls_srtp_key_derivation_cb(void* context,
 #endif
 }
 
-static int dtls_srtp_do_handshake(DtlsSrtp* dtls_srtp) {
-  int ret;
+static void dtls_srtp_timer_set(void* ctx, uint32_t int_ms, uint32_t fin_ms) {
+  DtlsSrtpTimer* timer = (DtlsSrtpTimer*)ctx;
 
-  static mbedtls_timing_delay_context timer;
+  timer->int_ms = int_ms;
+  timer->fin_ms = fin_ms;
+  if (fin_ms != 0) {
+    timer->start = ports_get_epoch_time();
+  }
+}
 
-  mbedtls_ssl_set_timer_cb(&dtls_srtp->ssl, &timer, mbedtls_timing_set_delay, mbedtls_timing_get_delay);
+// -1 cancelled, 0 running, 1 intermediate and 2 final delay passed
+static int dtls_srtp_timer_get(void* ctx) {
+  DtlsSrtpTimer* timer = (DtlsSrtpTimer*)ctx;
+  uint32_t elapsed;
+
+  if (timer->fin_ms == 0) {
+    return -1;
+  }
+
+  elapsed = ports_get_epoch_time() - timer->start;
+  if (elapsed >= timer->fin_ms) {
+    return 2;
+  } else if (elapsed >= timer->int_ms) {
+    return 1;
+  }
+  return 0;
+}
+
+static void dtls_srtp_handshake_start(DtlsSrtp* dtls_srtp) {
+  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
+    // ICE already checked the address, the cookie only has to match the ClientHello
+    unsigned char client_ip[] = "test";
+
+    mbedtls_ssl_session_reset(&dtls_srtp->ssl);
+
+    mbedtls_ssl_set_client_transport_id(&dtls_srtp->ssl, client_ip, sizeof(client_ip));
+  }
+
+  mbedtls_ssl_set_timer_cb(&dtls_srtp->ssl, &dtls_srtp->timer, dtls_srtp_timer_set, dtls_srtp_timer_get);
 
 #if CONFIG_MBEDTLS_2_X
   mbedtls_ssl_conf_export_keys_ext_cb(&dtls_srtp->conf, dtls_srtp_key_derivation_cb, dtls_srtp);
@@ -379,95 +1058,203 @@ static int dtls_srtp_do_handshake(DtlsSrtp* dtls_srtp) {
   mbedtls_ssl_set_export_keys_cb(&dtls_srtp->ssl, dtls_srtp_key_derivation_cb, dtls_srtp);
 #endif
 
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  if (dtls_srtp->offload) {
+    mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp_offload_send, dtls_srtp_offload_recv, NULL);
+  } else {
+    mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp->udp_send, dtls_srtp->udp_recv, NULL);
+  }
+#else
   mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp->udp_send, dtls_srtp->udp_recv, NULL);
+#endif
+}
 
-  do {
-    ret = mbedtls_ssl_handshake(&dtls_srtp->ssl);
+static int dtls_srtp_verify_remote(DtlsSrtp* dtls_srtp) {
+  const mbedtls_x509_crt* remote_crt;
 
-  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  if ((remote_crt = mbedtls_ssl_get_peer_cert(&dtls_srtp->ssl)) == NULL) {
+    LOGE("no remote fingerprint");
+    return -1;
+  }
 
-  return ret;
+  dtls_srtp_x509_digest(remote_crt, dtls_srtp->actual_remote_fingerprint);
+
+  if (strncmp(dtls_srtp->remote_fingerprint, dtls_srtp->actual_remote_fingerprint, DTLS_SRTP_FINGERPRINT_LENGTH) != 0) {
+    LOGE("Actual and Expected Fingerprint mismatch: %s %s",
+         dtls_srtp->remote_fingerprint,
+         dtls_srtp->actual_remote_fingerprint);
+    return -1;
+  }
+
+  return 0;
 }
 
-static int dtls_srtp_handshake_server(DtlsSrtp* dtls_srtp) {
+static int dtls_srtp_handshake_advance(DtlsSrtp* dtls_srtp) {
   int ret;
 
-  while (1) {
-    unsigned char client_ip[] = "test";
+  if (dtls_srtp->state == DTLS_SRTP_STATE_INIT) {
+    dtls_srtp_handshake_start(dtls_srtp);
+    dtls_srtp->state = DTLS_SRTP_STATE_HANDSHAKE;
+  }
 
-    mbedtls_ssl_session_reset(&dtls_srtp->ssl);
+  ret = mbedtls_ssl_handshake(&dtls_srtp->ssl);
 
-    mbedtls_ssl_set_client_transport_id(&dtls_srtp->ssl, client_ip, sizeof(client_ip));
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 1;
 
-    ret = dtls_srtp_do_handshake(dtls_srtp);
+  } else if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+    // the client comes back with the cookie
+    LOGD("DTLS hello verification requested");
+    dtls_srtp_handshake_start(dtls_srtp);
+    return 1;
 
-    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
-      LOGD("DTLS hello verification requested");
+  } else if (ret != 0) {
+    LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x", (unsigned int)-ret);
+    return -1;
+  }
 
-    } else if (ret != 0) {
-      LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x", (unsigned int)-ret);
+  LOGD("DTLS %s handshake done", dtls_srtp->role == DTLS_SRTP_ROLE_SERVER ? "server" : "client");
 
-      break;
+  return dtls_srtp_verify_remote(dtls_srtp);
+}
 
-    } else {
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+// on a worker, everything that arrived since the last run goes through mbedtls, signatures and key derivation included
+static void dtls_srtp_offload_run(WorkerJob* job) {
+  DtlsSrtpOffload* offload = (DtlsSrtpOffload*)job;
+  int ret, pending;
+
+  do {
+    ret = dtls_srtp_handshake_advance(offload->dtls_srtp);
+
+    pthread_mutex_lock(&g_offload_mutex);
+    pending = offload->inbox.count;
+    pthread_mutex_unlock(&g_offload_mutex);
+
+  } while (ret > 0 && pending > 0);
+
+  pthread_mutex_lock(&g_offload_mutex);
+  offload->result = ret;
+  offload->busy = 0;
+  pthread_cond_broadcast(&g_offload_cond);
+  pthread_mutex_unlock(&g_offload_mutex);
+}
+
+static void dtls_srtp_offload_flush(DtlsSrtp* dtls_srtp) {
+  DtlsSrtpOffload* offload = dtls_srtp->offload;
+  int len;
+
+  while (1) {
+    pthread_mutex_lock(&g_offload_mutex);
+    len = dtls_srtp_queue_pop(&offload->outbox, offload->buf, sizeof(offload->buf));
+    pthread_mutex_unlock(&g_offload_mutex);
+
+    if (len < 0) {
       break;
     }
+    dtls_srtp->udp_send(dtls_srtp, offload->buf, len);
   }
+}
 
-  LOGD("DTLS server handshake done");
+// on the loop, the worker only touches the handshake between busy being set and cleared, so the
+// state and the retransmission timer are read here only when it is not
+static int dtls_srtp_offload_step(DtlsSrtp* dtls_srtp) {
+  DtlsSrtpOffload* offload = dtls_srtp->offload;
+  int ret, len, start = 0, run = 0;
 
-  return ret;
-}
+  if (offload == NULL) {
+    if ((offload = (DtlsSrtpOffload*)calloc(1, sizeof(DtlsSrtpOffload))) == NULL) {
+      return dtls_srtp_handshake_advance(dtls_srtp);
+    }
+    offload->job.run = dtls_srtp_offload_run;
+    offload->dtls_srtp = dtls_srtp;
+    offload->result = 1;
+    dtls_srtp->offload = offload;
+  }
 
-static int dtls_srtp_handshake_client(DtlsSrtp* dtls_srtp) {
-  int ret;
+  if (dtls_srtp->state == DTLS_SRTP_STATE_INIT) {
+    dtls_srtp_handshake_start(dtls_srtp);
+    dtls_srtp->state = DTLS_SRTP_STATE_HANDSHAKE;
+    start = 1;
+  }
 
-  ret = dtls_srtp_do_handshake(dtls_srtp);
-  if (ret != 0) {
-    LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x\n\n", (unsigned int)-ret);
+  if ((len = dtls_srtp->udp_recv(dtls_srtp, offload->buf, sizeof(offload->buf))) > 0) {
+    pthread_mutex_lock(&g_offload_mutex);
+    dtls_srtp_queue_push(&offload->inbox, offload->buf, len);
+    pthread_mutex_unlock(&g_offload_mutex);
+  }
+
+  // the worker never touches the socket, its flights go out from here
+  dtls_srtp_offload_flush(dtls_srtp);
+
+  pthread_mutex_lock(&g_offload_mutex);
+  if (offload->busy) {
+    ret = 1;
+  } else {
+    if (offload->connected) {
+      dtls_srtp->state = DTLS_SRTP_STATE_CONNECTED;
+    }
+
+    if ((ret = offload->result) > 0 &&
+        (offload->inbox.count > 0 || start || dtls_srtp_timer_get(&dtls_srtp->timer) > 0)) {
+      offload->busy = 1;
+      if (worker_pool_submit(&offload->job) != 0) {
+        run = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_offload_mutex);
+
+  // the pool stopped under us
+  if (run) {
+    dtls_srtp_offload_run(&offload->job);
+    ret = 1;
   }
 
-  LOGD("DTLS client handshake done");
+  if (ret <= 0) {
+    // the last flight came out of the same run that finished
+    dtls_srtp_offload_flush(dtls_srtp);
+    dtls_srtp_offload_free(dtls_srtp);
+  }
 
   return ret;
 }
 
-int dtls_srtp_handshake(DtlsSrtp* dtls_srtp, Address* addr) {
-  int ret;
-  dtls_srtp->remote_addr = addr;
+#endif
 
-  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
-    ret = dtls_srtp_handshake_server(dtls_srtp);
-  } else {
-    ret = dtls_srtp_handshake_client(dtls_srtp);
+int dtls_srtp_handshake_step(DtlsSrtp* dtls_srtp) {
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  if (dtls_srtp->offload || worker_pool_size() > 0) {
+    return dtls_srtp_offload_step(dtls_srtp);
   }
+#endif
+  return dtls_srtp_handshake_advance(dtls_srtp);
+}
 
-  const mbedtls_x509_crt* remote_crt;
-  if ((remote_crt = mbedtls_ssl_get_peer_cert(&dtls_srtp->ssl)) != NULL) {
-    dtls_srtp_x509_digest(remote_crt, dtls_srtp->actual_remote_fingerprint);
-
-    if (strncmp(dtls_srtp->remote_fingerprint, dtls_srtp->actual_remote_fingerprint, DTLS_SRTP_FINGERPRINT_LENGTH) != 0) {
-      LOGE("Actual and Expected Fingerprint mismatch: %s %s",
-           dtls_srtp->remote_fingerprint,
-           dtls_srtp->actual_remote_fingerprint);
-      return -1;
-    }
+int dtls_srtp_handshake(DtlsSrtp* dtls_srtp, Address* addr) {
+  int ret;
 
-  } else {
-    LOGE("no remote fingerprint");
-    return -1;
-  }
+  dtls_srtp->remote_addr = addr;
 
-  mbedtls_dtls_srtp_info dtls_srtp_negotiation_result;
-  mbedtls_ssl_get_dtls_srtp_negotiation_result(&dtls_srtp->ssl, &dtls_srtp_negotiation_result);
+  // udp_recv blocks here, a worker would only add a thread switch per flight
+  while ((ret = dtls_srtp_handshake_advance(dtls_srtp)) > 0) {
+  }
 
   return ret;
 }
 
 void dtls_srtp_reset_session(DtlsSrtp* dtls_srtp) {
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  dtls_srtp_offload_free(dtls_srtp);
+#endif
+
   if (dtls_srtp->state == DTLS_SRTP_STATE_CONNECTED) {
     srtp_dealloc(dtls_srtp->srtp_in);
     srtp_dealloc(dtls_srtp->srtp_out);
+  }
+
+  // a handshake may have been cut off half way
+  if (dtls_srtp->state != DTLS_SRTP_STATE_INIT) {
     mbedtls_ssl_session_reset(&dtls_srtp->ssl);
   }
 
@@ -489,10 +1276,12 @@ int dtls_srtp_read(DtlsSrtp* dtls_srtp, unsigned char* buf, size_t len) {
 
   memset(buf, 0, len);
 
-  do {
-    ret = mbedtls_ssl_read(&dtls_srtp->ssl, buf, len);
+  ret = mbedtls_ssl_read(&dtls_srtp->ssl, buf, len);
 
-  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  // the record was not application data, or udp_recv has nothing more
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 0;
+  }
 
   return ret;
 }
@@ -506,6 +1295,19 @@ int dtls_srtp_probe(uint8_t* buf) {
   return (buf[0] == 0x17);
 }
 
+const uint8_t* dtls_srtp_client_hello_random(const uint8_t* buf, int len) {
+  // RFC 6347 4.1 and 4.2.2, 13 bytes of record header and 12 of handshake header before client_version and random
+  if (buf == NULL || len < 13 + 12 + 2 + DTLS_SRTP_RANDOM_LENGTH)
+    return NULL;
+
+  // epoch 0 and the first fragment of a ClientHello
+  if (buf[0] != MBEDTLS_SSL_MSG_HANDSHAKE || buf[3] != 0 || buf[4] != 0 ||
+      buf[13] != MBEDTLS_SSL_HS_CLIENT_HELLO || buf[19] != 0 || buf[20] != 0 || buf[21] != 0)
+    return NULL;
+
+  return buf + 13 + 12 + 2;
+}
+
 void dtls_srtp_decrypt_rtp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* bytes) {
   srtp_unprotect(dtls_srtp->srtp_in, packet, bytes);
 }
@@ -521,3 +1323,30 @@ void dtls_srtp_encrypt_rtp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* byt
 void dtls_srtp_encrypt_rctp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* bytes) {
   srtp_protect_rtcp(dtls_srtp->srtp_out, packet, bytes);
 }
+
+int dtls_srtp_encrypt_rtp_packets(DtlsSrtp* dtls_srtp, uint8_t** packets, int* bytes, int count) {
+  int i, done = 0;
+
+  // back to back on one session the stream and cipher state stay hot in cache
+  for (i = 0; i < count; i++) {
+    if (srtp_protect(dtls_srtp->srtp_out, packets[i], &bytes[i]) == srtp_err_status_ok) {
+      done++;
+    } else {
+      bytes[i] = 0;
+    }
+  }
+  return done;
+}
+
+int dtls_srtp_decrypt_rtp_packets(DtlsSrtp* dtls_srtp, uint8_t** packets, int* bytes, int count) {
+  int i, done = 0;
+
+  for (i = 0; i < count; i++) {
+    if (srtp_unprotect(dtls_srtp->srtp_in, packets[i], &bytes[i]) == srtp_err_status_ok) {
+      done++;
+    } else {
+      bytes[i] = 0;
+    }
+  }
+  return done;
+}
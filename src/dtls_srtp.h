@@ -4,12 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <mbedtls/ctr_drbg.h>
-#include <mbedtls/entropy.h>
 #include <mbedtls/pk.h>
 #include <mbedtls/ssl.h>
 #include <mbedtls/ssl_cookie.h>
-#include <mbedtls/timing.h>
 #include <mbedtls/x509_crt.h>
 #include <mbedtls/x509_csr.h>
 
@@ -17,10 +14,14 @@
 
 #include "address.h"
 
-#define SRTP_MASTER_KEY_LENGTH 16
+// the largest of the negotiable profiles, AES-256-GCM keys and AES-CM salts
+#define SRTP_MASTER_KEY_LENGTH 32
 #define SRTP_MASTER_SALT_LENGTH 14
-#define DTLS_SRTP_KEY_MATERIAL_LENGTH 60
+#define DTLS_SRTP_KEY_MATERIAL_LENGTH (2 * (SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH))
 #define DTLS_SRTP_FINGERPRINT_LENGTH 160
+// room for a PEM private key and certificate
+#define DTLS_SRTP_IDENTITY_PEM_SIZE 8192
+#define DTLS_SRTP_IDENTITY_PATH_LENGTH 256
 
 typedef enum DtlsSrtpRole {
 
@@ -29,6 +30,14 @@ typedef enum DtlsSrtpRole {
 
 } DtlsSrtpRole;
 
+// same order as PeerIdentityKey
+typedef enum DtlsSrtpKeyType {
+
+  DTLS_SRTP_KEY_ECDSA_P256 = 0,
+  DTLS_SRTP_KEY_RSA,
+
+} DtlsSrtpKeyType;
+
 typedef enum DtlsSrtpState {
 
   DTLS_SRTP_STATE_INIT,
@@ -37,15 +46,33 @@ typedef enum DtlsSrtpState {
 
 } DtlsSrtpState;
 
+// retransmission timer mbedtls polls on every handshake step, in ports_get_epoch_time() milliseconds
+typedef struct DtlsSrtpTimer {
+  uint32_t start;
+  uint32_t int_ms;
+  uint32_t fin_ms;  // 0 when cancelled
+
+} DtlsSrtpTimer;
+
+// certificate, key and fingerprint shared by every connection until the identity is rotated
+typedef struct DtlsSrtpIdentity {
+  mbedtls_x509_crt cert;
+  mbedtls_pk_context pkey;
+  char fingerprint[DTLS_SRTP_FINGERPRINT_LENGTH];
+  uint32_t created_time;  // seconds, generated or loaded
+  int refs;
+
+} DtlsSrtpIdentity;
+
 typedef struct DtlsSrtp {
   // MbedTLS
   mbedtls_ssl_context ssl;
   mbedtls_ssl_config conf;
   mbedtls_ssl_cookie_ctx cookie_ctx;
-  mbedtls_x509_crt cert;
-  mbedtls_pk_context pkey;
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
+  DtlsSrtpIdentity* identity;
+  DtlsSrtpTimer timer;
+  // set while the handshake runs on a worker
+  struct DtlsSrtpOffload* offload;
 
   // SRTP
   srtp_policy_t remote_policy;
@@ -54,6 +81,7 @@ typedef struct DtlsSrtp {
   srtp_t srtp_out;
   unsigned char remote_policy_key[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH];
   unsigned char local_policy_key[SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH];
+  uint16_t srtp_profile;  // negotiated, MBEDTLS_TLS_SRTP_*
 
   int (*udp_send)(void* ctx, const unsigned char* buf, size_t len);
   int (*udp_recv)(void* ctx, unsigned char* buf, size_t len);
@@ -71,12 +99,61 @@ typedef struct DtlsSrtp {
 
 } DtlsSrtp;
 
+/**
+ * @brief check every SRTP profile round trips one packet through libsrtp and log
+ * the crypto backend in use, call after srtp_init
+ * @return -1 if a profile is broken or AES_CM_128_HMAC_SHA1_80 is missing
+ */
+int dtls_srtp_self_check();
+
+/**
+ * @brief find the SRTP profiles libsrtp can run and offer them in DTLS, call once after srtp_init
+ * and before any connection, without it only the AES_CM_128 profiles are offered
+ */
+void dtls_srtp_profiles_probe();
+
 int dtls_srtp_init(DtlsSrtp* dtls_srtp, DtlsSrtpRole role, void* user_data);
 
 void dtls_srtp_deinit(DtlsSrtp* dtls_srtp);
 
-int dtls_srtp_create_cert(DtlsSrtp* dtls_srtp);
-
+/**
+ * @brief take a reference to the shared identity, it is created on first use
+ * and again once it is older than CONFIG_DTLS_IDENTITY_LIFETIME
+ */
+DtlsSrtpIdentity* dtls_srtp_identity_acquire();
+
+void dtls_srtp_identity_release(DtlsSrtpIdentity* identity);
+
+/**
+ * @brief generate a new shared identity, connections keep the one they hold until deinit
+ */
+int dtls_srtp_identity_rotate();
+
+/**
+ * @brief load the shared identity from a PEM file, or generate it and save it there,
+ * rotated identities are saved there as well
+ */
+int dtls_srtp_identity_set_file(const char* path);
+
+/**
+ * @brief key type for identities generated from now on, replaces the shared identity if it differs.
+ * An identity loaded from a file keeps the key type it was saved with
+ */
+int dtls_srtp_identity_set_key_type(DtlsSrtpKeyType key_type);
+
+/**
+ * @brief advance the handshake with whatever udp_recv has, without waiting for more.
+ * udp_recv returns MBEDTLS_ERR_SSL_WANT_READ when nothing arrived and flights are
+ * retransmitted once their timer expires, so call it on every loop iteration.
+ * With the worker pool running the mbedtls work and key derivation move to a worker,
+ * udp_recv and udp_send are still only called from here.
+ * @return 1 in progress, 0 done and the remote fingerprint matched, -1 failed
+ */
+int dtls_srtp_handshake_step(DtlsSrtp* dtls_srtp);
+
+/**
+ * @brief run the handshake to completion, for a udp_recv that blocks
+ */
 int dtls_srtp_handshake(DtlsSrtp* dtls_srtp, Address* addr);
 
 void dtls_srtp_reset_session(DtlsSrtp* dtls_srtp);
@@ -89,6 +166,13 @@ void dtls_srtp_sctp_to_dtls(DtlsSrtp* dtls_srtp, uint8_t* packet, int bytes);
 
 int dtls_srtp_probe(uint8_t* buf);
 
+#define DTLS_SRTP_RANDOM_LENGTH 32
+
+/**
+ * @brief the client random of a plaintext ClientHello record, NULL for any other record
+ */
+const uint8_t* dtls_srtp_client_hello_random(const uint8_t* buf, int len);
+
 void dtls_srtp_decrypt_rtp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* bytes);
 
 void dtls_srtp_decrypt_rtcp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* bytes);
@@ -97,4 +181,15 @@ void dtls_srtp_encrypt_rtp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* byt
 
 void dtls_srtp_encrypt_rctp_packet(DtlsSrtp* dtls_srtp, uint8_t* packet, int* bytes);
 
+/**
+ * @brief protect RTP packets of this session in place, each needs room for the trailer
+ * @return the number protected, a packet that fails is left with 0 bytes
+ */
+int dtls_srtp_encrypt_rtp_packets(DtlsSrtp* dtls_srtp, uint8_t** packets, int* bytes, int count);
+
+/**
+ * @return the number unprotected, a packet that fails is left with 0 bytes
+ */
+int dtls_srtp_decrypt_rtp_packets(DtlsSrtp* dtls_srtp, uint8_t** packets, int* bytes, int count);
+
 #endif  // DTLS_SRTP_H_
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "address.h"
+#include "fec.h"
+#include "utils.h"
+
+// The protected bit string of a media packet is the first 8 bytes of its RTP header,
+// with the sequence number replaced by the length after the fixed header, followed by
+// everything after the SSRC.
+static void fec_get_header(const uint8_t* packet, size_t size, uint8_t* header) {
+  memcpy(header, packet, 8);
+  header[2] = (size - sizeof(RtpHeader)) >> 8;
+  header[3] = (size - sizeof(RtpHeader)) & 0xff;
+}
+
+void fec_xor(uint8_t* dst, const uint8_t* src, size_t len) {
+  size_t i = 0;
+  uint64_t a, b;
+
+#if defined(__AVX2__)
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(x, y));
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(x, y));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= len; i += 16) {
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+  }
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+
+  for (; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+void fec_encoder_init(FecEncoder* fec_encoder, uint8_t type, uint32_t ssrc, RtpOnPacket on_packet, void* user_data) {
+  memset(fec_encoder, 0, sizeof(FecEncoder));
+  fec_encoder->on_packet = on_packet;
+  fec_encoder->user_data = user_data;
+  fec_encoder->type = type;
+  fec_encoder->ssrc = ssrc;
+  fec_encoder->next_group_size = CONFIG_FEC_MAX_GROUP_SIZE;
+}
+
+void fec_encoder_set_loss(FecEncoder* fec_encoder, uint8_t fraction_lost) {
+  int group_size = CONFIG_FEC_MAX_GROUP_SIZE;
+
+  // a repair packet recovers one loss per group, spend about twice the loss rate on it
+  if (fraction_lost > 0) {
+    group_size = 128 / fraction_lost;
+  }
+
+  if (group_size < CONFIG_FEC_MIN_GROUP_SIZE) {
+    group_size = CONFIG_FEC_MIN_GROUP_SIZE;
+  } else if (group_size > CONFIG_FEC_MAX_GROUP_SIZE) {
+    group_size = CONFIG_FEC_MAX_GROUP_SIZE;
+  }
+
+  if (group_size > FEC_MAX_GROUP_SIZE) {
+    group_size = FEC_MAX_GROUP_SIZE;
+  }
+
+  if (group_size != fec_encoder->next_group_size) {
+    LOGD("FEC group size %d", group_size);
+    fec_encoder->next_group_size = group_size;
+  }
+}
+
+void fec_encoder_flush(FecEncoder* fec_encoder) {
+  RtpHeader* rtp_header = (RtpHeader*)fec_encoder->buf;
+  uint8_t* fec_header = fec_encoder->buf + sizeof(RtpHeader) + 4;
+  size_t size = sizeof(RtpHeader) + 4 + FEC_HEADER_SIZE + fec_encoder->parity_size - 8;
+
+  if (fec_encoder->count == 0) {
+    return;
+  }
+
+  memset(fec_encoder->buf, 0, sizeof(RtpHeader) + 4);
+  rtp_header->version = 2;
+  rtp_header->csrccount = 1;
+  rtp_header->type = fec_encoder->type;
+  rtp_header->seq_number = htons(fec_encoder->seq_number++);
+  rtp_header->timestamp = htonl(fec_encoder->timestamp);
+  rtp_header->ssrc = htonl(fec_encoder->ssrc);
+  // the protected SSRC is carried in the CSRC list
+  rtp_header->csrc[0] = htonl(fec_encoder->media_ssrc);
+
+  memcpy(fec_header, fec_encoder->parity, 8);
+  // R=0, F=0: flexible mask
+  fec_header[0] &= 0x3f;
+  fec_header[8] = fec_encoder->base_seq_number >> 8;
+  fec_header[9] = fec_encoder->base_seq_number & 0xff;
+  // k=1, the 15-bit mask is complete
+  fec_header[10] = 0x80 | (fec_encoder->mask >> 8);
+  fec_header[11] = fec_encoder->mask & 0xff;
+  memcpy(fec_header + FEC_HEADER_SIZE, fec_encoder->parity + 8, fec_encoder->parity_size - 8);
+
+  fec_encoder->count = 0;
+  fec_encoder->mask = 0;
+  fec_encoder->on_packet(fec_encoder->buf, size, fec_encoder->user_data);
+}
+
+int fec_encoder_put(FecEncoder* fec_encoder, const uint8_t* packet, size_t size) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  uint8_t header[8];
+  uint16_t offset;
+  size_t parity_size;
+
+  if (size < sizeof(RtpHeader) || size - 4 > sizeof(fec_encoder->parity)) {
+    return 0;
+  }
+
+  offset = ntohs(rtp_header->seq_number) - fec_encoder->base_seq_number;
+  if (fec_encoder->count > 0 && offset >= FEC_MAX_GROUP_SIZE) {
+    fec_encoder_flush(fec_encoder);
+  }
+
+  if (fec_encoder->count == 0) {
+    fec_encoder->group_size = fec_encoder->next_group_size;
+    fec_encoder->base_seq_number = ntohs(rtp_header->seq_number);
+    fec_encoder->media_ssrc = ntohl(rtp_header->ssrc);
+    fec_encoder->parity_size = 0;
+    offset = 0;
+  }
+
+  // shorter packets are zero padded
+  parity_size = size - 4;
+  if (parity_size > fec_encoder->parity_size) {
+    memset(fec_encoder->parity + fec_encoder->parity_size, 0, parity_size - fec_encoder->parity_size);
+    fec_encoder->parity_size = parity_size;
+  }
+
+  fec_get_header(packet, size, header);
+  fec_xor(fec_encoder->parity, header, 8);
+  fec_xor(fec_encoder->parity + 8, packet + sizeof(RtpHeader), size - sizeof(RtpHeader));
+
+  fec_encoder->mask |= 1 << (FEC_MAX_GROUP_SIZE - 1 - offset);
+  fec_encoder->timestamp = ntohl(rtp_header->timestamp);
+  fec_encoder->count++;
+
+  // close the group at the end of a frame if it is half full, the repair packet should not wait for the next frame
+  return fec_encoder->count >= fec_encoder->group_size || (rtp_header->markerbit && 2 * fec_encoder->count >= fec_encoder->group_size);
+}
+
+int fec_decoder_init(FecDecoder* fec_decoder, uint32_t media_ssrc, int capacity) {
+  fec_decoder->media_ssrc = media_ssrc;
+  return rtp_history_init(&fec_decoder->history, capacity, CONFIG_FEC_REPAIR_WINDOW);
+}
+
+void fec_decoder_deinit(FecDecoder* fec_decoder) {
+  rtp_history_deinit(&fec_decoder->history);
+}
+
+int fec_decoder_put(FecDecoder* fec_decoder, const uint8_t* packet, size_t size, uint32_t now) {
+  if (rtp_history_get(&fec_decoder->history, rtp_get_seq_number((uint8_t*)packet), now)) {
+    return -1;
+  }
+
+  rtp_history_put(&fec_decoder->history, packet, size, now);
+  return 0;
+}
+
+int fec_decoder_recover(FecDecoder* fec_decoder, uint8_t* packet, size_t size, uint32_t now) {
+  int i;
+  int header_size;
+  int missing_count = 0;
+  uint8_t header[8];
+  uint8_t* fec_header;
+  uint16_t base_seq_number;
+  uint16_t mask;
+  uint16_t missing = 0;
+  size_t repair_size;
+  size_t length;
+  RtpHistoryEntry* entry;
+  RtpHeader* rtp_header = (RtpHeader*)fec_decoder->buf;
+
+  if (fec_decoder->history.entries == NULL) {
+    return -1;
+  }
+
+  header_size = rtp_get_header_size(packet, size);
+  if (header_size < 0 || size < header_size + FEC_HEADER_SIZE) {
+    return -1;
+  }
+
+  fec_header = packet + header_size;
+  repair_size = size - header_size - FEC_HEADER_SIZE;
+
+  // retransmission (R) and fixed mask (F) formats are not used by us
+  if ((fec_header[0] & 0xc0) || !(fec_header[10] & 0x80)) {
+    LOGD("Unsupported FlexFEC packet");
+    return -1;
+  }
+
+  if (((RtpHeader*)packet)->csrccount < 1 || ntohl(((RtpHeader*)packet)->csrc[0]) != fec_decoder->media_ssrc) {
+    return -1;
+  }
+
+  if (sizeof(RtpHeader) + repair_size > sizeof(fec_decoder->buf)) {
+    return -1;
+  }
+
+  base_seq_number = (fec_header[8] << 8) | fec_header[9];
+  mask = ((fec_header[10] & 0x7f) << 8) | fec_header[11];
+
+  for (i = 0; i < FEC_MAX_GROUP_SIZE; i++) {
+    if ((mask & (1 << (FEC_MAX_GROUP_SIZE - 1 - i))) &&
+        rtp_history_get(&fec_decoder->history, base_seq_number + i, now) == NULL) {
+      missing = base_seq_number + i;
+      missing_count++;
+    }
+  }
+
+  // nothing lost, or more than a single XOR can rebuild
+  if (missing_count != 1) {
+    return 0;
+  }
+
+  memcpy(fec_decoder->buf, fec_header, 8);
+  memcpy(fec_decoder->buf + sizeof(RtpHeader), fec_header + FEC_HEADER_SIZE, repair_size);
+
+  for (i = 0; i < FEC_MAX_GROUP_SIZE; i++) {
+    if (!(mask & (1 << (FEC_MAX_GROUP_SIZE - 1 - i))) || (uint16_t)(base_seq_number + i) == missing) {
+      continue;
+    }
+
+    entry = rtp_history_get(&fec_decoder->history, base_seq_number + i, now);
+    if (entry->size - sizeof(RtpHeader) > repair_size) {
+      return -1;
+    }
+
+    fec_get_header(entry->packet, entry->size, header);
+    fec_xor(fec_decoder->buf, header, 8);
+    fec_xor(fec_decoder->buf + sizeof(RtpHeader), entry->packet + sizeof(RtpHeader), entry->size - sizeof(RtpHeader));
+  }
+
+  length = (fec_decoder->buf[2] << 8) | fec_decoder->buf[3];
+  if (length > repair_size) {
+    return -1;
+  }
+
+  fec_decoder->buf[0] = 0x80 | (fec_decoder->buf[0] & 0x3f);
+  rtp_header->seq_number = htons(missing);
+  rtp_header->ssrc = htonl(fec_decoder->media_ssrc);
+
+  // a second repair packet covering the same group must not rebuild it again
+  rtp_history_put(&fec_decoder->history, fec_decoder->buf, sizeof(RtpHeader) + length, now);
+
+  LOGD("FEC recovered %d", missing);
+  return sizeof(RtpHeader) + length;
+}
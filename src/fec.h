@@ -0,0 +1,85 @@
+#ifndef FEC_H_
+#define FEC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "rtp.h"
+
+// RFC 8627 FlexFEC header with a single 15-bit mask (R=0, F=0)
+#define FEC_HEADER_SIZE 12
+// mask bits usable in the first mask word
+#define FEC_MAX_GROUP_SIZE 15
+// received media packets kept for recovery, two groups plus reordering
+#define FEC_DECODER_HISTORY_SIZE 32
+
+typedef struct FecEncoder {
+  RtpOnPacket on_packet;
+  void* user_data;
+  uint8_t type;
+  uint32_t ssrc;
+  uint16_t seq_number;
+
+  int group_size;
+  int next_group_size;
+  int count;
+  uint16_t base_seq_number;
+  uint16_t mask;
+  uint32_t media_ssrc;
+  uint32_t timestamp;
+  size_t parity_size;
+
+  // media packets are protected as sent, transport-cc extension included
+  uint8_t parity[CONFIG_MTU + RTP_TWCC_EXTENSION_SIZE];
+  uint8_t buf[CONFIG_MTU + 128];
+
+} FecEncoder;
+
+typedef struct FecDecoder {
+  uint32_t media_ssrc;
+  RtpHistory history;
+  uint8_t buf[CONFIG_MTU + 128];
+
+} FecDecoder;
+
+/**
+ * @brief dst ^= src over len bytes
+ */
+void fec_xor(uint8_t* dst, const uint8_t* src, size_t len);
+
+void fec_encoder_init(FecEncoder* fec_encoder, uint8_t type, uint32_t ssrc, RtpOnPacket on_packet, void* user_data);
+
+/**
+ * @brief adapt the protection level to the fraction lost reported by RTCP (0-255)
+ */
+void fec_encoder_set_loss(FecEncoder* fec_encoder, uint8_t fraction_lost);
+
+/**
+ * @brief add a media packet to the current group as it is sent before SRTP, header extensions included
+ * @return 1 if the group is complete and fec_encoder_flush should be called once the media packet is sent
+ */
+int fec_encoder_put(FecEncoder* fec_encoder, const uint8_t* packet, size_t size);
+
+/**
+ * @brief emit the repair packet of the current group through on_packet
+ */
+void fec_encoder_flush(FecEncoder* fec_encoder);
+
+int fec_decoder_init(FecDecoder* fec_decoder, uint32_t media_ssrc, int capacity);
+
+void fec_decoder_deinit(FecDecoder* fec_decoder);
+
+/**
+ * @brief remember a received media packet
+ * @return -1 if it was already received or recovered
+ */
+int fec_decoder_put(FecDecoder* fec_decoder, const uint8_t* packet, size_t size, uint32_t now);
+
+/**
+ * @brief try to rebuild a media packet from a repair packet
+ * @return size of the recovered packet in fec_decoder->buf, 0 if nothing to recover, -1 on error
+ */
+int fec_decoder_recover(FecDecoder* fec_decoder, uint8_t* packet, size_t size, uint32_t now);
+
+#endif  // FEC_H_
@@ -15,6 +15,8 @@ static uint8_t ice_candidate_type_preference(IceCandidateType type) {
   switch (type) {
     case ICE_CANDIDATE_TYPE_HOST:
       return 126;
+    case ICE_CANDIDATE_TYPE_PRFLX:
+      return 110;
     case ICE_CANDIDATE_TYPE_SRFLX:
       return 100;
     case ICE_CANDIDATE_TYPE_RELAY:
@@ -28,9 +30,29 @@ static uint16_t ice_candidate_local_preference(IceCandidate* candidate) {
   return candidate->addr.port;
 }
 
-static void ice_candidate_priority(IceCandidate* candidate) {
+static uint32_t ice_candidate_compute_priority(IceCandidate* candidate, IceCandidateType type) {
   // priority = (2^24)*(type preference) + (2^8)*(local preference) + (256 - component ID)
-  candidate->priority = (1 << 24) * ice_candidate_type_preference(candidate->type) + (1 << 8) * ice_candidate_local_preference(candidate) + (256 - candidate->component);
+  return (1 << 24) * ice_candidate_type_preference(type) + (1 << 8) * ice_candidate_local_preference(candidate) + (256 - candidate->component);
+}
+
+static void ice_candidate_priority(IceCandidate* candidate) {
+  candidate->priority = ice_candidate_compute_priority(candidate, candidate->type);
+}
+
+uint32_t ice_candidate_get_prflx_priority(IceCandidate* candidate) {
+  return ice_candidate_compute_priority(candidate, ICE_CANDIDATE_TYPE_PRFLX);
+}
+
+void ice_candidate_pair_create(IceCandidatePair* pair, IceCandidate* local, IceCandidate* remote, int controlling) {
+  uint64_t g = controlling ? local->priority : remote->priority;
+  uint64_t d = controlling ? remote->priority : local->priority;
+
+  memset(pair, 0, sizeof(IceCandidatePair));
+  pair->local = local;
+  pair->remote = remote;
+  pair->state = ICE_CANDIDATE_STATE_FROZEN;
+  // RFC 8445 6.1.2.3: 2^32*MIN(G,D) + 2*MAX(G,D) + (G>D?1:0)
+  pair->priority = ((g < d ? g : d) << 32) + 2 * (g > d ? g : d) + (g > d ? 1 : 0);
 }
 
 void ice_candidate_create(IceCandidate* candidate, int foundation, IceCandidateType type, Address* addr) {
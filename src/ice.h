@@ -48,8 +48,10 @@ struct IceCandidatePair {
   IceCandidateState state;
   IceCandidate* local;
   IceCandidate* remote;
-  int conncheck;
+  int conncheck;  // binding requests sent in the current transaction
   uint64_t priority;
+  uint32_t transaction_id[3];
+  uint32_t next_check_time;
 };
 
 void ice_candidate_create(IceCandidate* ice_candidate, int foundation, IceCandidateType type, Address* addr);
@@ -60,4 +62,11 @@ int ice_candidate_from_description(IceCandidate* candidate, char* description, c
 
 int ice_candidate_get_local_address(IceCandidate* candidate, Address* address);
 
+/**
+ * @brief priority the candidate would have if learned as peer reflexive, sent in the PRIORITY attribute
+ */
+uint32_t ice_candidate_get_prflx_priority(IceCandidate* candidate);
+
+void ice_candidate_pair_create(IceCandidatePair* pair, IceCandidate* local, IceCandidate* remote, int controlling);
+
 #endif  // ICE_H_
@@ -0,0 +1,194 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pacer.h"
+#include "rtp.h"
+#include "utils.h"
+
+// pace a bit above the estimate so encoder bursts drain instead of piling up
+#define PACER_RATE_FACTOR 1.5f
+// unused budget is carried into the next call for at most this long (ms)
+#define PACER_MAX_BURST 5
+// longer gaps between two calls are not credited (ms)
+#define PACER_MAX_ELAPSED 30
+
+static void pacer_queue_push(PacerQueue* queue, PacerPacket* packet) {
+  packet->next = NULL;
+  if (queue->tail) {
+    queue->tail->next = packet;
+  } else {
+    queue->head = packet;
+  }
+  queue->tail = packet;
+}
+
+static PacerPacket* pacer_queue_pop(PacerQueue* queue) {
+  PacerPacket* packet = queue->head;
+  if (packet) {
+    queue->head = packet->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+  }
+  return packet;
+}
+
+int pacer_init(Pacer* pacer,
+               void (*on_packet)(uint8_t* packet, size_t size, PacerPriority priority, void* user_data),
+               void (*on_drop)(PacerPriority priority, void* user_data),
+               void* user_data) {
+  memset(pacer, 0, sizeof(Pacer));
+  pacer->on_packet = on_packet;
+  pacer->on_drop = on_drop;
+  pacer->user_data = user_data;
+  pacer->rate = CONFIG_BWE_START_BITRATE * PACER_RATE_FACTOR;
+
+  if (ports_mutex_init(&pacer->mutex) < 0) {
+    LOGE("Failed to create pacer mutex");
+    return -1;
+  }
+
+  return 0;
+}
+
+void pacer_deinit(Pacer* pacer) {
+  int i;
+  PacerPacket* packet;
+
+  ports_mutex_lock(&pacer->mutex);
+  for (i = 0; i < PACER_PRIORITY_COUNT; i++) {
+    while ((packet = pacer_queue_pop(&pacer->queues[i]))) {
+      free(packet);
+    }
+  }
+  pacer->queue_size = 0;
+  ports_mutex_unlock(&pacer->mutex);
+
+  ports_mutex_destroy(&pacer->mutex);
+}
+
+void pacer_set_rate(Pacer* pacer, uint32_t bitrate) {
+  pacer->rate = bitrate * PACER_RATE_FACTOR;
+}
+
+static void pacer_drop(Pacer* pacer, PacerPriority priority) {
+  PacerPacket* packet = pacer_queue_pop(&pacer->queues[priority]);
+  if (packet) {
+    pacer->queue_size -= packet->size;
+    pacer->dropped++;
+    free(packet);
+  }
+}
+
+// the rest of a frame is useless once one of its packets is gone, they share the RTP timestamp
+static void pacer_drop_frame(Pacer* pacer) {
+  PacerQueue* queue = &pacer->queues[PACER_PRIORITY_VIDEO];
+  uint32_t timestamp = rtp_get_timestamp(queue->head->data);
+
+  do {
+    pacer_drop(pacer, PACER_PRIORITY_VIDEO);
+  } while (queue->head && rtp_get_timestamp(queue->head->data) == timestamp);
+}
+
+int pacer_enqueue(Pacer* pacer, const uint8_t* data, size_t size, size_t room, PacerPriority priority, uint32_t now) {
+  PacerPacket* packet;
+  int dropped = 0;
+
+  packet = (PacerPacket*)malloc(sizeof(PacerPacket) + size + room);
+  if (packet == NULL) {
+    LOGE("Failed to allocate pacer packet");
+    return -1;
+  }
+
+  memcpy(packet->data, data, size);
+  packet->size = size;
+  packet->enqueue_time = now;
+
+  ports_mutex_lock(&pacer->mutex);
+
+  // make room at the expense of the oldest video frames
+  while (pacer->queue_size + size > CONFIG_PACER_MAX_QUEUE_SIZE && pacer->queues[PACER_PRIORITY_VIDEO].head) {
+    pacer_drop_frame(pacer);
+    dropped = 1;
+  }
+
+  if (pacer->queue_size + size > CONFIG_PACER_MAX_QUEUE_SIZE && priority != PACER_PRIORITY_AUDIO) {
+    ports_mutex_unlock(&pacer->mutex);
+    free(packet);
+    LOGW("Pacer queue full");
+    return -1;
+  }
+
+  pacer_queue_push(&pacer->queues[priority], packet);
+  pacer->queue_size += size;
+
+  ports_mutex_unlock(&pacer->mutex);
+
+  if (dropped && pacer->on_drop) {
+    pacer->on_drop(PACER_PRIORITY_VIDEO, pacer->user_data);
+  }
+
+  return 0;
+}
+
+void pacer_process(Pacer* pacer, uint32_t now) {
+  int i;
+  int dropped = 0;
+  uint32_t elapsed = now - pacer->last_process_time;
+  int32_t max_budget = pacer->rate / 8 * PACER_MAX_BURST / 1000;
+  PacerPacket* packet;
+
+  if (pacer->last_process_time == 0 || elapsed > PACER_MAX_ELAPSED) {
+    elapsed = PACER_MAX_ELAPSED;
+  }
+  pacer->last_process_time = now;
+
+  // bytes we may send, debt from a large packet carries over, the interval since the last call
+  // is credited in full so a loop slower than PACER_MAX_BURST still reaches the rate
+  if (pacer->budget > max_budget) {
+    pacer->budget = max_budget;
+  }
+  pacer->budget += (int32_t)((uint64_t)pacer->rate * elapsed / 8000);
+
+  ports_mutex_lock(&pacer->mutex);
+  while (pacer->queues[PACER_PRIORITY_VIDEO].head &&
+         now - pacer->queues[PACER_PRIORITY_VIDEO].head->enqueue_time > CONFIG_PACER_MAX_QUEUE_DELAY) {
+    pacer_drop_frame(pacer);
+    dropped = 1;
+  }
+  ports_mutex_unlock(&pacer->mutex);
+
+  if (dropped) {
+    LOGD("Drop stale video, %" PRIu32 " dropped so far", pacer->dropped);
+    if (pacer->on_drop) {
+      pacer->on_drop(PACER_PRIORITY_VIDEO, pacer->user_data);
+    }
+  }
+
+  for (;;) {
+    packet = NULL;
+
+    ports_mutex_lock(&pacer->mutex);
+    for (i = 0; i < PACER_PRIORITY_COUNT; i++) {
+      if (pacer->queues[i].head == NULL) {
+        continue;
+      }
+      // audio is small and latency bound, it never waits for the budget
+      if (i == PACER_PRIORITY_AUDIO || pacer->budget > 0) {
+        packet = pacer_queue_pop(&pacer->queues[i]);
+        pacer->queue_size -= packet->size;
+      }
+      break;
+    }
+    ports_mutex_unlock(&pacer->mutex);
+
+    if (packet == NULL) {
+      break;
+    }
+
+    pacer->budget -= packet->size;
+    pacer->on_packet(packet->data, packet->size, (PacerPriority)i, pacer->user_data);
+    free(packet);
+  }
+}
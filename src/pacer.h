@@ -0,0 +1,73 @@
+#ifndef PACER_H_
+#define PACER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "ports.h"
+
+typedef enum PacerPriority {
+
+  PACER_PRIORITY_AUDIO = 0,
+  PACER_PRIORITY_RETRANSMISSION,
+  PACER_PRIORITY_VIDEO,
+  PACER_PRIORITY_DATA,
+  PACER_PRIORITY_COUNT,
+
+} PacerPriority;
+
+typedef struct PacerPacket PacerPacket;
+
+struct PacerPacket {
+  PacerPacket* next;
+  uint32_t enqueue_time;
+  size_t size;
+  uint8_t data[0];
+};
+
+typedef struct PacerQueue {
+  PacerPacket* head;
+  PacerPacket* tail;
+
+} PacerQueue;
+
+typedef struct Pacer {
+  PortsMutex mutex;
+  PacerQueue queues[PACER_PRIORITY_COUNT];
+  size_t queue_size;
+  uint32_t rate;
+  int32_t budget;
+  uint32_t last_process_time;
+  uint32_t dropped;
+
+  void (*on_packet)(uint8_t* packet, size_t size, PacerPriority priority, void* user_data);
+  void (*on_drop)(PacerPriority priority, void* user_data);
+  void* user_data;
+
+} Pacer;
+
+int pacer_init(Pacer* pacer,
+               void (*on_packet)(uint8_t* packet, size_t size, PacerPriority priority, void* user_data),
+               void (*on_drop)(PacerPriority priority, void* user_data),
+               void* user_data);
+
+void pacer_deinit(Pacer* pacer);
+
+/**
+ * @brief set the pacing rate in bps
+ */
+void pacer_set_rate(Pacer* pacer, uint32_t bitrate);
+
+/**
+ * @brief copy a packet into the queue of its priority, thread safe
+ * @param[in] room extra bytes to allocate after the packet, for headers added when it is sent
+ */
+int pacer_enqueue(Pacer* pacer, const uint8_t* packet, size_t size, size_t room, PacerPriority priority, uint32_t now);
+
+/**
+ * @brief drop stale video frames and release the packets the budget allows through on_packet
+ */
+void pacer_process(Pacer* pacer, uint32_t now);
+
+#endif  // PACER_H_
@@ -3,20 +3,53 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "dtls_srtp.h"
 #include "peer.h"
 #include "sctp.h"
 #include "utils.h"
+#include "worker.h"
 
 int peer_init() {
   if (srtp_init() != srtp_err_status_ok) {
     LOGE("libsrtp init failed");
     return -1;
   }
+
+  if (dtls_srtp_self_check() != 0) {
+    LOGE("SRTP self check failed");
+    return -1;
+  }
+  dtls_srtp_profiles_probe();
   sctp_usrsctp_init();
+
+  // connections fall back to handshaking on their own loop without workers
+  if (worker_pool_start(CONFIG_DTLS_HANDSHAKE_WORKERS) != 0) {
+    LOGW("DTLS handshake workers not started");
+  }
   return 0;
 }
 
 void peer_deinit() {
+  worker_pool_stop();
   srtp_shutdown();
   sctp_usrsctp_deinit();
 }
+
+int peer_set_identity_file(const char* path) {
+  return dtls_srtp_identity_set_file(path);
+}
+
+int peer_rotate_identity() {
+  return dtls_srtp_identity_rotate();
+}
+
+int peer_set_identity_key(PeerIdentityKey key) {
+  switch (key) {
+    case PEER_IDENTITY_KEY_ECDSA_P256:
+      return dtls_srtp_identity_set_key_type(DTLS_SRTP_KEY_ECDSA_P256);
+    case PEER_IDENTITY_KEY_RSA:
+      return dtls_srtp_identity_set_key_type(DTLS_SRTP_KEY_RSA);
+    default:
+      return -1;
+  }
+}
@@ -8,10 +8,34 @@ extern "C" {
 #include "peer_connection.h"
 #include "peer_signaling.h"
 
+typedef enum PeerIdentityKey {
+
+  PEER_IDENTITY_KEY_ECDSA_P256 = 0,  // small certificate and fast signatures
+  PEER_IDENTITY_KEY_RSA,             // for peers or mbedtls builds without ECDHE-ECDSA
+
+} PeerIdentityKey;
+
 int peer_init();
 
 void peer_deinit();
 
+/**
+ * @brief keep the DTLS certificate in a PEM file so restarts skip key generation,
+ * it is generated and saved there when the file is missing. Call before creating connections.
+ */
+int peer_set_identity_file(const char* path);
+
+/**
+ * @brief use a new DTLS certificate for connections created from now on
+ */
+int peer_rotate_identity();
+
+/**
+ * @brief key type of the DTLS certificate, a certificate of another type is replaced.
+ * Call before creating connections.
+ */
+int peer_set_identity_key(PeerIdentityKey key);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,14 +4,35 @@
 #include <unistd.h>
 
 #include "agent.h"
+#include "bwe.h"
 #include "config.h"
 #include "dtls_srtp.h"
+#include "fec.h"
+#include "pacer.h"
 #include "peer_connection.h"
 #include "ports.h"
 #include "rtcp.h"
 #include "rtp.h"
 #include "sctp.h"
 #include "sdp.h"
+#include "worker.h"
+
+// queued RTP packets get the transport-cc extension and the SRTP trailer in place
+#define PEER_CONNECTION_PACKET_ROOM (RTP_TWCC_EXTENSION_SIZE + 32)
+
+// keyframes asked for after pacer drops are at least this far apart (ms), the encoder needs
+// time to produce one and the pacer time to drain it
+#define PEER_CONNECTION_KEYFRAME_REQUEST_INTERVAL 1000
+
+// batches go to the workers only when the pool is built
+#define PEER_CONNECTION_PARALLEL_SEND (CONFIG_SRTP_PARALLEL && CONFIG_DTLS_HANDSHAKE_WORKERS > 0 && CONFIG_RTP_SEND_BATCH > 1)
+
+// one batch fills while a worker protects and sends the other
+#define PEER_CONNECTION_SEND_BATCHES (PEER_CONNECTION_PARALLEL_SEND ? 2 : 1)
+
+#if PEER_CONNECTION_PARALLEL_SEND
+#include <pthread.h>
+#endif
 
 #define STATE_CHANGED(pc, curr_state)                                 \
   if (pc->oniceconnectionstatechange && pc->state != curr_state) {    \
@@ -19,12 +40,29 @@
     pc->state = curr_state;                                           \
   }
 
+#if CONFIG_RTP_SEND_BATCH > 1
+typedef struct PeerConnectionBatch {
+  WorkerJob job;
+  PeerConnection* pc;
+  uint8_t packets[CONFIG_RTP_SEND_BATCH][CONFIG_MTU + PEER_CONNECTION_PACKET_ROOM];
+  int sizes[CONFIG_RTP_SEND_BATCH];
+  int count;
+
+} PeerConnectionBatch;
+#endif
+
 struct PeerConnection {
   PeerConfiguration config;
   PeerConnectionState state;
   Agent agent;
-  DtlsSrtp dtls_srtp;
+  // the association in use, and the spare that runs a handshake the remote starts beside it
+  DtlsSrtp dtls_srtps[2];
+  DtlsSrtp* dtls_srtp;
+  DtlsSrtp* dtls_srtp_next;
+  int b_dtls_rehandshake;
   Sctp sctp;
+  // the loop holds it while it runs, descriptions and candidates from other threads wait for it
+  PortsMutex mutex;
 
   char sdp[CONFIG_SDP_BUFFER_SIZE];
 
@@ -32,48 +70,383 @@ struct PeerConnection {
   void (*oniceconnectionstatechange)(PeerConnectionState state, void* user_data);
   void (*on_connected)(void* userdata);
   void (*on_receiver_packet_loss)(float fraction_loss, uint32_t total_loss, void* user_data);
+  void (*on_round_trip_time)(uint32_t rtt, void* user_data);
 
   uint8_t temp_buf[CONFIG_MTU];
   uint8_t agent_buf[CONFIG_MTU];
   int agent_ret;
   int b_local_description_created;
+  int ice_candidate_index;
 
   RtpEncoder artp_encoder;
   RtpEncoder vrtp_encoder;
   RtpDecoder vrtp_decoder;
   RtpDecoder artp_decoder;
 
+  RtpEncoder vrtx_encoder;
+  RtpHistory vrtp_history;
+  RtpNackTracker vrtp_nack_tracker;
+  FecEncoder vfec_encoder;
+  FecDecoder vfec_decoder;
+  Rtcp rtcp;
+  Bwe bwe;
+  Pacer pacer;
+  uint32_t bitrate_estimate;
+  // transport-cc id stamped on sent packets and the ones each remote media section carries
+  uint8_t twcc_ext_id;
+  uint8_t remote_vtwcc_ext_id;
+  uint8_t remote_atwcc_ext_id;
+  uint32_t keyframe_request_time;
+
+#if CONFIG_RTP_SEND_BATCH > 1
+  PeerConnectionBatch send_batches[PEER_CONNECTION_SEND_BATCHES];
+  PeerConnectionBatch* send_batch;
+  // a worker owns the SRTP session and the selected pair, guarded by g_send_mutex
+  int send_busy;
+#endif
+
   uint32_t remote_assrc;
   uint32_t remote_vssrc;
+  uint32_t remote_vrtx_ssrc;
+  uint32_t remote_vfec_ssrc;
+  // payload types of the RTX and FlexFEC streams of the remote video section, 0 when absent
+  uint8_t remote_vrtx_pt;
+  uint8_t remote_vfec_pt;
+
+  // an ICE restart keeps the o= session id, a ClientHello with another random starts a handshake in the spare
+  char remote_session_id[32];
+  uint8_t dtls_client_random[DTLS_SRTP_RANDOM_LENGTH];
 };
 
+#if PEER_CONNECTION_PARALLEL_SEND
+static pthread_mutex_t g_send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_send_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+#if CONFIG_RTP_SEND_BATCH > 1
+static void peer_connection_send_batch(PeerConnection* pc, PeerConnectionBatch* batch) {
+  uint8_t* packets[CONFIG_RTP_SEND_BATCH];
+  int i, count = 0;
+
+  for (i = 0; i < batch->count; i++) {
+    packets[i] = batch->packets[i];
+  }
+  dtls_srtp_encrypt_rtp_packets(pc->dtls_srtp, packets, batch->sizes, batch->count);
+
+  // drop the ones that failed to protect
+  for (i = 0; i < batch->count; i++) {
+    if (batch->sizes[i] > 0) {
+      packets[count] = packets[i];
+      batch->sizes[count++] = batch->sizes[i];
+    }
+  }
+
+  if (count > 0) {
+    agent_send_batch(&pc->agent, (const uint8_t**)packets, batch->sizes, count);
+  }
+  batch->count = 0;
+}
+#endif
+
+#if PEER_CONNECTION_PARALLEL_SEND
+static void peer_connection_send_batch_run(WorkerJob* job) {
+  PeerConnectionBatch* batch = (PeerConnectionBatch*)job;
+  PeerConnection* pc = batch->pc;
+
+  peer_connection_send_batch(pc, batch);
+
+  pthread_mutex_lock(&g_send_mutex);
+  pc->send_busy = 0;
+  pthread_cond_broadcast(&g_send_cond);
+  pthread_mutex_unlock(&g_send_mutex);
+}
+#endif
+
+// call before touching the outbound SRTP session or the selected pair outside a batch
+static void peer_connection_wait_rtp(PeerConnection* pc) {
+#if PEER_CONNECTION_PARALLEL_SEND
+  pthread_mutex_lock(&g_send_mutex);
+  while (pc->send_busy) {
+    pthread_cond_wait(&g_send_cond, &g_send_mutex);
+  }
+  pthread_mutex_unlock(&g_send_mutex);
+#endif
+}
+
+static void peer_connection_flush_rtp(PeerConnection* pc) {
+#if CONFIG_RTP_SEND_BATCH > 1
+  PeerConnectionBatch* batch = pc->send_batch;
+
+  if (batch->count == 0) {
+    return;
+  }
+
+  // batches of one connection go out one at a time and in order
+  peer_connection_wait_rtp(pc);
+
+#if PEER_CONNECTION_PARALLEL_SEND
+  // a relayed pair shares the TURN stream and its TLS state with the loop, only direct ones go to a worker
+  if (worker_pool_size() > 0 && pc->agent.selected_pair &&
+      pc->agent.selected_pair->local->type != ICE_CANDIDATE_TYPE_RELAY) {
+    batch->pc = pc;
+    batch->job.run = peer_connection_send_batch_run;
+    pthread_mutex_lock(&g_send_mutex);
+    pc->send_busy = 1;
+    pthread_mutex_unlock(&g_send_mutex);
+
+    if (worker_pool_submit(&batch->job) == 0) {
+      pc->send_batch = batch == &pc->send_batches[0] ? &pc->send_batches[1] : &pc->send_batches[0];
+      return;
+    }
+
+    pthread_mutex_lock(&g_send_mutex);
+    pc->send_busy = 0;
+    pthread_mutex_unlock(&g_send_mutex);
+  }
+#endif
+
+  peer_connection_send_batch(pc, batch);
+#endif
+}
+
+// the packet as it goes on the wire, with its transport-cc extension
+static size_t peer_connection_stamp_rtp(PeerConnection* pc, uint8_t* data, size_t size) {
+  uint32_t now = ports_get_epoch_time();
+  rtcp_on_rtp_sent(&pc->rtcp, data, size, now);
+
+  if (pc->twcc_ext_id) {
+    size = rtp_set_transport_cc(data, size, pc->twcc_ext_id, bwe_on_packet_sent(&pc->bwe, size + RTP_TWCC_EXTENSION_SIZE, now));
+  }
+
+  return size;
+}
+
+static void peer_connection_send_rtp(PeerConnection* pc, uint8_t* data, size_t size) {
+#if CONFIG_RTP_SEND_BATCH > 1
+  // everything reaches here from pacer_process, which flushes what is left when it returns
+  if (size <= CONFIG_MTU + RTP_TWCC_EXTENSION_SIZE) {
+    memcpy(pc->send_batch->packets[pc->send_batch->count], data, size);
+    pc->send_batch->sizes[pc->send_batch->count++] = size;
+    if (pc->send_batch->count == CONFIG_RTP_SEND_BATCH) {
+      peer_connection_flush_rtp(pc);
+    }
+    return;
+  }
+  // keep the order
+  peer_connection_flush_rtp(pc);
+  peer_connection_wait_rtp(pc);
+#endif
+
+  dtls_srtp_encrypt_rtp_packet(pc->dtls_srtp, data, (int*)&size);
+  agent_send(&pc->agent, data, size);
+}
+
 static void peer_connection_outgoing_rtp_packet(uint8_t* data, size_t size, void* user_data) {
   PeerConnection* pc = (PeerConnection*)user_data;
-  dtls_srtp_encrypt_rtp_packet(&pc->dtls_srtp, data, (int*)&size);
-  agent_send(&pc->agent, data, size);
+
+  size = peer_connection_stamp_rtp(pc, data, size);
+  peer_connection_send_rtp(pc, data, size);
 }
 
-static int peer_connection_dtls_srtp_recv(void* ctx, unsigned char* buf, size_t len) {
-  int recv_max = 0;
-  int ret = -1;
-  DtlsSrtp* dtls_srtp = (DtlsSrtp*)ctx;
-  PeerConnection* pc = (PeerConnection*)dtls_srtp->user_data;
+static void peer_connection_outgoing_video_rtp_packet(uint8_t* data, size_t size, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+  int fec_ready = 0;
+  // keep the unprotected packet, a retransmission is a new SRTP packet on the RTX stream
+  rtp_history_put(&pc->vrtp_history, data, size, ports_get_epoch_time());
+
+  // the receiver keeps packets as received, so protect them with the header extension in place
+  size = peer_connection_stamp_rtp(pc, data, size);
+  if (CONFIG_FEC && pc->remote_vfec_pt) {
+    fec_ready = fec_encoder_put(&pc->vfec_encoder, data, size);
+  }
 
-  if (pc->agent_ret > 0 && pc->agent_ret <= len) {
-    memcpy(buf, pc->agent_buf, pc->agent_ret);
-    return pc->agent_ret;
+  peer_connection_send_rtp(pc, data, size);
+
+  // the repair packet goes after the last media packet it protects
+  if (fec_ready) {
+    fec_encoder_flush(&pc->vfec_encoder);
   }
+}
 
-  while (recv_max < CONFIG_TLS_READ_TIMEOUT && pc->state == PEER_CONNECTION_CONNECTED) {
-    ret = agent_recv(&pc->agent, buf, len);
+static void peer_connection_on_paced_packet(uint8_t* packet, size_t size, PacerPriority priority, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
 
-    if (ret > 0) {
+  switch (priority) {
+    case PACER_PRIORITY_VIDEO:
+      peer_connection_outgoing_video_rtp_packet(packet, size, user_data);
+      break;
+    case PACER_PRIORITY_DATA:
+      agent_send(&pc->agent, packet, size);
       break;
+    default:
+      peer_connection_outgoing_rtp_packet(packet, size, user_data);
+      break;
+  }
+}
+
+static void peer_connection_on_paced_drop(PacerPriority priority, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+  uint32_t now = ports_get_epoch_time();
+
+  // the frames behind the gap cannot be decoded anyway
+  if (priority == PACER_PRIORITY_VIDEO && pc->config.on_request_keyframe &&
+      (pc->keyframe_request_time == 0 || now - pc->keyframe_request_time >= PEER_CONNECTION_KEYFRAME_REQUEST_INTERVAL)) {
+    pc->keyframe_request_time = now;
+    pc->config.on_request_keyframe(pc->config.user_data);
+  }
+}
+
+static void peer_connection_enqueue_audio(uint8_t* data, size_t size, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+  pacer_enqueue(&pc->pacer, data, size, PEER_CONNECTION_PACKET_ROOM, PACER_PRIORITY_AUDIO, ports_get_epoch_time());
+}
+
+static void peer_connection_enqueue_video(uint8_t* data, size_t size, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+  pacer_enqueue(&pc->pacer, data, size, PEER_CONNECTION_PACKET_ROOM, PACER_PRIORITY_VIDEO, ports_get_epoch_time());
+}
+
+static void peer_connection_enqueue_rtx(uint8_t* data, size_t size, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+  pacer_enqueue(&pc->pacer, data, size, PEER_CONNECTION_PACKET_ROOM, PACER_PRIORITY_RETRANSMISSION, ports_get_epoch_time());
+}
+
+static void peer_connection_incoming_video_rtp(PeerConnection* pc, uint8_t* buf, size_t len) {
+  uint32_t now = ports_get_epoch_time();
+
+  if (pc->vfec_decoder.history.entries && fec_decoder_put(&pc->vfec_decoder, buf, len, now) < 0) {
+    LOGD("Drop duplicated packet %d", rtp_get_seq_number(buf));
+    return;
+  }
+
+  rtp_nack_tracker_update(&pc->vrtp_nack_tracker, rtp_get_seq_number(buf), now);
+  rtp_decoder_decode(&pc->vrtp_decoder, buf, len);
+}
+
+static void peer_connection_handle_nack(PeerConnection* pc, uint8_t* buf, size_t len) {
+  int i;
+  int count;
+  uint32_t media_ssrc;
+  uint32_t now;
+  uint16_t seq_numbers[RTP_NACK_LIST_SIZE];
+  RtpHistoryEntry* entry;
+
+  if (!pc->remote_vrtx_pt || pc->vrtp_history.entries == NULL) {
+    return;
+  }
+
+  count = rtcp_parse_nack(buf, len, &media_ssrc, seq_numbers, RTP_NACK_LIST_SIZE);
+  if (count <= 0 || media_ssrc != SSRC_H264) {
+    return;
+  }
+
+  now = ports_get_epoch_time();
+  for (i = 0; i < count; i++) {
+    entry = rtp_history_get(&pc->vrtp_history, seq_numbers[i], now);
+    if (entry) {
+      rtp_encoder_encode(&pc->vrtx_encoder, entry->packet, entry->size);
+    } else {
+      LOGD("NACK for %d not in history", seq_numbers[i]);
     }
+  }
+}
+
+static void peer_connection_send_nack(PeerConnection* pc) {
+  int size;
+  int count;
+  uint16_t seq_numbers[RTP_NACK_LIST_SIZE];
+  // header + one FCI per requested packet + SRTCP index and tag
+  uint8_t packet[12 + 4 * RTP_NACK_LIST_SIZE + 32];
 
-    recv_max++;
+  count = rtp_nack_tracker_get_pending(&pc->vrtp_nack_tracker, seq_numbers, RTP_NACK_LIST_SIZE, ports_get_epoch_time());
+  if (count <= 0) {
+    return;
   }
-  return ret;
+
+  size = rtcp_get_nack(packet, 12 + 4 * RTP_NACK_LIST_SIZE, SSRC_H264, pc->remote_vssrc, seq_numbers, count);
+  if (size < 0) {
+    return;
+  }
+
+  LOGD("Send NACK for %d packets", count);
+  peer_connection_wait_rtp(pc);
+  dtls_srtp_encrypt_rctp_packet(pc->dtls_srtp, packet, &size);
+  agent_send(&pc->agent, packet, size);
+}
+
+// the estimate only paces the sender once the encoder follows it or transport-cc backs it,
+// the loss based estimate alone grows too slowly to let a keyframe through in time
+static uint32_t peer_connection_pacing_rate(PeerConnection* pc) {
+  if (pc->config.on_bitrate_estimate || pc->bwe.feedback_received) {
+    return pc->bitrate_estimate;
+  }
+  return CONFIG_BWE_MAX_BITRATE;
+}
+
+static void peer_connection_update_bitrate_estimate(PeerConnection* pc) {
+  uint32_t bitrate = bwe_get_target_bitrate(&pc->bwe);
+  int changed = bitrate != pc->bitrate_estimate;
+
+  pc->bitrate_estimate = bitrate;
+  // the first feedback switches pacing over even when the estimate did not move
+  pacer_set_rate(&pc->pacer, peer_connection_pacing_rate(pc));
+
+  if (changed && pc->config.on_bitrate_estimate) {
+    pc->config.on_bitrate_estimate(bitrate, pc->config.user_data);
+  }
+}
+
+static void peer_connection_on_rtcp_report(RtcpSenderStats* stats, void* user_data) {
+  PeerConnection* pc = (PeerConnection*)user_data;
+
+  // one loss report per RR, from the stream that carries most of the bitrate
+  if (stats->ssrc == pc->rtcp.senders[pc->rtcp.sender_count - 1].ssrc) {
+    bwe_on_receiver_report(&pc->bwe, stats->fraction_lost, ports_get_epoch_time());
+    peer_connection_update_bitrate_estimate(pc);
+  }
+
+  if (stats->ssrc == SSRC_H264) {
+    fec_encoder_set_loss(&pc->vfec_encoder, stats->fraction_lost);
+  }
+
+  if (pc->on_receiver_packet_loss) {
+    pc->on_receiver_packet_loss((float)stats->fraction_lost / 256.0, stats->total_lost > 0 ? stats->total_lost : 0, pc->config.user_data);
+  }
+
+  if (pc->on_round_trip_time && stats->rtt > 0) {
+    pc->on_round_trip_time(stats->rtt, pc->config.user_data);
+  }
+}
+
+static void peer_connection_send_rtcp_report(PeerConnection* pc) {
+  int size;
+  // SR for audio and video with a report block per remote stream, SDES, SRTCP index and tag
+  uint8_t packet[256];
+
+  size = rtcp_get_report(&pc->rtcp, packet, sizeof(packet) - 32, ports_get_epoch_time());
+  if (size <= 0) {
+    return;
+  }
+
+  peer_connection_wait_rtp(pc);
+  dtls_srtp_encrypt_rctp_packet(pc->dtls_srtp, packet, &size);
+  agent_send(&pc->agent, packet, size);
+}
+
+// the loop reads the socket, each datagram is handed to mbedtls once and it never waits for the next
+static int peer_connection_dtls_srtp_recv(void* ctx, unsigned char* buf, size_t len) {
+  int ret;
+  DtlsSrtp* dtls_srtp = (DtlsSrtp*)ctx;
+  PeerConnection* pc = (PeerConnection*)dtls_srtp->user_data;
+
+  if (pc->agent_ret > 0 && pc->agent_ret <= len) {
+    memcpy(buf, pc->agent_buf, pc->agent_ret);
+    ret = pc->agent_ret;
+    pc->agent_ret = 0;
+    return ret;
+  }
+
+  return MBEDTLS_ERR_SSL_WANT_READ;
 }
 
 static int peer_connection_dtls_srtp_send(void* ctx, const uint8_t* buf, size_t len) {
@@ -81,6 +454,11 @@ static int peer_connection_dtls_srtp_send(void* ctx, const uint8_t* buf, size_t
   PeerConnection* pc = (PeerConnection*)dtls_srtp->user_data;
 
   // LOGD("send %.4x %.4x, %ld", *(uint16_t*)buf, *(uint16_t*)(buf + 2), len);
+  // handshake flights go out right away, DataChannel records queue behind media
+  if (pc->state == PEER_CONNECTION_COMPLETED && dtls_srtp == pc->dtls_srtp) {
+    return pacer_enqueue(&pc->pacer, buf, len, 0, PACER_PRIORITY_DATA, ports_get_epoch_time()) == 0 ? (int)len : -1;
+  }
+
   return agent_send(&pc->agent, buf, len);
 }
 
@@ -88,25 +466,27 @@ static void peer_connection_incoming_rtcp(PeerConnection* pc, uint8_t* buf, size
   RtcpHeader* rtcp_header;
   size_t pos = 0;
 
+  rtcp_on_rtcp_received(&pc->rtcp, buf, len, ports_get_epoch_time());
+
   while (pos < len) {
     rtcp_header = (RtcpHeader*)(buf + pos);
 
     switch (rtcp_header->type) {
-      case RTCP_RR:
-        LOGD("RTCP_PR");
-        if (rtcp_header->rc > 0) {
-// TODO: REMB, GCC ...etc
-#if 0
-          RtcpRr rtcp_rr = rtcp_parse_rr(buf);
-          uint32_t fraction = ntohl(rtcp_rr.report_block[0].flcnpl) >> 24;
-          uint32_t total = ntohl(rtcp_rr.report_block[0].flcnpl) & 0x00FFFFFF;
-          if(pc->on_receiver_packet_loss && fraction > 0) {
-
-            pc->on_receiver_packet_loss((float)fraction/256.0, total, pc->config.user_data);
-          }
-#endif
+      case RTCP_RTPFB:
+        LOGD("RTCP_RTPFB %d", rtcp_header->rc);
+        // generic NACK
+        if (rtcp_header->rc == 1) {
+          peer_connection_handle_nack(pc, buf + pos, len - pos);
+        } else if (rtcp_header->rc == 15) {
+          bwe_on_feedback(&pc->bwe, buf + pos, len - pos, ports_get_epoch_time());
+          peer_connection_update_bitrate_estimate(pc);
         }
         break;
+      case RTCP_SR:
+      case RTCP_RR:
+        // report blocks are handled by rtcp_on_rtcp_received
+        LOGD("RTCP %s", rtcp_header->type == RTCP_SR ? "SR" : "RR");
+        break;
       case RTCP_PSFB: {
         int fmt = rtcp_header->rc;
         LOGD("RTCP_PSFB %d", fmt);
@@ -161,12 +541,52 @@ PeerConnection* peer_connection_create(PeerConfiguration* config) {
   memcpy(&pc->config, config, sizeof(PeerConfiguration));
 
   agent_create(&pc->agent);
+  pc->agent.lite = pc->config.ice_lite || ICE_LITE;
 
   memset(&pc->sctp, 0, sizeof(pc->sctp));
+  pc->dtls_srtp = &pc->dtls_srtps[0];
+  pc->dtls_srtp_next = &pc->dtls_srtps[1];
+
+  rtcp_init(&pc->rtcp, peer_connection_on_rtcp_report, (void*)pc);
+  bwe_init(&pc->bwe, CONFIG_BWE_START_BITRATE, CONFIG_BWE_MIN_BITRATE, CONFIG_BWE_MAX_BITRATE);
+  pc->bitrate_estimate = bwe_get_target_bitrate(&pc->bwe);
+
+  if (pacer_init(&pc->pacer, peer_connection_on_paced_packet, peer_connection_on_paced_drop, (void*)pc) != 0) {
+    free(pc);
+    return NULL;
+  }
+
+  if (ports_mutex_init(&pc->mutex) != 0) {
+    pacer_deinit(&pc->pacer);
+    free(pc);
+    return NULL;
+  }
+  pacer_set_rate(&pc->pacer, peer_connection_pacing_rate(pc));
+#if CONFIG_RTP_SEND_BATCH > 1
+  pc->send_batch = &pc->send_batches[0];
+#endif
+
+  switch (pc->config.audio_codec) {
+    case CODEC_PCMA:
+      rtcp_add_sender(&pc->rtcp, SSRC_PCMA, 8000, "webrtc-pcma");
+      break;
+    case CODEC_PCMU:
+      rtcp_add_sender(&pc->rtcp, SSRC_PCMU, 8000, "webrtc-pcmu");
+      break;
+    case CODEC_OPUS:
+      rtcp_add_sender(&pc->rtcp, SSRC_OPUS, 48000, "webrtc-opus");
+      break;
+    default:
+      break;
+  }
+
+  if (pc->config.video_codec == CODEC_H264) {
+    rtcp_add_sender(&pc->rtcp, SSRC_H264, 90000, "webrtc-h264");
+  }
 
   if (pc->config.audio_codec) {
     rtp_encoder_init(&pc->artp_encoder, pc->config.audio_codec,
-                     peer_connection_outgoing_rtp_packet, (void*)pc);
+                     peer_connection_enqueue_audio, (void*)pc);
 
     rtp_decoder_init(&pc->artp_decoder, pc->config.audio_codec,
                      pc->config.onaudiotrack, pc->config.user_data);
@@ -174,10 +594,22 @@ PeerConnection* peer_connection_create(PeerConfiguration* config) {
 
   if (pc->config.video_codec) {
     rtp_encoder_init(&pc->vrtp_encoder, pc->config.video_codec,
-                     peer_connection_outgoing_rtp_packet, (void*)pc);
+                     peer_connection_enqueue_video, (void*)pc);
 
     rtp_decoder_init(&pc->vrtp_decoder, pc->config.video_codec,
                      pc->config.onvideotrack, pc->config.user_data);
+
+    rtp_rtx_encoder_init(&pc->vrtx_encoder, PT_RTX, SSRC_RTX,
+                         peer_connection_enqueue_rtx, (void*)pc);
+
+    if (rtp_history_init(&pc->vrtp_history, CONFIG_RTP_HISTORY_SIZE, CONFIG_RTP_HISTORY_DURATION) != 0) {
+      LOGW("Retransmission disabled");
+    }
+
+    rtp_nack_tracker_reset(&pc->vrtp_nack_tracker);
+
+    fec_encoder_init(&pc->vfec_encoder, PT_FLEXFEC, SSRC_FLEXFEC,
+                     peer_connection_outgoing_rtp_packet, (void*)pc);
   }
 
   return pc;
@@ -185,9 +617,18 @@ PeerConnection* peer_connection_create(PeerConfiguration* config) {
 
 void peer_connection_destroy(PeerConnection* pc) {
   if (pc) {
+    peer_connection_wait_rtp(pc);
     sctp_destroy_association(&pc->sctp);
-    dtls_srtp_deinit(&pc->dtls_srtp);
+    if (pc->b_dtls_rehandshake) {
+      dtls_srtp_reset_session(pc->dtls_srtp_next);
+      dtls_srtp_deinit(pc->dtls_srtp_next);
+    }
+    dtls_srtp_deinit(pc->dtls_srtp);
     agent_destroy(&pc->agent);
+    rtp_history_deinit(&pc->vrtp_history);
+    fec_decoder_deinit(&pc->vfec_decoder);
+    pacer_deinit(&pc->pacer);
+    ports_mutex_destroy(&pc->mutex);
     free(pc);
     pc = NULL;
   }
@@ -284,11 +725,148 @@ static char* peer_connection_dtls_role_setup_value(DtlsSrtpRole d) {
   return d == DTLS_SRTP_ROLE_SERVER ? "a=setup:passive" : "a=setup:active";
 }
 
+// the association and its SRTP keys outlive an ICE restart, set_remote_description resets it for anything else
+static int peer_connection_dtls_kept(PeerConnection* pc) {
+  return pc->state != PEER_CONNECTION_CLOSED && pc->dtls_srtp->state == DTLS_SRTP_STATE_CONNECTED;
+}
+
+static void peer_connection_init_dtls(PeerConnection* pc, DtlsSrtp* dtls_srtp, DtlsSrtpRole role) {
+  dtls_srtp_init(dtls_srtp, role, pc);
+  dtls_srtp->udp_recv = peer_connection_dtls_srtp_recv;
+  dtls_srtp->udp_send = peer_connection_dtls_srtp_send;
+}
+
+static void peer_connection_abort_rehandshake(PeerConnection* pc) {
+  if (pc->b_dtls_rehandshake) {
+    dtls_srtp_reset_session(pc->dtls_srtp_next);
+    dtls_srtp_deinit(pc->dtls_srtp_next);
+    pc->b_dtls_rehandshake = 0;
+  }
+}
+
+static void peer_connection_reset_dtls(PeerConnection* pc, DtlsSrtpRole role) {
+  peer_connection_abort_rehandshake(pc);
+  peer_connection_wait_rtp(pc);
+  pc->sctp.connected = 0;
+  memset(pc->dtls_client_random, 0, sizeof(pc->dtls_client_random));
+  dtls_srtp_reset_session(pc->dtls_srtp);
+  // drop the previous config and identity reference
+  dtls_srtp_deinit(pc->dtls_srtp);
+  peer_connection_init_dtls(pc, pc->dtls_srtp, role);
+}
+
+static void peer_connection_create_sctp(PeerConnection* pc) {
+  if (pc->config.datachannel) {
+    LOGI("SCTP create socket");
+    sctp_create_association(&pc->sctp, pc->dtls_srtp);
+    pc->sctp.userdata = pc->config.user_data;
+  }
+}
+
+// RFC 6347 4.2.8, a new ClientHello on the pair may come from a remote that lost the association,
+// or from anyone who can spoof its address. The handshake runs in the spare context and the
+// association keeps media and data going until the new one completes.
+static int peer_connection_rehandshake_record(PeerConnection* pc) {
+  const uint8_t* client_random;
+
+  if (pc->b_dtls_rehandshake) {
+    // handshake, alert and ChangeCipherSpec records, application data is still the association's
+    return pc->agent_buf[0] >= 20 && pc->agent_buf[0] <= 22;
+  }
+
+  // a late copy of the ClientHello that set up the association is not a new handshake
+  if ((client_random = dtls_srtp_client_hello_random(pc->agent_buf, pc->agent_ret)) == NULL ||
+      memcmp(client_random, pc->dtls_client_random, sizeof(pc->dtls_client_random)) == 0) {
+    return 0;
+  }
+
+  LOGI("New DTLS handshake from the remote");
+  memcpy(pc->dtls_client_random, client_random, sizeof(pc->dtls_client_random));
+  peer_connection_init_dtls(pc, pc->dtls_srtp_next, DTLS_SRTP_ROLE_SERVER);
+  memcpy(pc->dtls_srtp_next->remote_fingerprint, pc->dtls_srtp->remote_fingerprint, DTLS_SRTP_FINGERPRINT_LENGTH);
+  pc->b_dtls_rehandshake = 1;
+  return 1;
+}
+
+static void peer_connection_step_rehandshake(PeerConnection* pc) {
+  DtlsSrtp* dtls_srtp;
+  int ret;
+
+  if ((ret = dtls_srtp_handshake_step(pc->dtls_srtp_next)) < 0) {
+    LOGW("New DTLS handshake failed, keeping the association");
+    peer_connection_abort_rehandshake(pc);
+
+  } else if (ret == 0) {
+    LOGI("New DTLS handshake done, replacing the association");
+    peer_connection_wait_rtp(pc);
+    sctp_destroy_association(&pc->sctp);
+    pc->sctp.connected = 0;
+
+    dtls_srtp = pc->dtls_srtp;
+    pc->dtls_srtp = pc->dtls_srtp_next;
+    pc->dtls_srtp_next = dtls_srtp;
+    // the spare now holds the old association
+    peer_connection_abort_rehandshake(pc);
+    peer_connection_create_sctp(pc);
+  }
+}
+
+static void peer_connection_gather_candidates(PeerConnection* pc) {
+  int count = pc->ice_candidate_index;
+  char description[256];
+
+  agent_update_gathering(&pc->agent);
+
+  // nothing else reads the socket before the checks, also when an ICE restart gathers again
+  // after a disconnect, server responses are handled by agent_recv
+  switch (pc->state) {
+    case PEER_CONNECTION_NEW:
+    case PEER_CONNECTION_DISCONNECTED:
+    case PEER_CONNECTION_FAILED:
+      agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf));
+      break;
+    default:
+      break;
+  }
+
+  for (; pc->ice_candidate_index < pc->agent.local_candidates_count; pc->ice_candidate_index++) {
+    memset(description, 0, sizeof(description));
+    ice_candidate_to_description(&pc->agent.local_candidates[pc->ice_candidate_index], description, sizeof(description));
+    if (pc->config.trickle_ice) {
+      if (pc->onicecandidate) {
+        pc->onicecandidate(description, pc->config.user_data);
+      }
+    } else {
+      sdp_append(pc->sdp, description);
+    }
+  }
+
+  if (pc->ice_candidate_index > count) {
+    agent_update_candidate_pairs(&pc->agent);
+  }
+
+  if (pc->agent.state == AGENT_STATE_GATHERING_COMPLETED) {
+    if (!pc->config.trickle_ice && pc->onicecandidate) {
+      pc->onicecandidate(pc->sdp, pc->config.user_data);
+    }
+  }
+}
+
 int peer_connection_loop(PeerConnection* pc) {
+  int ret;
   uint32_t ssrc = 0;
+  const uint8_t* client_random;
+  ports_mutex_lock(&pc->mutex);
   memset(pc->agent_buf, 0, sizeof(pc->agent_buf));
   pc->agent_ret = -1;
 
+  if (pc->agent.state == AGENT_STATE_GATHERING_STARTED) {
+    peer_connection_gather_candidates(pc);
+  }
+
+  // TURN permissions and channel bindings expire unless refreshed
+  agent_update_turn(&pc->agent);
+
   switch (pc->state) {
     case PEER_CONNECTION_NEW:
       break;
@@ -297,21 +875,30 @@ int peer_connection_loop(PeerConnection* pc) {
       if (agent_select_candidate_pair(&pc->agent) < 0) {
         STATE_CHANGED(pc, PEER_CONNECTION_FAILED);
       } else if (agent_connectivity_check(&pc->agent) == 0) {
-        STATE_CHANGED(pc, PEER_CONNECTION_CONNECTED);
+        if (pc->dtls_srtp->state == DTLS_SRTP_STATE_CONNECTED) {
+          // ICE restart, media and data channels resume on the new pair without a handshake
+          pc->agent.binding_request_time = ports_get_epoch_time();
+          STATE_CHANGED(pc, PEER_CONNECTION_COMPLETED);
+        } else {
+          STATE_CHANGED(pc, PEER_CONNECTION_CONNECTED);
+        }
       }
       break;
 
     case PEER_CONNECTION_CONNECTED:
+      // one step per iteration so a slow or lost flight does not hold up the thread
+      pc->agent_ret = agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf));
 
-      if (dtls_srtp_handshake(&pc->dtls_srtp, NULL) == 0) {
-        LOGD("DTLS-SRTP handshake done");
+      if (pc->agent_ret > 0 && (client_random = dtls_srtp_client_hello_random(pc->agent_buf, pc->agent_ret))) {
+        memcpy(pc->dtls_client_random, client_random, sizeof(pc->dtls_client_random));
+      }
 
-        if (pc->config.datachannel) {
-          LOGI("SCTP create socket");
-          sctp_create_association(&pc->sctp, &pc->dtls_srtp);
-          pc->sctp.userdata = pc->config.user_data;
-        }
+      if ((ret = dtls_srtp_handshake_step(pc->dtls_srtp)) < 0) {
+        STATE_CHANGED(pc, PEER_CONNECTION_FAILED);
 
+      } else if (ret == 0) {
+        LOGD("DTLS-SRTP handshake done");
+        peer_connection_create_sctp(pc);
         STATE_CHANGED(pc, PEER_CONNECTION_COMPLETED);
       }
       break;
@@ -323,11 +910,14 @@ int peer_connection_loop(PeerConnection* pc) {
 
         if (rtcp_probe(pc->agent_buf, pc->agent_ret)) {
           LOGD("Got RTCP packet");
-          dtls_srtp_decrypt_rtcp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
+          dtls_srtp_decrypt_rtcp_packet(pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
           peer_connection_incoming_rtcp(pc, pc->agent_buf, pc->agent_ret);
 
+        } else if (peer_connection_rehandshake_record(pc)) {
+          peer_connection_step_rehandshake(pc);
+
         } else if (dtls_srtp_probe(pc->agent_buf)) {
-          int ret = dtls_srtp_read(&pc->dtls_srtp, pc->temp_buf, sizeof(pc->temp_buf));
+          ret = dtls_srtp_read(pc->dtls_srtp, pc->temp_buf, sizeof(pc->temp_buf));
           LOGD("Got DTLS data %d", ret);
 
           if (ret > 0) {
@@ -337,13 +927,33 @@ int peer_connection_loop(PeerConnection* pc) {
         } else if (rtp_packet_validate(pc->agent_buf, pc->agent_ret)) {
           LOGD("Got RTP packet");
 
-          dtls_srtp_decrypt_rtp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
+          dtls_srtp_decrypt_rtp_packet(pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
 
           ssrc = rtp_get_ssrc(pc->agent_buf);
-          if (ssrc == pc->remote_assrc) {
+          // retransmitted and recovered packets do not count as received
+          if (ssrc == pc->remote_vssrc) {
+            rtcp_on_rtp_received(&pc->rtcp, pc->agent_buf, pc->agent_ret, 90000, ports_get_epoch_time());
+          } else if (ssrc == pc->remote_assrc) {
+            rtcp_on_rtp_received(&pc->rtcp, pc->agent_buf, pc->agent_ret, pc->config.audio_codec == CODEC_OPUS ? 48000 : 8000, ports_get_epoch_time());
+          }
+
+          if (pc->remote_vrtx_ssrc && ssrc == pc->remote_vrtx_ssrc) {
+            pc->agent_ret = rtp_rtx_unwrap(pc->agent_buf, pc->agent_ret, PT_H264, pc->remote_vssrc);
+            ssrc = pc->remote_vssrc;
+          }
+
+          if (pc->agent_ret <= 0) {
+            LOGW("Invalid RTX packet");
+          } else if (ssrc == pc->remote_assrc) {
             rtp_decoder_decode(&pc->artp_decoder, pc->agent_buf, pc->agent_ret);
           } else if (ssrc == pc->remote_vssrc) {
-            rtp_decoder_decode(&pc->vrtp_decoder, pc->agent_buf, pc->agent_ret);
+            peer_connection_incoming_video_rtp(pc, pc->agent_buf, pc->agent_ret);
+          } else if (pc->remote_vfec_ssrc && ssrc == pc->remote_vfec_ssrc) {
+            ret = fec_decoder_recover(&pc->vfec_decoder, pc->agent_buf, pc->agent_ret, ports_get_epoch_time());
+            if (ret > 0) {
+              rtp_nack_tracker_update(&pc->vrtp_nack_tracker, rtp_get_seq_number(pc->vfec_decoder.buf), ports_get_epoch_time());
+              rtp_decoder_decode(&pc->vrtp_decoder, pc->vfec_decoder.buf, ret);
+            }
           }
 
         } else {
@@ -351,9 +961,27 @@ int peer_connection_loop(PeerConnection* pc) {
         }
       }
 
+      // retransmissions of the handshake beside the association, whatever arrived is handled
+      if (pc->b_dtls_rehandshake) {
+        pc->agent_ret = 0;
+        peer_connection_step_rehandshake(pc);
+      }
+
+      if (pc->config.video_codec && pc->remote_vssrc) {
+        peer_connection_send_nack(pc);
+      }
+
+      pacer_process(&pc->pacer, ports_get_epoch_time());
+      peer_connection_flush_rtp(pc);
+
+      if (rtcp_report_due(&pc->rtcp, ports_get_epoch_time())) {
+        peer_connection_send_rtcp_report(pc);
+      }
+
       if (CONFIG_KEEPALIVE_TIMEOUT > 0 && (ports_get_epoch_time() - pc->agent.binding_request_time) > CONFIG_KEEPALIVE_TIMEOUT) {
         LOGI("binding request timeout");
-        STATE_CHANGED(pc, PEER_CONNECTION_CLOSED);
+        // the DTLS association is kept, a new offer or answer restarts ICE on it
+        STATE_CHANGED(pc, PEER_CONNECTION_DISCONNECTED);
       }
 
       break;
@@ -367,6 +995,7 @@ int peer_connection_loop(PeerConnection* pc) {
       break;
   }
 
+  ports_mutex_unlock(&pc->mutex);
   return 0;
 }
 
@@ -376,10 +1005,26 @@ void peer_connection_set_remote_description(PeerConnection* pc, const char* sdp,
   char buf[256];
   char* val_start = NULL;
   uint32_t* ssrc = NULL;
+  uint8_t* twcc_ext_id = NULL;
+  uint32_t fid_ssrc = 0;
+  uint32_t fid_rtx_ssrc = 0;
+  uint32_t fec_ssrc = 0;
+  uint32_t fec_repair_ssrc = 0;
   DtlsSrtpRole role = DTLS_SRTP_ROLE_SERVER;
   int is_update = 0;
+  char fingerprint[DTLS_SRTP_FINGERPRINT_LENGTH] = {0};
+  char session_id[sizeof(pc->remote_session_id)] = {0};
+  int pt, apt;
   Agent* agent = &pc->agent;
 
+  ports_mutex_lock(&pc->mutex);
+  // every description lists the extensions again, one left out is no longer negotiated
+  pc->twcc_ext_id = 0;
+  pc->remote_vtwcc_ext_id = 0;
+  pc->remote_atwcc_ext_id = 0;
+  pc->remote_vrtx_pt = 0;
+  pc->remote_vfec_pt = 0;
+
   while ((line = strstr(start, "\r\n"))) {
     line = strstr(start, "\r\n");
     strncpy(buf, start, line - start);
@@ -390,7 +1035,12 @@ void peer_connection_set_remote_description(PeerConnection* pc, const char* sdp,
     }
 
     if (strstr(buf, "a=fingerprint")) {
-      strncpy(pc->dtls_srtp.remote_fingerprint, buf + 22, DTLS_SRTP_FINGERPRINT_LENGTH);
+      strncpy(fingerprint, buf + 22, DTLS_SRTP_FINGERPRINT_LENGTH - 1);
+    }
+
+    // o=<username> <sess-id> <sess-version> ...
+    if (strncmp(buf, "o=", 2) == 0) {
+      sscanf(buf, "o=%*s %31s", session_id);
     }
 
     if (strstr(buf, "a=ice-ufrag") &&
@@ -401,8 +1051,10 @@ void peer_connection_set_remote_description(PeerConnection* pc, const char* sdp,
 
     if (strstr(buf, "m=video")) {
       ssrc = &pc->remote_vssrc;
+      twcc_ext_id = &pc->remote_vtwcc_ext_id;
     } else if (strstr(buf, "m=audio")) {
       ssrc = &pc->remote_assrc;
+      twcc_ext_id = &pc->remote_atwcc_ext_id;
     }
 
     if ((val_start = strstr(buf, "a=ssrc:")) && ssrc) {
@@ -410,18 +1062,92 @@ void peer_connection_set_remote_description(PeerConnection* pc, const char* sdp,
       LOGD("SSRC: %" PRIu32, *ssrc);
     }
 
+    // a=ssrc-group:FID <media ssrc> <rtx ssrc>
+    if ((val_start = strstr(buf, "a=ssrc-group:FID ")) && ssrc == &pc->remote_vssrc) {
+      fid_ssrc = strtoul(val_start + 17, &val_start, 10);
+      fid_rtx_ssrc = strtoul(val_start, NULL, 10);
+    }
+
+    // a=ssrc-group:FEC-FR <media ssrc> <repair ssrc>
+    if ((val_start = strstr(buf, "a=ssrc-group:FEC-FR ")) && ssrc == &pc->remote_vssrc) {
+      fec_ssrc = strtoul(val_start + 20, &val_start, 10);
+      fec_repair_ssrc = strtoul(val_start, NULL, 10);
+    }
+
+    // a=fmtp:<rtx pt> apt=<media pt>, the RTX stream of our H264 payload type
+    if (ssrc == &pc->remote_vssrc && sscanf(buf, "a=fmtp:%d apt=%d", &pt, &apt) == 2 && apt == PT_H264) {
+      pc->remote_vrtx_pt = pt;
+    }
+
+    // a=rtpmap:<pt> flexfec/90000
+    if ((val_start = strstr(buf, "a=rtpmap:")) && strstr(buf, "flexfec/90000") && ssrc == &pc->remote_vssrc) {
+      pc->remote_vfec_pt = strtol(val_start + 9, NULL, 10);
+    }
+
+    // a=extmap:<id> <transport-cc uri>, one-byte header ids only
+    if ((val_start = strstr(buf, "a=extmap:")) && strstr(buf, RTP_TWCC_EXTENSION_URI) && twcc_ext_id) {
+      int id = strtol(val_start + 9, NULL, 10);
+      if (id > 0 && id < 15) {
+        *twcc_ext_id = id;
+        pc->twcc_ext_id = id;
+      }
+    }
+
     start = line + 2;
   }
 
+  // the a=ssrc lines of the RTX stream follow the media stream ones
+  if (fid_ssrc && fid_rtx_ssrc) {
+    pc->remote_vssrc = fid_ssrc;
+    pc->remote_vrtx_ssrc = fid_rtx_ssrc;
+    LOGD("Video SSRC: %" PRIu32 ", RTX SSRC: %" PRIu32, fid_ssrc, fid_rtx_ssrc);
+  }
+
+  if (CONFIG_FEC && fec_ssrc && fec_repair_ssrc) {
+    pc->remote_vssrc = fec_ssrc;
+    pc->remote_vfec_ssrc = fec_repair_ssrc;
+    if (pc->vfec_decoder.history.entries == NULL) {
+      fec_decoder_init(&pc->vfec_decoder, fec_ssrc, FEC_DECODER_HISTORY_SIZE);
+    }
+    LOGD("Video SSRC: %" PRIu32 ", FEC SSRC: %" PRIu32, fec_ssrc, fec_repair_ssrc);
+  }
+
+  // an answer echoes ours, an offer picks the numbers our answer and streams use
+  if (pc->remote_vrtx_pt) {
+    pc->vrtx_encoder.type = pc->remote_vrtx_pt;
+  }
+  if (pc->remote_vfec_pt) {
+    pc->vfec_encoder.type = pc->remote_vfec_pt;
+  }
+
   if (is_update) {
+    ports_mutex_unlock(&pc->mutex);
     return;
   }
 
+  // RFC 8839 4.4.1.1.1, a restart is new ICE credentials within the same session and certificate
+  if (peer_connection_dtls_kept(pc) &&
+      (agent->remote_ufrag[0] == '\0' ||
+       strcmp(session_id, pc->remote_session_id) != 0 ||
+       strncmp(fingerprint, pc->dtls_srtp->actual_remote_fingerprint, DTLS_SRTP_FINGERPRINT_LENGTH) != 0)) {
+    LOGI("Not an ICE restart of the current session, new DTLS handshake");
+    peer_connection_reset_dtls(pc, pc->dtls_srtp->role);
+  }
+  memcpy(pc->dtls_srtp->remote_fingerprint, fingerprint, sizeof(fingerprint));
+  memcpy(pc->remote_session_id, session_id, sizeof(session_id));
+
+  // the restarting peer gathered again, its old candidates and our pairs with them are gone
+  if (type == SDP_TYPE_OFFER && agent->remote_ufrag[0] != '\0') {
+    peer_connection_wait_rtp(pc);
+    agent_clear_candidates(agent);
+  }
+
   agent_set_remote_description(&pc->agent, (char*)sdp);
   if (type == SDP_TYPE_ANSWER) {
     agent_update_candidate_pairs(&pc->agent);
     STATE_CHANGED(pc, PEER_CONNECTION_CHECKING);
   }
+  ports_mutex_unlock(&pc->mutex);
 }
 
 static const char* peer_connection_create_sdp(PeerConnection* pc, SdpType sdp_type) {
@@ -429,8 +1155,15 @@ static const char* peer_connection_create_sdp(PeerConnection* pc, SdpType sdp_ty
 
   memset(pc->temp_buf, 0, sizeof(pc->temp_buf));
   DtlsSrtpRole role = DTLS_SRTP_ROLE_SERVER;
+  int dtls_kept = peer_connection_dtls_kept(pc);
+  int vtwcc_ext_id = SDP_TWCC_EXT_ID;
+  int atwcc_ext_id = SDP_TWCC_EXT_ID;
+  // offers keep the payload types already in use, PT_RTX and PT_FLEXFEC at first
+  int vrtx_pt = CONFIG_RTP_HISTORY_SIZE > 0 ? pc->vrtx_encoder.type : 0;
+  int vfec_pt = CONFIG_FEC ? pc->vfec_encoder.type : 0;
 
-  pc->sctp.connected = 0;
+  // a worker may still be sending on the pair the candidates are cleared under
+  peer_connection_wait_rtp(pc);
 
   switch (sdp_type) {
     case SDP_TYPE_OFFER:
@@ -441,15 +1174,29 @@ static const char* peer_connection_create_sdp(PeerConnection* pc, SdpType sdp_ty
     case SDP_TYPE_ANSWER:
       role = DTLS_SRTP_ROLE_CLIENT;
       pc->agent.mode = AGENT_MODE_CONTROLLED;
+      // RFC 8285 6, only extensions in the offer are answered and with the offered id
+      vtwcc_ext_id = pc->remote_vtwcc_ext_id;
+      atwcc_ext_id = pc->remote_atwcc_ext_id;
+      // no payload type the offer lacks
+      vrtx_pt = CONFIG_RTP_HISTORY_SIZE > 0 ? pc->remote_vrtx_pt : 0;
+      vfec_pt = CONFIG_FEC ? pc->remote_vfec_pt : 0;
       break;
     default:
       break;
   }
 
-  dtls_srtp_reset_session(&pc->dtls_srtp);
-  dtls_srtp_init(&pc->dtls_srtp, role, pc);
-  pc->dtls_srtp.udp_recv = peer_connection_dtls_srtp_recv;
-  pc->dtls_srtp.udp_send = peer_connection_dtls_srtp_send;
+  // RFC 8445 6.1.1, a lite agent is always the controlled one
+  if (pc->agent.lite) {
+    pc->agent.mode = AGENT_MODE_CONTROLLED;
+  }
+
+  if (dtls_kept) {
+    // only ICE restarts, the description keeps the role and fingerprint of the association
+    LOGI("ICE restart, keeping the DTLS association");
+    role = pc->dtls_srtp->role;
+  } else {
+    peer_connection_reset_dtls(pc, role);
+  }
 
   memset(pc->sdp, 0, sizeof(pc->sdp));
   // TODO: check if we have video or audio codecs
@@ -458,25 +1205,29 @@ static const char* peer_connection_create_sdp(PeerConnection* pc, SdpType sdp_ty
              pc->config.audio_codec != CODEC_NONE,
              pc->config.datachannel);
 
+  if (pc->agent.lite) {
+    sdp_append(pc->sdp, "a=ice-lite");
+  }
+
   agent_create_ice_credential(&pc->agent);
   sdp_append(pc->sdp, "a=ice-ufrag:%s", pc->agent.local_ufrag);
   sdp_append(pc->sdp, "a=ice-pwd:%s", pc->agent.local_upwd);
-  sdp_append(pc->sdp, "a=fingerprint:sha-256 %s", pc->dtls_srtp.local_fingerprint);
+  sdp_append(pc->sdp, "a=fingerprint:sha-256 %s", pc->dtls_srtp->local_fingerprint);
   sdp_append(pc->sdp, peer_connection_dtls_role_setup_value(role));
 
   if (pc->config.video_codec == CODEC_H264) {
-    sdp_append_h264(pc->sdp);
+    sdp_append_h264(pc->sdp, vtwcc_ext_id, vrtx_pt, vfec_pt);
   }
 
   switch (pc->config.audio_codec) {
     case CODEC_PCMA:
-      sdp_append_pcma(pc->sdp);
+      sdp_append_pcma(pc->sdp, atwcc_ext_id);
       break;
     case CODEC_PCMU:
-      sdp_append_pcmu(pc->sdp);
+      sdp_append_pcmu(pc->sdp, atwcc_ext_id);
       break;
     case CODEC_OPUS:
-      sdp_append_opus(pc->sdp);
+      sdp_append_opus(pc->sdp, atwcc_ext_id);
     default:
       break;
   }
@@ -487,32 +1238,44 @@ static const char* peer_connection_create_sdp(PeerConnection* pc, SdpType sdp_ty
 
   pc->b_local_description_created = 1;
 
-  agent_gather_candidate(&pc->agent, NULL, NULL, NULL);  // host address
-  for (int i = 0; i < sizeof(pc->config.ice_servers) / sizeof(pc->config.ice_servers[0]); ++i) {
+  // host candidates are known right away, server reflexive and relay ones are gathered by the loop
+  agent_gather_candidate(&pc->agent, NULL, NULL, NULL);
+  agent_get_local_description(&pc->agent, description, sizeof(pc->temp_buf));
+  sdp_append(pc->sdp, description);
+  pc->ice_candidate_index = pc->agent.local_candidates_count;
+
+  // all servers are queried at once, the loop picks them up once every one is in the list
+  agent_clear_ice_servers(&pc->agent);
+  pc->agent.state = AGENT_STATE_GATHERING_ENDED;
+  // a lite agent is publicly reachable, it only advertises host candidates
+  for (int i = 0; i < sizeof(pc->config.ice_servers) / sizeof(pc->config.ice_servers[0]) && !pc->agent.lite; ++i) {
     if (pc->config.ice_servers[i].urls) {
       LOGI("ice server: %s", pc->config.ice_servers[i].urls);
       agent_gather_candidate(&pc->agent, pc->config.ice_servers[i].urls, pc->config.ice_servers[i].username, pc->config.ice_servers[i].credential);
     }
   }
-
-  agent_get_local_description(&pc->agent, description, sizeof(pc->temp_buf));
-  sdp_append(pc->sdp, description);
-
-  if (pc->onicecandidate) {
-    pc->onicecandidate(pc->sdp, pc->config.user_data);
-  }
+  pc->agent.state = AGENT_STATE_GATHERING_STARTED;
 
   return pc->sdp;
 }
 
 const char* peer_connection_create_offer(PeerConnection* pc) {
-  return peer_connection_create_sdp(pc, SDP_TYPE_OFFER);
+  const char* sdp;
+
+  ports_mutex_lock(&pc->mutex);
+  sdp = peer_connection_create_sdp(pc, SDP_TYPE_OFFER);
+  ports_mutex_unlock(&pc->mutex);
+  return sdp;
 }
 
 const char* peer_connection_create_answer(PeerConnection* pc) {
-  const char* sdp = peer_connection_create_sdp(pc, SDP_TYPE_ANSWER);
+  const char* sdp;
+
+  ports_mutex_lock(&pc->mutex);
+  sdp = peer_connection_create_sdp(pc, SDP_TYPE_ANSWER);
   agent_update_candidate_pairs(&pc->agent);
   STATE_CHANGED(pc, PEER_CONNECTION_CHECKING);
+  ports_mutex_unlock(&pc->mutex);
   return sdp;
 }
 
@@ -539,6 +1302,11 @@ void peer_connection_on_receiver_packet_loss(PeerConnection* pc,
   pc->on_receiver_packet_loss = on_receiver_packet_loss;
 }
 
+void peer_connection_on_round_trip_time(PeerConnection* pc,
+                                        void (*on_round_trip_time)(uint32_t rtt, void* userdata)) {
+  pc->on_round_trip_time = on_round_trip_time;
+}
+
 void peer_connection_onicecandidate(PeerConnection* pc, void (*onicecandidate)(char* sdp, void* userdata)) {
   pc->onicecandidate = onicecandidate;
 }
@@ -580,10 +1348,17 @@ char* peer_connection_lookup_sid_label(PeerConnection* pc, uint16_t sid) {
 
 int peer_connection_add_ice_candidate(PeerConnection* pc, char* candidate) {
   Agent* agent = &pc->agent;
-  if (ice_candidate_from_description(&agent->remote_candidates[agent->remote_candidates_count], candidate, candidate + strlen(candidate)) != 0) {
-    return -1;
+  int ret = -1;
+
+  ports_mutex_lock(&pc->mutex);
+  if (agent->remote_candidates_count >= AGENT_MAX_CANDIDATES) {
+    LOGW("Too many remote candidates");
+  } else if (ice_candidate_from_description(&agent->remote_candidates[agent->remote_candidates_count], candidate, candidate + strlen(candidate)) == 0) {
+    LOGD("Add candidate: %s", candidate);
+    agent->remote_candidates_count++;
+    agent_update_candidate_pairs(agent);
+    ret = 0;
   }
-  LOGD("Add candidate: %s", candidate);
-  agent->remote_candidates_count++;
-  return 0;
+  ports_mutex_unlock(&pc->mutex);
+  return ret;
 }
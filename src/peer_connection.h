@@ -75,10 +75,13 @@ typedef struct PeerConfiguration {
   MediaCodec audio_codec;
   MediaCodec video_codec;
   DataChannelType datachannel;
+  int trickle_ice;  // onicecandidate gets each candidate line as it is gathered instead of the complete SDP
+  int ice_lite;     // for hosts with a public address, host candidates only and no checks of our own
 
   void (*onaudiotrack)(uint8_t* data, size_t size, void* userdata);
   void (*onvideotrack)(uint8_t* data, size_t size, void* userdata);
   void (*on_request_keyframe)(void* userdata);
+  void (*on_bitrate_estimate)(uint32_t bitrate, void* userdata);  // target send bitrate in bps
   void* user_data;
 
 } PeerConfiguration;
@@ -97,6 +100,10 @@ void peer_connection_destroy(PeerConnection* pc);
 
 void peer_connection_close(PeerConnection* pc);
 
+/**
+ * @brief run one iteration of ICE, DTLS and media. Descriptions and candidates may be set from
+ * other threads, they wait for the iteration to finish. Callbacks run on this thread
+ */
 int peer_connection_loop(PeerConnection* pc);
 
 int peer_connection_create_datachannel(PeerConnection* pc, DecpChannelType channel_type, uint16_t priority, uint32_t reliability_parameter, char* label, char* protocol);
@@ -121,6 +128,11 @@ void peer_connection_set_remote_description(PeerConnection* pc, const char* sdp,
 
 void peer_connection_set_local_description(PeerConnection* pc, const char* sdp, SdpType sdp_type);
 
+/**
+ * @brief create a local description, while the DTLS association is up (connected, or
+ * disconnected after the keepalive timed out) it is an ICE restart: new credentials and
+ * candidates, and media resumes without a handshake once a pair passes its checks
+ */
 const char* peer_connection_create_offer(PeerConnection* pc);
 
 const char* peer_connection_create_answer(PeerConnection* pc);
@@ -134,8 +146,19 @@ const char* peer_connection_create_answer(PeerConnection* pc);
 void peer_connection_on_receiver_packet_loss(PeerConnection* pc,
                                              void (*on_receiver_packet_loss)(float fraction_loss, uint32_t total_loss, void* userdata));
 
+/**
+ * @brief register callback function to handle round trip time computed from RTCP receiver report
+ * @param[in] peer connection
+ * @param[in] callback function void (*cb)(uint32_t rtt, void *userdata), rtt in milliseconds
+ * @param[in] userdata for callback function
+ */
+void peer_connection_on_round_trip_time(PeerConnection* pc,
+                                        void (*on_round_trip_time)(uint32_t rtt, void* userdata));
+
 /**
  * @brief Set the callback function to handle onicecandidate event.
+ * With trickle_ice it is called with every local candidate line as soon as it is gathered,
+ * otherwise once with the complete local description when gathering is done.
  * @param A PeerConnection.
  * @param A callback function to handle onicecandidate event.
  * @param A userdata which is pass to callback function.
@@ -168,7 +191,7 @@ int peer_connection_lookup_sid(PeerConnection* pc, const char* label, uint16_t*
 char* peer_connection_lookup_sid_label(PeerConnection* pc, uint16_t sid);
 
 /**
- * @brief adds a new remote candidate to the peer connection
+ * @brief adds a new remote candidate to the peer connection, checks on it start right away
  * @param[in] peer connection
  * @param[in] ice candidate
  */
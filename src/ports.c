@@ -10,6 +10,10 @@
 
 #include "config.h"
 
+#if CONFIG_DNS_ASYNC
+#include <pthread.h>
+#endif
+
 #if CONFIG_USE_LWIP || defined(__RP2040_BM__)
 #include "lwip/ip_addr.h"
 #include "lwip/netif.h"
@@ -33,6 +37,30 @@
 #include "ports.h"
 #include "utils.h"
 
+// failed lookups are retried after this long (ms)
+#define PORTS_DNS_NEGATIVE_TTL 5000
+#define PORTS_DNS_HOST_LENGTH 64
+
+typedef enum PortsDnsState {
+
+  PORTS_DNS_EMPTY = 0,
+  PORTS_DNS_PENDING,
+  PORTS_DNS_RESOLVED,
+  PORTS_DNS_FAILED,
+
+} PortsDnsState;
+
+typedef struct PortsDnsEntry {
+  char host[PORTS_DNS_HOST_LENGTH];
+  PortsDnsState state;
+  Address addr;
+  uint32_t expire_time;
+
+} PortsDnsEntry;
+
+static PortsDnsEntry g_dns_cache[CONFIG_DNS_CACHE_SIZE];
+static PortsMutex g_dns_mutex = PORTS_MUTEX_INITIALIZER;
+
 int ports_get_host_addr(Address* addr, const char* iface_prefix) {
   int ret = 0;
 
@@ -118,7 +146,7 @@ int ports_get_host_addr(Address* addr, const char* iface_prefix) {
   return ret;
 }
 
-int ports_resolve_addr(const char* host, Address* addr) {
+static int ports_getaddrinfo(const char* host, Address* addr) {
   char addr_string[ADDRSTRLEN];
   int ret = -1;
   struct addrinfo hints, *res, *p;
@@ -155,12 +183,163 @@ int ports_resolve_addr(const char* host, Address* addr) {
   return ret;
 }
 
+// must be called with g_dns_mutex held
+static PortsDnsEntry* ports_dns_lookup(const char* host, uint32_t now) {
+  int i;
+  for (i = 0; i < CONFIG_DNS_CACHE_SIZE; i++) {
+    if (g_dns_cache[i].state != PORTS_DNS_EMPTY && strcmp(g_dns_cache[i].host, host) == 0) {
+      if (g_dns_cache[i].state != PORTS_DNS_PENDING && (int32_t)(g_dns_cache[i].expire_time - now) <= 0) {
+        g_dns_cache[i].state = PORTS_DNS_EMPTY;
+        return NULL;
+      }
+      return &g_dns_cache[i];
+    }
+  }
+  return NULL;
+}
+
+// must be called with g_dns_mutex held, evicts the entry closest to expiry when the cache is full
+static PortsDnsEntry* ports_dns_alloc(const char* host) {
+  int i;
+  PortsDnsEntry* entry = NULL;
+  for (i = 0; i < CONFIG_DNS_CACHE_SIZE; i++) {
+    if (g_dns_cache[i].state == PORTS_DNS_EMPTY) {
+      entry = &g_dns_cache[i];
+      break;
+    } else if (g_dns_cache[i].state != PORTS_DNS_PENDING &&
+               (entry == NULL || (int32_t)(g_dns_cache[i].expire_time - entry->expire_time) < 0)) {
+      entry = &g_dns_cache[i];
+    }
+  }
+
+  if (entry) {
+    memset(entry, 0, sizeof(PortsDnsEntry));
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+  }
+  return entry;
+}
+
+static void ports_dns_store(const char* host, int ret, Address* addr) {
+  uint32_t now = ports_get_epoch_time();
+  PortsDnsEntry* entry;
+
+  ports_mutex_lock(&g_dns_mutex);
+  if ((entry = ports_dns_lookup(host, now)) != NULL || (entry = ports_dns_alloc(host)) != NULL) {
+    if (ret == 0) {
+      entry->state = PORTS_DNS_RESOLVED;
+      entry->addr = *addr;
+      entry->expire_time = now + CONFIG_DNS_CACHE_TTL;
+    } else {
+      entry->state = PORTS_DNS_FAILED;
+      entry->expire_time = now + PORTS_DNS_NEGATIVE_TTL;
+    }
+  }
+  ports_mutex_unlock(&g_dns_mutex);
+}
+
+int ports_resolve_addr(const char* host, Address* addr) {
+  int ret = 1;
+  Address resolved_addr;
+  PortsDnsEntry* entry;
+
+  if (strlen(host) >= PORTS_DNS_HOST_LENGTH) {
+    return ports_getaddrinfo(host, addr);
+  }
+
+  ports_mutex_lock(&g_dns_mutex);
+  if ((entry = ports_dns_lookup(host, ports_get_epoch_time())) != NULL) {
+    if (entry->state == PORTS_DNS_RESOLVED) {
+      *addr = entry->addr;
+      ret = 0;
+    } else if (entry->state == PORTS_DNS_FAILED) {
+      ret = -1;
+    }
+  }
+  ports_mutex_unlock(&g_dns_mutex);
+
+  if (ret != 1) {
+    return ret;
+  }
+
+  // a pending async lookup is simply raced, both answers land in the same entry
+  memset(&resolved_addr, 0, sizeof(resolved_addr));
+  ret = ports_getaddrinfo(host, &resolved_addr);
+  ports_dns_store(host, ret, &resolved_addr);
+  if (ret == 0) {
+    *addr = resolved_addr;
+  }
+  return ret;
+}
+
+#if CONFIG_DNS_ASYNC
+static void* ports_dns_thread(void* arg) {
+  char* host = (char*)arg;
+  Address addr;
+  int ret;
+
+  memset(&addr, 0, sizeof(addr));
+  ret = ports_getaddrinfo(host, &addr);
+  ports_dns_store(host, ret, &addr);
+  free(host);
+  return NULL;
+}
+#endif
+
+int ports_resolve_addr_async(const char* host, Address* addr) {
+#if CONFIG_DNS_ASYNC
+  int ret = -1;
+  char* arg;
+  pthread_t thread;
+  PortsDnsEntry* entry;
+
+  // literals need no lookup, overlong names do not fit the cache
+  if (addr_from_string(host, addr)) {
+    return 0;
+  } else if (strlen(host) >= PORTS_DNS_HOST_LENGTH) {
+    return ports_resolve_addr(host, addr);
+  }
+
+  ports_mutex_lock(&g_dns_mutex);
+  entry = ports_dns_lookup(host, ports_get_epoch_time());
+  if (entry == NULL) {
+    if ((entry = ports_dns_alloc(host)) != NULL && (arg = strdup(host)) != NULL) {
+      entry->state = PORTS_DNS_PENDING;
+      if (pthread_create(&thread, NULL, ports_dns_thread, arg) == 0) {
+        pthread_detach(thread);
+        ret = 1;
+      } else {
+        LOGE("Failed to start DNS thread");
+        entry->state = PORTS_DNS_EMPTY;
+        free(arg);
+      }
+    }
+  } else if (entry->state == PORTS_DNS_RESOLVED) {
+    *addr = entry->addr;
+    ret = 0;
+  } else if (entry->state == PORTS_DNS_PENDING) {
+    ret = 1;
+  }
+  ports_mutex_unlock(&g_dns_mutex);
+
+  return ret;
+#else
+  return ports_resolve_addr(host, addr);
+#endif
+}
+
 uint32_t ports_get_epoch_time() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
   return (uint32_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+uint64_t ports_get_ntp_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  // 70 years between 1900 and 1970
+  return ((uint64_t)(tv.tv_sec + 2208988800UL) << 32) | (((uint64_t)tv.tv_usec << 32) / 1000000);
+}
+
 void ports_sleep_ms(int ms) {
 #if defined(__RP2040_BM__)
   sleep_ms(ms);
@@ -170,3 +349,42 @@ void ports_sleep_ms(int ms) {
   usleep(ms * 1000);
 #endif
 }
+
+#if CONFIG_THREADS
+int ports_mutex_init(PortsMutex* mutex) {
+  pthread_mutexattr_t attr;
+  int ret;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  ret = pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return ret == 0 ? 0 : -1;
+}
+
+void ports_mutex_destroy(PortsMutex* mutex) {
+  pthread_mutex_destroy(mutex);
+}
+
+void ports_mutex_lock(PortsMutex* mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+void ports_mutex_unlock(PortsMutex* mutex) {
+  pthread_mutex_unlock(mutex);
+}
+#else
+int ports_mutex_init(PortsMutex* mutex) {
+  *mutex = 0;
+  return 0;
+}
+
+void ports_mutex_destroy(PortsMutex* mutex) {
+}
+
+void ports_mutex_lock(PortsMutex* mutex) {
+}
+
+void ports_mutex_unlock(PortsMutex* mutex) {
+}
+#endif
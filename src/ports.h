@@ -3,15 +3,51 @@
 
 #include <stdlib.h>
 #include "address.h"
+#include "config.h"
 
+#if CONFIG_THREADS
+#include <pthread.h>
+typedef pthread_mutex_t PortsMutex;
+#define PORTS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#else
+typedef int PortsMutex;
+#define PORTS_MUTEX_INITIALIZER 0
+#endif
+
+/**
+ * @brief resolve a host name, answers are cached process wide for CONFIG_DNS_CACHE_TTL
+ */
 int ports_resolve_addr(const char* host, Address* addr);
 
+/**
+ * @brief non-blocking variant of ports_resolve_addr, poll it until the lookup is done
+ * @return 0 when addr is filled, 1 while the lookup is in progress, -1 on failure
+ */
+int ports_resolve_addr_async(const char* host, Address* addr);
+
 int ports_resolve_mdns_host(const char* host, Address* addr);
 
 int ports_get_host_addr(Address* addr, const char* iface_prefix);
 
 uint32_t ports_get_epoch_time();
 
+/**
+ * @brief wall clock as a 64-bit NTP timestamp (RFC 5905), seconds since 1900 in the upper 32 bits
+ */
+uint64_t ports_get_ntp_time();
+
 void ports_sleep_ms(int ms);
 
+/**
+ * @brief mutexes for state shared between threads, no-ops when CONFIG_THREADS is 0.
+ * Ones created by ports_mutex_init are recursive, callbacks run under them may lock them again
+ */
+int ports_mutex_init(PortsMutex* mutex);
+
+void ports_mutex_destroy(PortsMutex* mutex);
+
+void ports_mutex_lock(PortsMutex* mutex);
+
+void ports_mutex_unlock(PortsMutex* mutex);
+
 #endif  // PORTS_H_
@@ -1,9 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "address.h"
+#include "config.h"
+#include "ports.h"
 #include "rtcp.h"
 #include "rtp.h"
+#include "utils.h"
+
+#define RTCP_MAX_DROPOUT 3000
+#define RTCP_MAX_MISORDER 100
 
 int rtcp_probe(uint8_t* packet, size_t size) {
   if (size < 8)
@@ -49,6 +56,182 @@ int rtcp_get_fir(uint8_t* packet, int len, int* seqnr) {
   return 20;
 }
 
+// RFC 4585 generic NACK, seq_numbers are expected in ascending order
+int rtcp_get_nack(uint8_t* packet, int len, uint32_t ssrc, uint32_t media_ssrc, const uint16_t* seq_numbers, int count) {
+  int i;
+  int size = 12;
+  uint16_t pid = 0;
+  uint16_t blp = 0;
+  uint16_t diff;
+
+  if (packet == NULL || len < 16 || count <= 0)
+    return -1;
+
+  memset(packet, 0, 12);
+  RtcpFb* rtcp_fb = (RtcpFb*)packet;
+
+  for (i = 0; i < count; i++) {
+    diff = seq_numbers[i] - pid;
+    if (size > 12 && diff >= 1 && diff <= 16) {
+      blp |= 1 << (diff - 1);
+      *(uint16_t*)(packet + size - 2) = htons(blp);
+      continue;
+    }
+
+    if (size + 4 > len)
+      break;
+
+    pid = seq_numbers[i];
+    blp = 0;
+    *(uint16_t*)(packet + size) = htons(pid);
+    *(uint16_t*)(packet + size + 2) = 0;
+    size += 4;
+  }
+
+  rtcp_fb->header.version = 2;
+  rtcp_fb->header.type = RTCP_RTPFB;
+  rtcp_fb->header.rc = 1;
+  rtcp_fb->header.length = htons((size / 4) - 1);
+  rtcp_fb->ssrc = htonl(ssrc);
+  rtcp_fb->media = htonl(media_ssrc);
+
+  return size;
+}
+
+int rtcp_parse_nack(uint8_t* packet, int len, uint32_t* media_ssrc, uint16_t* seq_numbers, int max_count) {
+  int i;
+  int pos;
+  int size;
+  int count = 0;
+  uint16_t pid;
+  uint16_t blp;
+  RtcpFb* rtcp_fb = (RtcpFb*)packet;
+
+  if (len < 12)
+    return -1;
+
+  size = 4 * (ntohs(rtcp_fb->header.length) + 1);
+  if (size > len)
+    return -1;
+
+  *media_ssrc = ntohl(rtcp_fb->media);
+
+  for (pos = 12; pos + 4 <= size && count < max_count; pos += 4) {
+    pid = ntohs(*(uint16_t*)(packet + pos));
+    blp = ntohs(*(uint16_t*)(packet + pos + 2));
+    seq_numbers[count++] = pid;
+    for (i = 0; i < 16 && count < max_count; i++) {
+      if (blp & (1 << i))
+        seq_numbers[count++] = pid + i + 1;
+    }
+  }
+
+  return count;
+}
+
+static int rtcp_twcc_status(uint8_t* packet, int size, int* delta_pos, int64_t* arrival_time, int symbol) {
+  switch (symbol) {
+    case 1:
+      // small delta, unsigned 8 bits of 250us
+      if (*delta_pos + 1 > size)
+        return -1;
+      *arrival_time += packet[*delta_pos] * 250;
+      *delta_pos += 1;
+      return 1;
+    case 2:
+      // large or negative delta, signed 16 bits of 250us
+      if (*delta_pos + 2 > size)
+        return -1;
+      *arrival_time += (int16_t)((packet[*delta_pos] << 8) | packet[*delta_pos + 1]) * 250;
+      *delta_pos += 2;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int rtcp_parse_twcc(uint8_t* packet, int len, RtcpOnTwccPacket on_packet, void* user_data) {
+  int i;
+  int n;
+  int pos;
+  int size;
+  int delta_pos;
+  int covered = 0;
+  int received;
+  int symbol;
+  int remaining;
+  uint16_t chunk;
+  uint16_t seq_number;
+  uint16_t status_count;
+  int32_t reference_time;
+  int64_t arrival_time;
+  RtcpHeader* rtcp_header = (RtcpHeader*)packet;
+
+  if (packet == NULL || len < 20)
+    return -1;
+
+  size = 4 * (ntohs(rtcp_header->length) + 1);
+  if (size > len)
+    return -1;
+
+  seq_number = (packet[12] << 8) | packet[13];
+  status_count = (packet[14] << 8) | packet[15];
+  // signed 24 bits in multiples of 64ms
+  reference_time = (packet[16] << 16) | (packet[17] << 8) | packet[18];
+  if (reference_time & 0x800000)
+    reference_time |= 0xff000000;
+  arrival_time = (int64_t)reference_time * 64000;
+
+  // receive deltas follow the last packet chunk
+  for (pos = 20; covered < status_count; pos += 2) {
+    if (pos + 2 > size)
+      return -1;
+    chunk = (packet[pos] << 8) | packet[pos + 1];
+    if (chunk & 0x8000) {
+      covered += (chunk & 0x4000) ? 7 : 14;
+    } else {
+      covered += chunk & 0x1fff;
+    }
+  }
+  delta_pos = pos;
+
+  remaining = status_count;
+  for (pos = 20; remaining > 0; pos += 2) {
+    chunk = (packet[pos] << 8) | packet[pos + 1];
+
+    if (!(chunk & 0x8000)) {
+      // run length chunk
+      n = chunk & 0x1fff;
+      symbol = (chunk >> 13) & 0x03;
+    } else if (chunk & 0x4000) {
+      // status vector chunk of 2-bit symbols
+      n = 7;
+      symbol = -1;
+    } else {
+      // status vector chunk of 1-bit symbols
+      n = 14;
+      symbol = -1;
+    }
+
+    for (i = 0; i < n && remaining > 0; i++, remaining--, seq_number++) {
+      if (!(chunk & 0x8000)) {
+        received = rtcp_twcc_status(packet, size, &delta_pos, &arrival_time, symbol);
+      } else if (chunk & 0x4000) {
+        received = rtcp_twcc_status(packet, size, &delta_pos, &arrival_time, (chunk >> (12 - 2 * i)) & 0x03);
+      } else {
+        received = rtcp_twcc_status(packet, size, &delta_pos, &arrival_time, (chunk >> (13 - i)) & 0x01);
+      }
+
+      if (received < 0)
+        return -1;
+
+      on_packet(seq_number, received, arrival_time, user_data);
+    }
+  }
+
+  return status_count;
+}
+
 RtcpRr rtcp_parse_rr(uint8_t* packet) {
   RtcpRr rtcp_rr;
   memcpy(&rtcp_rr.header, packet, sizeof(rtcp_rr.header));
@@ -56,3 +239,339 @@ RtcpRr rtcp_parse_rr(uint8_t* packet) {
 
   return rtcp_rr;
 }
+
+void rtcp_init(Rtcp* rtcp, void (*on_report)(RtcpSenderStats* stats, void* user_data), void* user_data) {
+  memset(rtcp, 0, sizeof(Rtcp));
+  rtcp->on_report = on_report;
+  rtcp->user_data = user_data;
+}
+
+int rtcp_add_sender(Rtcp* rtcp, uint32_t ssrc, uint32_t clock_rate, const char* cname) {
+  RtcpSenderStats* sender;
+
+  if (rtcp->sender_count >= RTCP_MAX_STREAMS)
+    return -1;
+
+  sender = &rtcp->senders[rtcp->sender_count++];
+  memset(sender, 0, sizeof(RtcpSenderStats));
+  sender->ssrc = ssrc;
+  sender->clock_rate = clock_rate;
+  sender->cname = cname;
+  return 0;
+}
+
+static RtcpSenderStats* rtcp_find_sender(Rtcp* rtcp, uint32_t ssrc) {
+  int i;
+  for (i = 0; i < rtcp->sender_count; i++) {
+    if (rtcp->senders[i].ssrc == ssrc)
+      return &rtcp->senders[i];
+  }
+  return NULL;
+}
+
+static RtcpReceiverStats* rtcp_get_receiver(Rtcp* rtcp, uint32_t ssrc) {
+  int i;
+  RtcpReceiverStats* receiver;
+
+  for (i = 0; i < rtcp->receiver_count; i++) {
+    if (rtcp->receivers[i].ssrc == ssrc)
+      return &rtcp->receivers[i];
+  }
+
+  if (rtcp->receiver_count >= RTCP_MAX_STREAMS)
+    return NULL;
+
+  receiver = &rtcp->receivers[rtcp->receiver_count++];
+  memset(receiver, 0, sizeof(RtcpReceiverStats));
+  receiver->ssrc = ssrc;
+  return receiver;
+}
+
+static void rtcp_receiver_reset(RtcpReceiverStats* receiver, uint16_t seq_number) {
+  receiver->started = 1;
+  receiver->max_seq_number = seq_number;
+  receiver->base_seq_number = seq_number;
+  receiver->cycles = 0;
+  receiver->received = 0;
+  receiver->expected_prior = 0;
+  receiver->received_prior = 0;
+}
+
+void rtcp_on_rtp_sent(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t now) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  RtcpSenderStats* sender = rtcp_find_sender(rtcp, ntohl(rtp_header->ssrc));
+  int header_size = rtp_get_header_size(packet, size);
+
+  if (sender == NULL || header_size < 0)
+    return;
+
+  sender->packet_count++;
+  sender->octet_count += size - header_size;
+  sender->rtp_timestamp = ntohl(rtp_header->timestamp);
+  sender->rtp_time = now;
+}
+
+// RFC 3550 appendix A.1 and A.8, without probation
+void rtcp_on_rtp_received(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t clock_rate, uint32_t now) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  RtcpReceiverStats* receiver = rtcp_get_receiver(rtcp, ntohl(rtp_header->ssrc));
+  uint16_t seq_number = ntohs(rtp_header->seq_number);
+  uint16_t delta;
+  uint32_t transit;
+  uint32_t d;
+
+  if (receiver == NULL)
+    return;
+
+  if (clock_rate)
+    receiver->clock_rate = clock_rate;
+
+  if (!receiver->started) {
+    rtcp_receiver_reset(receiver, seq_number);
+  } else {
+    delta = seq_number - receiver->max_seq_number;
+    if (delta < RTCP_MAX_DROPOUT) {
+      if (seq_number < receiver->max_seq_number)
+        receiver->cycles += 65536;
+      receiver->max_seq_number = seq_number;
+    } else if (delta <= 65536 - RTCP_MAX_MISORDER) {
+      // the sender restarted
+      rtcp_receiver_reset(receiver, seq_number);
+    }
+  }
+
+  receiver->received++;
+
+  // interarrival jitter in timestamp units, kept scaled by 16
+  transit = now * (receiver->clock_rate / 1000) - ntohl(rtp_header->timestamp);
+  if (receiver->received > 1) {
+    d = transit - receiver->transit;
+    if ((int32_t)d < 0)
+      d = -d;
+    receiver->jitter += d - ((receiver->jitter + 8) >> 4);
+  }
+  receiver->transit = transit;
+}
+
+static void rtcp_parse_report_blocks(Rtcp* rtcp, uint8_t* buf, int count, size_t len, uint64_t ntp_time) {
+  int i;
+  uint32_t flcnpl;
+  uint32_t lsr;
+  uint32_t rtt;
+  RtcpReportBlock block;
+  RtcpSenderStats* sender;
+
+  for (i = 0; i < count && (i + 1) * sizeof(RtcpReportBlock) <= len; i++) {
+    memcpy(&block, buf + i * sizeof(RtcpReportBlock), sizeof(RtcpReportBlock));
+
+    sender = rtcp_find_sender(rtcp, ntohl(block.ssrc));
+    if (sender == NULL)
+      continue;
+
+    flcnpl = ntohl(block.flcnpl);
+    sender->fraction_lost = flcnpl >> 24;
+    // cumulative lost is a signed 24-bit number
+    sender->total_lost = (flcnpl & 0x800000) ? (int32_t)(flcnpl | 0xff000000) : (int32_t)(flcnpl & 0xffffff);
+    sender->jitter = ntohl(block.jitter);
+
+    // RTT = A - LSR - DLSR in 1/65536 seconds
+    lsr = ntohl(block.lsr);
+    if (lsr) {
+      rtt = (uint32_t)(ntp_time >> 16) - lsr - ntohl(block.dlsr);
+      if ((int32_t)rtt >= 0)
+        sender->rtt = ((uint64_t)rtt * 1000) >> 16;
+    }
+
+    if (rtcp->on_report)
+      rtcp->on_report(sender, rtcp->user_data);
+  }
+}
+
+void rtcp_on_rtcp_received(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t now) {
+  size_t pos = 0;
+  size_t length;
+  uint64_t ntp_time = ports_get_ntp_time();
+  RtcpHeader* rtcp_header;
+  RtcpReceiverStats* receiver;
+
+  while (pos + sizeof(RtcpHeader) <= size) {
+    rtcp_header = (RtcpHeader*)(packet + pos);
+    length = 4 * ntohs(rtcp_header->length) + 4;
+    if (pos + length > size)
+      break;
+
+    switch (rtcp_header->type) {
+      case RTCP_SR:
+        if (length < 28)
+          break;
+        // remember the middle 32 bits of the NTP timestamp for LSR
+        receiver = rtcp_get_receiver(rtcp, ntohl(*(uint32_t*)(packet + pos + 4)));
+        if (receiver) {
+          receiver->last_sr = (ntohl(*(uint32_t*)(packet + pos + 8)) << 16) | (ntohl(*(uint32_t*)(packet + pos + 12)) >> 16);
+          receiver->last_sr_time = now;
+        }
+        rtcp_parse_report_blocks(rtcp, packet + pos + 28, rtcp_header->rc, length - 28, ntp_time);
+        break;
+      case RTCP_RR:
+        if (length < 8)
+          break;
+        rtcp_parse_report_blocks(rtcp, packet + pos + 8, rtcp_header->rc, length - 8, ntp_time);
+        break;
+      default:
+        break;
+    }
+
+    pos += length;
+  }
+}
+
+static void rtcp_schedule(Rtcp* rtcp, uint32_t now) {
+  // randomized in [0.5, 1.5] of the interval as in RFC 3550 6.3.1
+  rtcp->next_report_time = now + CONFIG_RTCP_INTERVAL / 2 + utils_random_u32() % CONFIG_RTCP_INTERVAL;
+}
+
+int rtcp_report_due(Rtcp* rtcp, uint32_t now) {
+  if (rtcp->next_report_time == 0) {
+    rtcp_schedule(rtcp, now);
+    return 0;
+  }
+
+  return (int32_t)(now - rtcp->next_report_time) >= 0;
+}
+
+static void rtcp_get_report_block(RtcpReceiverStats* receiver, uint8_t* buf, uint32_t now) {
+  RtcpReportBlock block;
+  uint32_t extended_max = receiver->cycles + receiver->max_seq_number;
+  uint32_t expected = extended_max - receiver->base_seq_number + 1;
+  uint32_t expected_interval = expected - receiver->expected_prior;
+  uint32_t received_interval = receiver->received - receiver->received_prior;
+  int32_t lost = expected - receiver->received;
+  int32_t lost_interval = expected_interval - received_interval;
+  uint32_t fraction = 0;
+
+  receiver->expected_prior = expected;
+  receiver->received_prior = receiver->received;
+
+  if (expected_interval > 0 && lost_interval > 0) {
+    fraction = ((uint32_t)lost_interval << 8) / expected_interval;
+    if (fraction > 255)
+      fraction = 255;
+  }
+
+  if (lost > 0x7fffff)
+    lost = 0x7fffff;
+  else if (lost < -0x800000)
+    lost = -0x800000;
+
+  block.ssrc = htonl(receiver->ssrc);
+  block.flcnpl = htonl((fraction << 24) | (lost & 0xffffff));
+  block.ehsnr = htonl(extended_max);
+  block.jitter = htonl(receiver->jitter >> 4);
+  block.lsr = htonl(receiver->last_sr);
+  // delay since last SR in 1/65536 seconds
+  block.dlsr = htonl(receiver->last_sr ? (uint32_t)(((uint64_t)(now - receiver->last_sr_time) << 16) / 1000) : 0);
+  memcpy(buf, &block, sizeof(block));
+}
+
+static int rtcp_get_report_blocks(Rtcp* rtcp, uint8_t* buf, int len, uint32_t now) {
+  int i;
+  int count = 0;
+
+  for (i = 0; i < rtcp->receiver_count; i++) {
+    if (!rtcp->receivers[i].started || (count + 1) * (int)sizeof(RtcpReportBlock) > len)
+      continue;
+    rtcp_get_report_block(&rtcp->receivers[i], buf + count * sizeof(RtcpReportBlock), now);
+    count++;
+  }
+
+  return count;
+}
+
+int rtcp_get_report(Rtcp* rtcp, uint8_t* packet, int len, uint32_t now) {
+  int i;
+  int size = 0;
+  int count;
+  int sdes_size;
+  int cname_len;
+  int has_blocks = 1;
+  uint32_t ntp_msw;
+  uint32_t ntp_lsw;
+  uint64_t ntp_time = ports_get_ntp_time();
+  RtcpHeader* rtcp_header;
+  RtcpSenderStats* sender;
+  RtcpSenderStats* reporter = NULL;
+
+  rtcp_schedule(rtcp, now);
+
+  if (rtcp->sender_count == 0)
+    return 0;
+
+  ntp_msw = htonl(ntp_time >> 32);
+  ntp_lsw = htonl(ntp_time & 0xffffffff);
+
+  // one SR per active stream, reception report blocks go in the first one
+  for (i = 0; i < rtcp->sender_count; i++) {
+    sender = &rtcp->senders[i];
+    if (sender->packet_count == 0 || size + 28 > len)
+      continue;
+
+    rtcp_header = (RtcpHeader*)(packet + size);
+    memset(packet + size, 0, 28);
+    *(uint32_t*)(packet + size + 4) = htonl(sender->ssrc);
+    *(uint32_t*)(packet + size + 8) = ntp_msw;
+    *(uint32_t*)(packet + size + 12) = ntp_lsw;
+    *(uint32_t*)(packet + size + 16) = htonl(sender->rtp_timestamp + (now - sender->rtp_time) * (sender->clock_rate / 1000));
+    *(uint32_t*)(packet + size + 20) = htonl(sender->packet_count);
+    *(uint32_t*)(packet + size + 24) = htonl(sender->octet_count);
+
+    count = 0;
+    if (has_blocks) {
+      count = rtcp_get_report_blocks(rtcp, packet + size + 28, len - size - 28, now);
+      has_blocks = 0;
+      reporter = sender;
+    }
+
+    rtcp_header->version = 2;
+    rtcp_header->type = RTCP_SR;
+    rtcp_header->rc = count;
+    rtcp_header->length = htons((28 + count * sizeof(RtcpReportBlock)) / 4 - 1);
+    size += 28 + count * sizeof(RtcpReportBlock);
+  }
+
+  if (reporter == NULL) {
+    if (len < 8)
+      return -1;
+
+    reporter = &rtcp->senders[0];
+    rtcp_header = (RtcpHeader*)packet;
+    memset(packet, 0, 8);
+    *(uint32_t*)(packet + 4) = htonl(reporter->ssrc);
+    count = rtcp_get_report_blocks(rtcp, packet + 8, len - 8, now);
+    rtcp_header->version = 2;
+    rtcp_header->type = RTCP_RR;
+    rtcp_header->rc = count;
+    rtcp_header->length = htons((8 + count * sizeof(RtcpReportBlock)) / 4 - 1);
+    size = 8 + count * sizeof(RtcpReportBlock);
+  }
+
+  // SDES with the CNAME of the reporting stream, null terminated and padded to 32 bits
+  cname_len = reporter->cname ? strlen(reporter->cname) : 0;
+  sdes_size = ALIGN32(4 + 4 + 2 + cname_len + 1);
+  if (size + sdes_size > len)
+    return -1;
+
+  memset(packet + size, 0, sdes_size);
+  rtcp_header = (RtcpHeader*)(packet + size);
+  rtcp_header->version = 2;
+  rtcp_header->type = RTCP_SDES;
+  rtcp_header->rc = 1;
+  rtcp_header->length = htons(sdes_size / 4 - 1);
+  *(uint32_t*)(packet + size + 4) = htonl(reporter->ssrc);
+  packet[size + 8] = RTCP_SDES_CNAME;
+  packet[size + 9] = cname_len;
+  if (cname_len > 0)
+    memcpy(packet + size + 10, reporter->cname, cname_len);
+  size += sdes_size;
+
+  return size;
+}
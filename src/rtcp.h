@@ -1,6 +1,9 @@
 #ifndef RTCP_H_
 #define RTCP_H_
 
+#include <stdint.h>
+#include <stdlib.h>
+
 #ifdef __BYTE_ORDER
 #define __BIG_ENDIAN 4321
 #define __LITTLE_ENDIAN 1234
@@ -71,12 +74,109 @@ typedef struct RtcpFb {
 
 } RtcpFb;
 
+#define RTCP_MAX_STREAMS 4
+
+typedef enum RtcpSdesType {
+
+  RTCP_SDES_END = 0,
+  RTCP_SDES_CNAME = 1,
+
+} RtcpSdesType;
+
+typedef struct RtcpSenderStats {
+  uint32_t ssrc;
+  uint32_t clock_rate;
+  const char* cname;
+  uint32_t packet_count;
+  uint32_t octet_count;
+  uint32_t rtp_timestamp;
+  uint32_t rtp_time;
+
+  /* from the remote receiver report */
+  uint8_t fraction_lost;
+  int32_t total_lost;
+  uint32_t jitter;
+  uint32_t rtt;
+
+} RtcpSenderStats;
+
+typedef struct RtcpReceiverStats {
+  uint32_t ssrc;
+  uint32_t clock_rate;
+  int started;
+  uint16_t max_seq_number;
+  uint32_t cycles;
+  uint32_t base_seq_number;
+  uint32_t received;
+  uint32_t expected_prior;
+  uint32_t received_prior;
+  uint32_t transit;
+  uint32_t jitter;
+  uint32_t last_sr;
+  uint32_t last_sr_time;
+
+} RtcpReceiverStats;
+
+typedef struct Rtcp {
+  RtcpSenderStats senders[RTCP_MAX_STREAMS];
+  int sender_count;
+  RtcpReceiverStats receivers[RTCP_MAX_STREAMS];
+  int receiver_count;
+  uint32_t next_report_time;
+
+  void (*on_report)(RtcpSenderStats* stats, void* user_data);
+  void* user_data;
+
+} Rtcp;
+
+/**
+ * @brief called for every packet of a transport-cc feedback, arrival_time in microseconds
+ */
+typedef void (*RtcpOnTwccPacket)(uint16_t transport_seq_number, int received, int64_t arrival_time, void* user_data);
+
 int rtcp_probe(uint8_t* packet, size_t size);
 
 int rtcp_get_pli(uint8_t* packet, int len, uint32_t ssrc);
 
 int rtcp_get_fir(uint8_t* packet, int len, int* seqnr);
 
+int rtcp_get_nack(uint8_t* packet, int len, uint32_t ssrc, uint32_t media_ssrc, const uint16_t* seq_numbers, int count);
+
+int rtcp_parse_nack(uint8_t* packet, int len, uint32_t* media_ssrc, uint16_t* seq_numbers, int max_count);
+
 RtcpRr rtcp_parse_rr(uint8_t* packet);
 
+/**
+ * @brief parse a transport-cc feedback (draft-holmer-rmcat-transport-wide-cc-extensions-01)
+ * @return number of packet statuses, -1 if malformed
+ */
+int rtcp_parse_twcc(uint8_t* packet, int len, RtcpOnTwccPacket on_packet, void* user_data);
+
+void rtcp_init(Rtcp* rtcp, void (*on_report)(RtcpSenderStats* stats, void* user_data), void* user_data);
+
+int rtcp_add_sender(Rtcp* rtcp, uint32_t ssrc, uint32_t clock_rate, const char* cname);
+
+/**
+ * @brief account an outgoing RTP packet, before protection
+ */
+void rtcp_on_rtp_sent(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t now);
+
+/**
+ * @brief account an incoming RTP packet, after unprotection
+ */
+void rtcp_on_rtp_received(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t clock_rate, uint32_t now);
+
+/**
+ * @brief handle SR and RR of an incoming compound packet, on_report is called for every block about our streams
+ */
+void rtcp_on_rtcp_received(Rtcp* rtcp, uint8_t* packet, size_t size, uint32_t now);
+
+int rtcp_report_due(Rtcp* rtcp, uint32_t now);
+
+/**
+ * @brief build a compound SR/RR + SDES packet
+ * @return size of the packet, -1 if it does not fit
+ */
+int rtcp_get_report(Rtcp* rtcp, uint8_t* packet, int len, uint32_t now);
+
 #endif  // RTCP_H_
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "address.h"
@@ -27,8 +28,12 @@ typedef struct FuHeader {
   uint8_t s : 1;
 } FuHeader;
 
-#define RTP_PAYLOAD_SIZE (CONFIG_MTU - sizeof(RtpHeader))
-#define FU_PAYLOAD_SIZE (CONFIG_MTU - sizeof(RtpHeader) - sizeof(FuHeader) - sizeof(NaluHeader))
+// leave room for the transport-cc extension added when sending
+#define RTP_PAYLOAD_SIZE (CONFIG_MTU - sizeof(RtpHeader) - RTP_TWCC_EXTENSION_SIZE)
+#define FU_PAYLOAD_SIZE (RTP_PAYLOAD_SIZE - sizeof(FuHeader) - sizeof(NaluHeader))
+
+#define RTP_NACK_RETRY_INTERVAL 100
+#define RTP_NACK_MAX_RETRIES 5
 
 int rtp_packet_validate(uint8_t* packet, size_t size) {
   if (size < 12)
@@ -43,6 +48,57 @@ uint32_t rtp_get_ssrc(uint8_t* packet) {
   return ntohl(rtp_header->ssrc);
 }
 
+uint16_t rtp_get_seq_number(uint8_t* packet) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  return ntohs(rtp_header->seq_number);
+}
+
+uint32_t rtp_get_timestamp(uint8_t* packet) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  return ntohl(rtp_header->timestamp);
+}
+
+int rtp_get_header_size(uint8_t* packet, size_t size) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  size_t header_size = sizeof(RtpHeader) + 4 * rtp_header->csrccount;
+
+  if (rtp_header->extension) {
+    if (size < header_size + 4)
+      return -1;
+    // 16-bit profile + 16-bit length in 32-bit words
+    header_size += 4 + 4 * ntohs(*(uint16_t*)(packet + header_size + 2));
+  }
+
+  if (header_size > size)
+    return -1;
+
+  return (int)header_size;
+}
+
+size_t rtp_set_transport_cc(uint8_t* packet, size_t size, uint8_t id, uint16_t transport_seq_number) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  size_t header_size = sizeof(RtpHeader) + 4 * rtp_header->csrccount;
+  uint8_t* extension = packet + header_size;
+
+  if (rtp_header->extension || size < header_size) {
+    return size;
+  }
+
+  memmove(extension + RTP_TWCC_EXTENSION_SIZE, extension, size - header_size);
+  // RFC 8285 one-byte header, one element of 2 bytes and one byte of padding
+  extension[0] = 0xbe;
+  extension[1] = 0xde;
+  extension[2] = 0x00;
+  extension[3] = 0x01;
+  extension[4] = (id << 4) | 0x01;
+  extension[5] = transport_seq_number >> 8;
+  extension[6] = transport_seq_number & 0xff;
+  extension[7] = 0x00;
+  rtp_header->extension = 1;
+
+  return size + RTP_TWCC_EXTENSION_SIZE;
+}
+
 static int rtp_encoder_encode_h264_single(RtpEncoder* rtp_encoder, uint8_t* buf, size_t size) {
   RtpPacket* rtp_packet = (RtpPacket*)rtp_encoder->buf;
 
@@ -114,7 +170,7 @@ static int rtp_encoder_encode_h264_fu_a(RtpEncoder* rtp_encoder, uint8_t* buf, s
     fu_header->e = 0;
 
     memcpy(rtp_packet->payload + sizeof(NaluHeader) + sizeof(FuHeader), buf, FU_PAYLOAD_SIZE);
-    rtp_encoder->on_packet(rtp_encoder->buf, CONFIG_MTU, rtp_encoder->user_data);
+    rtp_encoder->on_packet(rtp_encoder->buf, sizeof(RtpHeader) + sizeof(NaluHeader) + sizeof(FuHeader) + FU_PAYLOAD_SIZE, rtp_encoder->user_data);
     size -= FU_PAYLOAD_SIZE;
     buf += FU_PAYLOAD_SIZE;
 
@@ -220,6 +276,187 @@ int rtp_encoder_encode(RtpEncoder* rtp_encoder, const uint8_t* buf, size_t size)
   return rtp_encoder->encode_func(rtp_encoder, (uint8_t*)buf, size);
 }
 
+// RFC 4588: the RTX payload is the original sequence number followed by the original payload
+static int rtp_encoder_encode_rtx(RtpEncoder* rtp_encoder, uint8_t* packet, size_t size) {
+  RtpHeader* rtp_header = (RtpHeader*)rtp_encoder->buf;
+  int header_size = rtp_get_header_size(packet, size);
+
+  if (header_size < 0 || size + 2 > sizeof(rtp_encoder->buf)) {
+    return -1;
+  }
+
+  memcpy(rtp_encoder->buf, packet, header_size);
+  memcpy(rtp_encoder->buf + header_size, &((RtpHeader*)packet)->seq_number, 2);
+  memcpy(rtp_encoder->buf + header_size + 2, packet + header_size, size - header_size);
+
+  rtp_header->type = rtp_encoder->type;
+  rtp_header->seq_number = htons(rtp_encoder->seq_number++);
+  rtp_header->ssrc = htonl(rtp_encoder->ssrc);
+
+  rtp_encoder->on_packet(rtp_encoder->buf, size + 2, rtp_encoder->user_data);
+  return 0;
+}
+
+void rtp_rtx_encoder_init(RtpEncoder* rtp_encoder, uint8_t type, uint32_t ssrc, RtpOnPacket on_packet, void* user_data) {
+  rtp_encoder->on_packet = on_packet;
+  rtp_encoder->user_data = user_data;
+  rtp_encoder->type = type;
+  rtp_encoder->ssrc = ssrc;
+  rtp_encoder->timestamp = 0;
+  rtp_encoder->timestamp_increment = 0;
+  rtp_encoder->seq_number = 0;
+  rtp_encoder->encode_func = rtp_encoder_encode_rtx;
+}
+
+int rtp_rtx_unwrap(uint8_t* packet, size_t size, uint8_t type, uint32_t ssrc) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  int header_size = rtp_get_header_size(packet, size);
+
+  if (header_size < 0 || size < header_size + 2) {
+    return -1;
+  }
+
+  memcpy(&rtp_header->seq_number, packet + header_size, 2);
+  memmove(packet + header_size, packet + header_size + 2, size - header_size - 2);
+  rtp_header->type = type;
+  rtp_header->ssrc = htonl(ssrc);
+  return (int)size - 2;
+}
+
+int rtp_history_init(RtpHistory* history, int capacity, uint32_t duration) {
+  history->entries = NULL;
+  history->capacity = 0;
+  history->duration = duration;
+
+  if (capacity <= 0) {
+    return 0;
+  }
+
+  history->entries = (RtpHistoryEntry*)calloc(capacity, sizeof(RtpHistoryEntry));
+  if (history->entries == NULL) {
+    LOGE("Failed to allocate RTP history");
+    return -1;
+  }
+
+  history->capacity = capacity;
+  return 0;
+}
+
+void rtp_history_deinit(RtpHistory* history) {
+  if (history->entries) {
+    free(history->entries);
+    history->entries = NULL;
+  }
+  history->capacity = 0;
+}
+
+void rtp_history_put(RtpHistory* history, const uint8_t* packet, size_t size, uint32_t now) {
+  RtpHistoryEntry* entry;
+  uint16_t seq_number;
+
+  if (history->entries == NULL || size > sizeof(entry->packet)) {
+    return;
+  }
+
+  seq_number = rtp_get_seq_number((uint8_t*)packet);
+  entry = &history->entries[seq_number % history->capacity];
+  entry->time = now;
+  entry->seq_number = seq_number;
+  entry->size = size;
+  memcpy(entry->packet, packet, size);
+}
+
+RtpHistoryEntry* rtp_history_get(RtpHistory* history, uint16_t seq_number, uint32_t now) {
+  RtpHistoryEntry* entry;
+
+  if (history->entries == NULL) {
+    return NULL;
+  }
+
+  entry = &history->entries[seq_number % history->capacity];
+  if (entry->size == 0 || entry->seq_number != seq_number || now - entry->time > history->duration) {
+    return NULL;
+  }
+
+  return entry;
+}
+
+void rtp_nack_tracker_reset(RtpNackTracker* tracker) {
+  memset(tracker, 0, sizeof(RtpNackTracker));
+}
+
+static void rtp_nack_tracker_remove(RtpNackTracker* tracker, int index) {
+  tracker->count--;
+  memmove(&tracker->items[index], &tracker->items[index + 1], (tracker->count - index) * sizeof(RtpNackItem));
+}
+
+void rtp_nack_tracker_update(RtpNackTracker* tracker, uint16_t seq_number, uint32_t now) {
+  int i;
+  uint16_t lost;
+  int16_t diff;
+  RtpNackItem* item;
+
+  if (!tracker->started) {
+    tracker->started = 1;
+    tracker->max_seq_number = seq_number;
+    return;
+  }
+
+  diff = (int16_t)(seq_number - tracker->max_seq_number);
+
+  if (diff > 0) {
+    if (diff > RTP_NACK_LIST_SIZE) {
+      // the sender restarted or we lost too much to recover, start over
+      tracker->count = 0;
+    } else {
+      for (lost = tracker->max_seq_number + 1; lost != seq_number; lost++) {
+        if (tracker->count == RTP_NACK_LIST_SIZE) {
+          rtp_nack_tracker_remove(tracker, 0);
+        }
+        item = &tracker->items[tracker->count++];
+        item->seq_number = lost;
+        item->retries = 0;
+        item->lost_time = now;
+        item->sent_time = 0;
+      }
+    }
+    tracker->max_seq_number = seq_number;
+    return;
+  }
+
+  // reordered or retransmitted packet
+  for (i = 0; i < tracker->count; i++) {
+    if (tracker->items[i].seq_number == seq_number) {
+      rtp_nack_tracker_remove(tracker, i);
+      break;
+    }
+  }
+}
+
+int rtp_nack_tracker_get_pending(RtpNackTracker* tracker, uint16_t* seq_numbers, int max_count, uint32_t now) {
+  int i = 0;
+  int count = 0;
+  RtpNackItem* item;
+
+  while (i < tracker->count) {
+    item = &tracker->items[i];
+
+    if (now - item->lost_time > CONFIG_NACK_MAX_DELAY || item->retries >= RTP_NACK_MAX_RETRIES) {
+      rtp_nack_tracker_remove(tracker, i);
+      continue;
+    }
+
+    if (count < max_count && (item->retries == 0 || now - item->sent_time >= RTP_NACK_RETRY_INTERVAL)) {
+      item->retries++;
+      item->sent_time = now;
+      seq_numbers[count++] = item->seq_number;
+    }
+    i++;
+  }
+
+  return count;
+}
+
 static int rtp_decode_h264(RtpDecoder* rtp_decoder, uint8_t* buf, size_t size) {
   static const uint32_t nalu_start_4bytecode = 0x01000000;
   static uint8_t nalu_buf[CONFIG_MAX_NALU_SIZE];
@@ -21,6 +21,8 @@ typedef enum RtpPayloadType {
   PT_PCMA = 8,
   PT_G722 = 9,
   PT_H264 = 96,
+  PT_RTX = 97,
+  PT_FLEXFEC = 98,
   PT_OPUS = 111
 
 } RtpPayloadType;
@@ -28,6 +30,8 @@ typedef enum RtpPayloadType {
 typedef enum RtpSsrc {
 
   SSRC_H264 = 1,
+  SSRC_RTX = 2,
+  SSRC_FLEXFEC = 3,
   SSRC_PCMA = 4,
   SSRC_PCMU = 5,
   SSRC_OPUS = 6,
@@ -93,6 +97,44 @@ struct RtpEncoder {
   uint8_t buf[CONFIG_MTU + 128];
 };
 
+#define RTP_NACK_LIST_SIZE 64
+
+// one-byte header extension block carrying the 16-bit transport-wide sequence number
+#define RTP_TWCC_EXTENSION_SIZE 8
+#define RTP_TWCC_EXTENSION_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+
+typedef struct RtpHistoryEntry {
+  uint32_t time;
+  uint16_t seq_number;
+  uint16_t size;
+  // received packets are kept with their header extensions
+  uint8_t packet[CONFIG_MTU + RTP_TWCC_EXTENSION_SIZE];
+
+} RtpHistoryEntry;
+
+typedef struct RtpHistory {
+  RtpHistoryEntry* entries;
+  int capacity;
+  uint32_t duration;
+
+} RtpHistory;
+
+typedef struct RtpNackItem {
+  uint16_t seq_number;
+  uint8_t retries;
+  uint32_t lost_time;
+  uint32_t sent_time;
+
+} RtpNackItem;
+
+typedef struct RtpNackTracker {
+  int started;
+  uint16_t max_seq_number;
+  int count;
+  RtpNackItem items[RTP_NACK_LIST_SIZE];
+
+} RtpNackTracker;
+
 int rtp_packet_validate(uint8_t* packet, size_t size);
 
 void rtp_encoder_init(RtpEncoder* rtp_encoder, MediaCodec codec, RtpOnPacket on_packet, void* user_data);
@@ -105,4 +147,34 @@ int rtp_decoder_decode(RtpDecoder* rtp_decoder, const uint8_t* data, size_t size
 
 uint32_t rtp_get_ssrc(uint8_t* packet);
 
+uint16_t rtp_get_seq_number(uint8_t* packet);
+
+uint32_t rtp_get_timestamp(uint8_t* packet);
+
+int rtp_get_header_size(uint8_t* packet, size_t size);
+
+/**
+ * @brief insert the transport-cc header extension, the packet buffer needs RTP_TWCC_EXTENSION_SIZE bytes of room
+ * @return new size of the packet
+ */
+size_t rtp_set_transport_cc(uint8_t* packet, size_t size, uint8_t id, uint16_t transport_seq_number);
+
+void rtp_rtx_encoder_init(RtpEncoder* rtp_encoder, uint8_t type, uint32_t ssrc, RtpOnPacket on_packet, void* user_data);
+
+int rtp_rtx_unwrap(uint8_t* packet, size_t size, uint8_t type, uint32_t ssrc);
+
+int rtp_history_init(RtpHistory* history, int capacity, uint32_t duration);
+
+void rtp_history_deinit(RtpHistory* history);
+
+void rtp_history_put(RtpHistory* history, const uint8_t* packet, size_t size, uint32_t now);
+
+RtpHistoryEntry* rtp_history_get(RtpHistory* history, uint16_t seq_number, uint32_t now);
+
+void rtp_nack_tracker_reset(RtpNackTracker* tracker);
+
+void rtp_nack_tracker_update(RtpNackTracker* tracker, uint16_t seq_number, uint32_t now);
+
+int rtp_nack_tracker_get_pending(RtpNackTracker* tracker, uint16_t* seq_numbers, int max_count, uint32_t now);
+
 #endif  // RTP_H_
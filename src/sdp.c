@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include "rtp.h"
 #include "sdp.h"
 
 int sdp_append(char* sdp, const char* format, ...) {
@@ -26,43 +27,82 @@ void sdp_reset(char* sdp) {
   memset(sdp, 0, CONFIG_SDP_BUFFER_SIZE);
 }
 
-void sdp_append_h264(char* sdp) {
-  sdp_append(sdp, "m=video 9 UDP/TLS/RTP/SAVPF 96");
+void sdp_append_h264(char* sdp, int twcc_ext_id, int rtx_pt, int fec_pt) {
+  char rtx[8] = "";
+  char fec[8] = "";
+
+  if (rtx_pt) {
+    snprintf(rtx, sizeof(rtx), " %d", rtx_pt);
+  }
+  if (fec_pt) {
+    snprintf(fec, sizeof(fec), " %d", fec_pt);
+  }
+
+  sdp_append(sdp, "m=video 9 UDP/TLS/RTP/SAVPF 96%s%s", rtx, fec);
   sdp_append(sdp, "c=IN IP4 0.0.0.0");
   sdp_append(sdp, "a=rtcp-fb:96 nack");
   sdp_append(sdp, "a=rtcp-fb:96 nack pli");
+  if (twcc_ext_id) {
+    sdp_append(sdp, "a=rtcp-fb:96 transport-cc");
+    sdp_append(sdp, "a=extmap:%d " RTP_TWCC_EXTENSION_URI, twcc_ext_id);
+  }
   sdp_append(sdp, "a=fmtp:96 profile-level-id=42e01f;level-asymmetry-allowed=1");
   sdp_append(sdp, "a=rtpmap:96 H264/90000");
+  if (rtx_pt) {
+    sdp_append(sdp, "a=rtpmap:%d rtx/90000", rtx_pt);
+    sdp_append(sdp, "a=fmtp:%d apt=96", rtx_pt);
+    sdp_append(sdp, "a=ssrc-group:FID 1 2");
+  }
+  if (fec_pt) {
+    sdp_append(sdp, "a=rtpmap:%d flexfec/90000", fec_pt);
+    sdp_append(sdp, "a=fmtp:%d repair-window=%d", fec_pt, CONFIG_FEC_REPAIR_WINDOW * 1000);
+    sdp_append(sdp, "a=ssrc-group:FEC-FR 1 3");
+  }
   sdp_append(sdp, "a=ssrc:1 cname:webrtc-h264");
+  if (rtx_pt) {
+    sdp_append(sdp, "a=ssrc:2 cname:webrtc-h264");
+  }
+  if (fec_pt) {
+    sdp_append(sdp, "a=ssrc:3 cname:webrtc-h264");
+  }
   sdp_append(sdp, "a=sendrecv");
   sdp_append(sdp, "a=mid:video");
   sdp_append(sdp, "a=rtcp-mux");
 }
 
-void sdp_append_pcma(char* sdp) {
+void sdp_append_pcma(char* sdp, int twcc_ext_id) {
   sdp_append(sdp, "m=audio 9 UDP/TLS/RTP/SAVP 8");
   sdp_append(sdp, "c=IN IP4 0.0.0.0");
   sdp_append(sdp, "a=rtpmap:8 PCMA/8000");
+  if (twcc_ext_id) {
+    sdp_append(sdp, "a=extmap:%d " RTP_TWCC_EXTENSION_URI, twcc_ext_id);
+  }
   sdp_append(sdp, "a=ssrc:4 cname:webrtc-pcma");
   sdp_append(sdp, "a=sendrecv");
   sdp_append(sdp, "a=mid:audio");
   sdp_append(sdp, "a=rtcp-mux");
 }
 
-void sdp_append_pcmu(char* sdp) {
+void sdp_append_pcmu(char* sdp, int twcc_ext_id) {
   sdp_append(sdp, "m=audio 9 UDP/TLS/RTP/SAVP 0");
   sdp_append(sdp, "c=IN IP4 0.0.0.0");
   sdp_append(sdp, "a=rtpmap:0 PCMU/8000");
+  if (twcc_ext_id) {
+    sdp_append(sdp, "a=extmap:%d " RTP_TWCC_EXTENSION_URI, twcc_ext_id);
+  }
   sdp_append(sdp, "a=ssrc:5 cname:webrtc-pcmu");
   sdp_append(sdp, "a=sendrecv");
   sdp_append(sdp, "a=mid:audio");
   sdp_append(sdp, "a=rtcp-mux");
 }
 
-void sdp_append_opus(char* sdp) {
+void sdp_append_opus(char* sdp, int twcc_ext_id) {
   sdp_append(sdp, "m=audio 9 UDP/TLS/RTP/SAVP 111");
   sdp_append(sdp, "c=IN IP4 0.0.0.0");
   sdp_append(sdp, "a=rtpmap:111 opus/48000/2");
+  if (twcc_ext_id) {
+    sdp_append(sdp, "a=extmap:%d " RTP_TWCC_EXTENSION_URI, twcc_ext_id);
+  }
   sdp_append(sdp, "a=ssrc:6 cname:webrtc-opus");
   sdp_append(sdp, "a=sendrecv");
   sdp_append(sdp, "a=mid:audio");
@@ -84,9 +124,6 @@ void sdp_create(char* sdp, int b_video, int b_audio, int b_datachannel) {
   sdp_append(sdp, "s=-");
   sdp_append(sdp, "t=0 0");
   sdp_append(sdp, "a=msid-semantic: iot");
-#if ICE_LITE
-  sdp_append(sdp, "a=ice-lite");
-#endif
   memset(bundle, 0, sizeof(bundle));
 
   strcat(bundle, "a=group:BUNDLE");
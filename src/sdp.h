@@ -6,17 +6,23 @@
 
 #define SDP_ATTR_LENGTH 128
 
+// build-wide default for PeerConfiguration.ice_lite
 #ifndef ICE_LITE
 #define ICE_LITE 0
 #endif
 
-void sdp_append_h264(char* sdp);
+// transport-cc header extension id put in offers, answers take the one offered
+#define SDP_TWCC_EXT_ID 3
 
-void sdp_append_pcma(char* sdp);
+// twcc_ext_id 0 leaves out the transport-cc feedback and header extension,
+// rtx_pt and fec_pt 0 leave out the RTX and FlexFEC streams
+void sdp_append_h264(char* sdp, int twcc_ext_id, int rtx_pt, int fec_pt);
 
-void sdp_append_pcmu(char* sdp);
+void sdp_append_pcma(char* sdp, int twcc_ext_id);
 
-void sdp_append_opus(char* sdp);
+void sdp_append_pcmu(char* sdp, int twcc_ext_id);
+
+void sdp_append_opus(char* sdp, int twcc_ext_id);
 
 void sdp_append_datachannel(char* sdp);
 
@@ -1,3 +1,8 @@
+// sendmmsg
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +20,17 @@
 #include <lwip/sockets.h>
 #include <lwip/igmp.h>
 #else
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && !defined(__RP2040_BM__) && !CONFIG_USE_LWIP
+#define UDP_SOCKET_SENDMMSG 1
+// datagrams handed to the kernel per sendmmsg call
+#define UDP_SOCKET_BATCH_MAX 16
 #endif
 
 #include "socket.h"
@@ -223,7 +238,7 @@ int udp_socket_open(UdpSocket* udp_socket, int family, int port) {
         int retries;
         for (retries = 0; retries < EPHEMERAL_PORT_RETRIES; retries++) {
             port = EPHEMERAL_PORT_LO +
-                   (rand() % (EPHEMERAL_PORT_HI - EPHEMERAL_PORT_LO + 1));
+                   (utils_random_u32() % (EPHEMERAL_PORT_HI - EPHEMERAL_PORT_LO + 1));
             if (family == AF_INET6) {
                 err = udp_bind(rp_sock.pcb, IP6_ADDR_ANY, port);
             } else {
@@ -402,6 +417,20 @@ int udp_socket_sendto(UdpSocket* udp_socket, Address* addr, const uint8_t* buf,
     return len;
 }
 #else
+static struct sockaddr* udp_socket_sockaddr(Address* addr, socklen_t* sock_len) {
+  switch (addr->family) {
+    case AF_INET6:
+      addr->sin6.sin6_family = AF_INET6;
+      *sock_len = sizeof(struct sockaddr_in6);
+      return (struct sockaddr*)&addr->sin6;
+    case AF_INET:
+    default:
+      addr->sin.sin_family = AF_INET;
+      *sock_len = sizeof(struct sockaddr_in);
+      return (struct sockaddr*)&addr->sin;
+  }
+}
+
 int udp_socket_sendto(UdpSocket* udp_socket, Address* addr, const uint8_t* buf, int len) {
   struct sockaddr* sa;
   socklen_t sock_len;
@@ -412,19 +441,7 @@ int udp_socket_sendto(UdpSocket* udp_socket, Address* addr, const uint8_t* buf,
     return -1;
   }
 
-  switch (addr->family) {
-    case AF_INET6:
-      addr->sin6.sin6_family = AF_INET6;
-      sa = (struct sockaddr*)&addr->sin6;
-      sock_len = sizeof(struct sockaddr_in6);
-      break;
-    case AF_INET:
-    default:
-      addr->sin.sin_family = AF_INET;
-      sa = (struct sockaddr*)&addr->sin;
-      sock_len = sizeof(struct sockaddr_in);
-      break;
-  }
+  sa = udp_socket_sockaddr(addr, &sock_len);
 
   if ((ret = sendto(udp_socket->fd, buf, len, 0, sa, sock_len)) < 0) {
     LOGE("Failed to sendto: %s", strerror(errno));
@@ -435,6 +452,58 @@ int udp_socket_sendto(UdpSocket* udp_socket, Address* addr, const uint8_t* buf,
 }
 #endif
 
+#if UDP_SOCKET_SENDMMSG
+int udp_socket_sendto_batch(UdpSocket* udp_socket, Address* addr, const uint8_t** bufs, const int* lens, int count) {
+  struct mmsghdr msgs[UDP_SOCKET_BATCH_MAX];
+  struct iovec iovs[UDP_SOCKET_BATCH_MAX];
+  struct sockaddr* sa;
+  socklen_t sock_len;
+  int i, n, ret, sent = 0;
+
+  if (udp_socket->fd < 0) {
+    LOGE("sendto before socket init");
+    return -1;
+  }
+
+  sa = udp_socket_sockaddr(addr, &sock_len);
+  memset(msgs, 0, sizeof(msgs));
+
+  while (sent < count) {
+    n = count - sent < UDP_SOCKET_BATCH_MAX ? count - sent : UDP_SOCKET_BATCH_MAX;
+    for (i = 0; i < n; i++) {
+      iovs[i].iov_base = (void*)bufs[sent + i];
+      iovs[i].iov_len = lens[sent + i];
+      msgs[i].msg_hdr.msg_name = sa;
+      msgs[i].msg_hdr.msg_namelen = sock_len;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((ret = sendmmsg(udp_socket->fd, msgs, n, 0)) < 0) {
+      LOGE("Failed to sendmmsg: %s", strerror(errno));
+      break;
+    }
+
+    sent += ret;
+    // the socket buffer is full, the rest would fail the same way
+    if (ret < n) {
+      break;
+    }
+  }
+
+  return sent > 0 ? sent : -1;
+}
+#else
+int udp_socket_sendto_batch(UdpSocket* udp_socket, Address* addr, const uint8_t** bufs, const int* lens, int count) {
+  int sent = 0;
+
+  while (sent < count && udp_socket_sendto(udp_socket, addr, bufs[sent], lens[sent]) >= 0) {
+    sent++;
+  }
+  return sent > 0 ? sent : -1;
+}
+#endif
+
 #ifdef __RP2040_BM__
 int udp_socket_recvfrom(UdpSocket* udp_socket, Address* addr, uint8_t* buf, int len) {
     Rp2040UdpSocket *sock = (Rp2040UdpSocket *)udp_socket->priv;
@@ -658,6 +727,9 @@ int tcp_socket_connect(TcpSocket* tcp_socket, Address* addr) {
   addr_to_string(addr, addr_string, sizeof(addr_string));
   LOGI("Connecting to server: %s:%d", addr_string, addr->port);
   if ((ret = connect(tcp_socket->fd, sa, sock_len)) < 0) {
+    if (errno == EINPROGRESS) {
+      return 1;
+    }
     LOGE("Failed to connect to server");
     return -1;
   }
@@ -803,3 +875,65 @@ int tcp_socket_recv(TcpSocket* tcp_socket, uint8_t* buf, int len) {
   return ret;
 }
 #endif
+
+#ifdef __RP2040_BM__
+int tcp_socket_set_nonblocking(TcpSocket* tcp_socket, int nonblocking) {
+  // the lwIP raw API never blocks
+  return 0;
+}
+
+int tcp_socket_wait_connected(TcpSocket* tcp_socket, int timeout) {
+  Rp2040TcpSocket* sock = (Rp2040TcpSocket*)tcp_socket->priv;
+
+  if (!sock || !sock->pcb || sock->error) {
+    return -1;
+  }
+  return sock->connected ? 0 : 1;
+}
+#else
+int tcp_socket_set_nonblocking(TcpSocket* tcp_socket, int nonblocking) {
+  int flags;
+
+  if (tcp_socket->fd < 0 || (flags = fcntl(tcp_socket->fd, F_GETFL, 0)) < 0) {
+    return -1;
+  }
+
+  flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  if (fcntl(tcp_socket->fd, F_SETFL, flags) < 0) {
+    LOGE("Failed to set O_NONBLOCK: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int tcp_socket_wait_connected(TcpSocket* tcp_socket, int timeout) {
+  int ret;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  fd_set wfds;
+  struct timeval tv;
+
+  if (tcp_socket->fd < 0) {
+    return -1;
+  }
+
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  FD_ZERO(&wfds);
+  FD_SET(tcp_socket->fd, &wfds);
+
+  if ((ret = select(tcp_socket->fd + 1, NULL, &wfds, NULL, &tv)) < 0) {
+    return -1;
+  } else if (ret == 0) {
+    return 1;
+  }
+
+  if (getsockopt(tcp_socket->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+    LOGE("Failed to connect to server: %s", strerror(error));
+    return -1;
+  }
+
+  LOGI("Server is connected");
+  return 0;
+}
+#endif
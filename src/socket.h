@@ -27,14 +27,31 @@ void udp_socket_close(UdpSocket* udp_socket);
 
 int udp_socket_sendto(UdpSocket* udp_socket, Address* bind_addr, const uint8_t* buf, int len);
 
+/**
+ * @brief send datagrams to one address, with a single sendmmsg per UDP_SOCKET_BATCH_MAX on Linux
+ * @return the number sent, -1 if none was
+ */
+int udp_socket_sendto_batch(UdpSocket* udp_socket, Address* addr, const uint8_t** bufs, const int* lens, int count);
+
 int udp_socket_recvfrom(UdpSocket* udp_sock, Address* bind_addr, uint8_t* buf, int len);
 
 int udp_socket_add_multicast_group(UdpSocket* udp_socket, Address* mcast_addr);
 
 int tcp_socket_open(TcpSocket* tcp_socket, int family);
 
+/**
+ * @return 0 when connected, 1 if a non-blocking socket is still connecting, -1 on failure
+ */
 int tcp_socket_connect(TcpSocket* tcp_socket, Address* addr);
 
+int tcp_socket_set_nonblocking(TcpSocket* tcp_socket, int nonblocking);
+
+/**
+ * @brief wait up to timeout ms for a non-blocking connect to finish
+ * @return 0 when connected, 1 if still connecting, -1 on failure
+ */
+int tcp_socket_wait_connected(TcpSocket* tcp_socket, int timeout);
+
 void tcp_socket_close(TcpSocket* tcp_socket);
 
 int tcp_socket_send(TcpSocket* tcp_socket, const uint8_t* buf, int len);
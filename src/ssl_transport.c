@@ -3,9 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "mbedtls/ctr_drbg.h"
 #include "mbedtls/debug.h"
-#include "mbedtls/entropy.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
 
@@ -68,29 +66,43 @@ static int ssl_transport_mbedtls_recv_timeout(void* ctx, unsigned char* buf, siz
 }
 #endif
 
+static int ssl_transport_mbedtls_recv_nonblocking(void* ctx, unsigned char* buf, size_t len) {
+  int ret;
+#ifdef __RP2040_BM__
+  cyw43_arch_poll();
+#else
+  fd_set read_fds;
+  struct timeval tv = {0, 0};
+
+  FD_ZERO(&read_fds);
+  FD_SET(((TcpSocket*)ctx)->fd, &read_fds);
+  if ((ret = select(((TcpSocket*)ctx)->fd + 1, &read_fds, NULL, NULL, &tv)) <= 0) {
+    return ret < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : MBEDTLS_ERR_SSL_WANT_READ;
+  }
+#endif
+
+  ret = tcp_socket_recv((TcpSocket*)ctx, buf, len);
+  if (ret < 0) {
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+#ifdef __RP2040_BM__
+  if (ret == 0) {
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  }
+#endif
+  return ret;
+}
+
 static int ssl_transport_mbedlts_send(void* ctx, const uint8_t* buf, size_t len) {
   return tcp_socket_send((TcpSocket*)ctx, buf, len);
 }
 
-int ssl_transport_connect(NetworkContext_t* net_ctx,
-                          const char* host,
-                          uint16_t port,
-                          const char* cacert) {
-  const char* pers = "ssl_client";
+static int ssl_transport_setup(NetworkContext_t* net_ctx, const char* host) {
   int ret;
-  Address resolved_addr;
 
   mbedtls_ssl_init(&net_ctx->ssl);
   mbedtls_ssl_config_init(&net_ctx->conf);
   // mbedtls_x509_crt_init(&net_ctx->cacert);
-  mbedtls_ctr_drbg_init(&net_ctx->ctr_drbg);
-  mbedtls_entropy_init(&net_ctx->entropy);
-
-  if ((ret = mbedtls_ctr_drbg_seed(&net_ctx->ctr_drbg, mbedtls_entropy_func, &net_ctx->entropy,
-                                   (const unsigned char*)pers, strlen(pers))) != 0) {
-    return -1;
-  }
-
   if ((ret = mbedtls_ssl_config_defaults(&net_ctx->conf,
                                          MBEDTLS_SSL_IS_CLIENT,
                                          MBEDTLS_SSL_TRANSPORT_STREAM,
@@ -109,7 +121,7 @@ int ssl_transport_connect(NetworkContext_t* net_ctx,
   mbedtls_ssl_conf_ca_chain(&net_ctx->conf, &net_ctx->cacert, NULL);
   */
 
-  mbedtls_ssl_conf_rng(&net_ctx->conf, mbedtls_ctr_drbg_random, &net_ctx->ctr_drbg);
+  mbedtls_ssl_conf_rng(&net_ctx->conf, utils_random, NULL);
 
   if ((ret = mbedtls_ssl_setup(&net_ctx->ssl, &net_ctx->conf)) != 0) {
     LOGE("ssl setup error: -0x%x", (unsigned int)-ret);
@@ -121,6 +133,20 @@ int ssl_transport_connect(NetworkContext_t* net_ctx,
     return -1;
   }
 
+  return 0;
+}
+
+int ssl_transport_connect(NetworkContext_t* net_ctx,
+                          const char* host,
+                          uint16_t port,
+                          const char* cacert) {
+  int ret;
+  Address resolved_addr;
+
+  if (ssl_transport_setup(net_ctx, host) != 0) {
+    return -1;
+  }
+
   memset(&resolved_addr, 0, sizeof(resolved_addr));
   tcp_socket_open(&net_ctx->tcp_socket, AF_INET);
   if (ports_resolve_addr(host, &resolved_addr) < 0) {
@@ -148,11 +174,49 @@ int ssl_transport_connect(NetworkContext_t* net_ctx,
   return 0;
 }
 
+int ssl_transport_start(NetworkContext_t* net_ctx, const char* host) {
+  if (ssl_transport_setup(net_ctx, host) != 0) {
+    return -1;
+  }
+
+  mbedtls_ssl_set_bio(&net_ctx->ssl, &net_ctx->tcp_socket,
+                      ssl_transport_mbedlts_send, ssl_transport_mbedtls_recv_nonblocking, NULL);
+  return ssl_transport_handshake(net_ctx) < 0 ? -1 : 0;
+}
+
+int ssl_transport_handshake(NetworkContext_t* net_ctx) {
+  int ret = mbedtls_ssl_handshake(&net_ctx->ssl);
+
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 1;
+  } else if (ret != 0) {
+    LOGE("ssl handshake error: -0x%x", (unsigned int)-ret);
+    return -1;
+  }
+
+  LOGI("handshake success");
+  return 0;
+}
+
+size_t ssl_transport_pending(NetworkContext_t* net_ctx) {
+  return mbedtls_ssl_get_bytes_avail(&net_ctx->ssl);
+}
+
+int32_t ssl_transport_read(NetworkContext_t* net_ctx, void* buf, size_t len) {
+  int ret = mbedtls_ssl_read(&net_ctx->ssl, buf, len);
+
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 0;
+  } else if (ret == 0) {
+    // close notify or EOF
+    return -1;
+  }
+  return ret;
+}
+
 void ssl_transport_disconnect(NetworkContext_t* net_ctx) {
   mbedtls_ssl_config_free(&net_ctx->conf);
   // mbedtls_x509_crt_free(&net_ctx->cacert);
-  mbedtls_ctr_drbg_free(&net_ctx->ctr_drbg);
-  mbedtls_entropy_free(&net_ctx->entropy);
   mbedtls_ssl_free(&net_ctx->ssl);
 
   tcp_socket_close(&net_ctx->tcp_socket);
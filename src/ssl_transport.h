@@ -3,8 +3,6 @@
 
 #ifndef DISABLE_PEER_SIGNALING
 
-#include <mbedtls/ctr_drbg.h>
-#include <mbedtls/entropy.h>
 #include <mbedtls/ssl.h>
 #include <stdint.h>
 
@@ -14,8 +12,6 @@
 struct NetworkContext {
   TcpSocket tcp_socket;
   mbedtls_ssl_context ssl;
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
   mbedtls_ssl_config conf;
   mbedtls_x509_crt cacert;
 };
@@ -25,6 +21,28 @@ int ssl_transport_connect(NetworkContext_t* net_ctx,
                           uint16_t port,
                           const char* cacert);
 
+/**
+ * @brief start a TLS session on the already connected net_ctx->tcp_socket without blocking,
+ * ssl_transport_handshake is called until it returns 0
+ */
+int ssl_transport_start(NetworkContext_t* net_ctx, const char* host);
+
+/**
+ * @return 0 when the handshake is done, 1 while waiting for the server, -1 on failure
+ */
+int ssl_transport_handshake(NetworkContext_t* net_ctx);
+
+/**
+ * @return decrypted bytes held by the session that ssl_transport_read returns without touching the socket
+ */
+size_t ssl_transport_pending(NetworkContext_t* net_ctx);
+
+/**
+ * @brief read from a session created by ssl_transport_start
+ * @return bytes read, 0 if nothing arrived yet, -1 when the session is closed or failed
+ */
+int32_t ssl_transport_read(NetworkContext_t* net_ctx, void* buf, size_t len);
+
 void ssl_transport_disconnect(NetworkContext_t* net_ctx);
 
 int32_t ssl_transport_recv(NetworkContext_t* net_ctx, void* buf, size_t len);
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "address.h"
+#include "utils.h"
 
 typedef struct StunHeader StunHeader;
 
@@ -13,7 +14,8 @@ typedef struct StunAttribute StunAttribute;
 
 typedef struct StunMessage StunMessage;
 
-#define STUN_ATTR_BUF_SIZE 256
+// room for the largest message we build, a long-term authenticated TURN request
+#define STUN_ATTR_BUF_SIZE 512
 #define MAGIC_COOKIE 0x2112A442
 #define STUN_FINGERPRINT_XOR 0x5354554e
 
@@ -30,6 +32,11 @@ typedef enum StunMethod {
 
   STUN_METHOD_BINDING = 0x0001,
   STUN_METHOD_ALLOCATE = 0x0003,
+  STUN_METHOD_REFRESH = 0x0004,
+  STUN_METHOD_SEND = 0x0006,
+  STUN_METHOD_DATA = 0x0007,
+  STUN_METHOD_CREATE_PERMISSION = 0x0008,
+  STUN_METHOD_CHANNEL_BIND = 0x0009,
 
 } StunMethod;
 
@@ -38,7 +45,11 @@ typedef enum StunAttrType {
   STUN_ATTR_TYPE_MAPPED_ADDRESS = 0x0001,
   STUN_ATTR_TYPE_USERNAME = 0x0006,
   STUN_ATTR_TYPE_MESSAGE_INTEGRITY = 0x0008,
+  STUN_ATTR_TYPE_ERROR_CODE = 0x0009,
+  STUN_ATTR_TYPE_CHANNEL_NUMBER = 0x000c,
   STUN_ATTR_TYPE_LIFETIME = 0x000d,
+  STUN_ATTR_TYPE_XOR_PEER_ADDRESS = 0x0012,
+  STUN_ATTR_TYPE_DATA = 0x0013,
   STUN_ATTR_TYPE_REALM = 0x0014,
   STUN_ATTR_TYPE_NONCE = 0x0015,
   STUN_ATTR_TYPE_XOR_RELAYED_ADDRESS = 0x0016,
@@ -85,15 +96,16 @@ struct StunAttribute {
 struct StunMessage {
   StunClass stunclass;
   StunMethod stunmethod;
-  uint32_t fingerprint;
-  char message_integrity[20];
   char username[128];
   char realm[64];
   char nonce[64];
   Address mapped_addr;
   Address relayed_addr;
-  uint8_t buf[STUN_ATTR_BUF_SIZE];
+  uint32_t lifetime;
+  int error_code;
+  uint8_t* buf;  // storage for a message being built, or the received message parsed in place
   size_t size;
+  uint8_t storage[STUN_ATTR_BUF_SIZE];
 };
 
 void stun_msg_create(StunMessage* msg, uint16_t type);
@@ -102,9 +114,13 @@ int stun_set_mapped_address(char* value, uint8_t* mask, Address* addr);
 
 void stun_get_mapped_address(char* value, uint8_t* mask, Address* addr);
 
-void stun_msg_parse(StunMessage* msg, uint8_t* buf, size_t len);
+/**
+ * @brief parse a received message in place, msg->buf points into buf afterwards
+ * @return -1 if an attribute runs past the message or the buffer
+ */
+int stun_msg_parse(StunMessage* msg, uint8_t* buf, size_t len);
 
-void stun_parse_msg_buf(StunMessage* msg);
+int stun_parse_msg_buf(StunMessage* msg);
 
 void stun_calculate_fingerprint(char* buf, size_t len, uint32_t* fingerprint);
 
@@ -112,8 +128,25 @@ int stun_msg_write_attr(StunMessage* msg, StunAttrType type, uint16_t length, ch
 
 int stun_probe(uint8_t* buf, size_t size);
 
-int stun_msg_is_valid(uint8_t* buf, size_t len, char* password);
-
-int stun_msg_finish(StunMessage* msg, StunCredential credential, const char* password, size_t password_len);
+/**
+ * @brief find an attribute in a raw message without copying it
+ * @return pointer to the attribute value or NULL, length is set to its unpadded length
+ */
+uint8_t* stun_msg_find_attr(uint8_t* buf, size_t size, StunAttrType type, uint16_t* length);
+
+/**
+ * @brief check FINGERPRINT and MESSAGE-INTEGRITY of a received message without copying it
+ * @return 0 if both are present and match
+ */
+int stun_msg_is_valid(uint8_t* buf, size_t len, const UtilsHmacSha1* key);
+
+/**
+ * @brief key MESSAGE-INTEGRITY once per credential, with the password itself for short-term
+ * credentials and MD5(username:realm:password) for long-term ones
+ */
+void stun_key_init(UtilsHmacSha1* key, StunCredential credential, const char* username, const char* realm,
+                   const char* password);
+
+int stun_msg_finish(StunMessage* msg, const UtilsHmacSha1* key);
 
 #endif  // STUN_H_
@@ -3,24 +3,79 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
 #include "mbedtls/md.h"
+#include "ports.h"
+
+static PortsMutex g_random_mutex = PORTS_MUTEX_INITIALIZER;
+static mbedtls_entropy_context g_random_entropy;
+static mbedtls_ctr_drbg_context g_random_drbg;
+// 1 once seeded, -1 if seeding failed, it is not retried
+static int g_random_seeded = 0;
+
+// must be called with g_random_mutex held
+static void utils_random_seed() {
+  const char* pers = "libpeer";
+  int ret;
+
+  mbedtls_entropy_init(&g_random_entropy);
+  mbedtls_ctr_drbg_init(&g_random_drbg);
+  // reseeds from the entropy source by itself every MBEDTLS_CTR_DRBG_RESEED_INTERVAL requests
+  if ((ret = mbedtls_ctr_drbg_seed(&g_random_drbg, mbedtls_entropy_func, &g_random_entropy, (const unsigned char*)pers, strlen(pers))) != 0) {
+    LOGE("Failed to seed the random generator: -0x%x", (unsigned int)-ret);
+    g_random_seeded = -1;
+    return;
+  }
+  g_random_seeded = 1;
+}
+
+int utils_random(void* ctx, unsigned char* buf, size_t len) {
+  size_t n;
+  int ret = 0;
+
+  ports_mutex_lock(&g_random_mutex);
+  if (g_random_seeded == 0) {
+    utils_random_seed();
+  }
+  if (g_random_seeded < 0) {
+    ports_mutex_unlock(&g_random_mutex);
+    return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+  }
+
+  while (len > 0 && ret == 0) {
+    n = len < MBEDTLS_CTR_DRBG_MAX_REQUEST ? len : MBEDTLS_CTR_DRBG_MAX_REQUEST;
+    ret = mbedtls_ctr_drbg_random(&g_random_drbg, buf, n);
+    buf += n;
+    len -= n;
+  }
+  ports_mutex_unlock(&g_random_mutex);
+  return ret;
+}
+
+uint32_t utils_random_u32() {
+  uint32_t value = 0;
+  utils_random(NULL, (unsigned char*)&value, sizeof(value));
+  return value;
+}
 
 void utils_random_string(char* s, const int len) {
-  int i;
+  int i = 0;
+  unsigned char byte;
 
   static const char alphanum[] =
       "0123456789"
       "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
       "abcdefghijklmnopqrstuvwxyz";
 
-  srand(time(NULL));
-
-  for (i = 0; i < len; ++i) {
-    s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+  while (i < len && utils_random(NULL, &byte, 1) == 0) {
+    // bytes past the last multiple of 62 are dropped so every character is equally likely
+    if (byte < 256 - 256 % (sizeof(alphanum) - 1)) {
+      s[i++] = alphanum[byte % (sizeof(alphanum) - 1)];
+    }
   }
 
-  s[len] = '\0';
+  s[i] = '\0';
 }
 
 void utils_get_hmac_sha1(const char* input, size_t input_len, const char* key, size_t key_len, unsigned char* output) {
@@ -34,6 +89,61 @@ void utils_get_hmac_sha1(const char* input, size_t input_len, const char* key, s
   mbedtls_md_free(&ctx);
 }
 
+// SHA-1 block size, the length of ipad and opad
+#define UTILS_SHA1_BLOCK_SIZE 64
+
+void utils_hmac_sha1_init(UtilsHmacSha1* hmac, const char* key, size_t key_len) {
+  unsigned char pad[UTILS_SHA1_BLOCK_SIZE];
+  unsigned char hashed_key[20];
+  size_t i;
+
+  // RFC 2104 2, keys longer than a block are hashed first
+  if (key_len > sizeof(pad)) {
+    mbedtls_sha1((const unsigned char*)key, key_len, hashed_key);
+    key = (const char*)hashed_key;
+    key_len = sizeof(hashed_key);
+  }
+
+  memset(pad, 0x36, sizeof(pad));
+  for (i = 0; i < key_len; i++) {
+    pad[i] ^= key[i];
+  }
+  mbedtls_sha1_init(&hmac->inner);
+  mbedtls_sha1_starts(&hmac->inner);
+  mbedtls_sha1_update(&hmac->inner, pad, sizeof(pad));
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (i = 0; i < key_len; i++) {
+    pad[i] ^= key[i];
+  }
+  mbedtls_sha1_init(&hmac->outer);
+  mbedtls_sha1_starts(&hmac->outer);
+  mbedtls_sha1_update(&hmac->outer, pad, sizeof(pad));
+
+  memset(pad, 0, sizeof(pad));
+  memset(hashed_key, 0, sizeof(hashed_key));
+}
+
+void utils_hmac_sha1_compute(const UtilsHmacSha1* hmac, const char* input, size_t input_len, unsigned char* output) {
+  mbedtls_sha1_context ctx;
+  unsigned char digest[20];
+
+  mbedtls_sha1_init(&ctx);
+  mbedtls_sha1_clone(&ctx, &hmac->inner);
+  mbedtls_sha1_update(&ctx, (const unsigned char*)input, input_len);
+  mbedtls_sha1_finish(&ctx, digest);
+
+  mbedtls_sha1_clone(&ctx, &hmac->outer);
+  mbedtls_sha1_update(&ctx, digest, sizeof(digest));
+  mbedtls_sha1_finish(&ctx, output);
+  mbedtls_sha1_free(&ctx);
+}
+
+void utils_hmac_sha1_free(UtilsHmacSha1* hmac) {
+  mbedtls_sha1_free(&hmac->inner);
+  mbedtls_sha1_free(&hmac->outer);
+}
+
 void utils_get_md5(const char* input, size_t input_len, unsigned char* output) {
   mbedtls_md_context_t ctx;
   mbedtls_md_type_t md_type = MBEDTLS_MD_MD5;
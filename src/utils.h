@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <mbedtls/sha1.h>
 #include "config.h"
 
 #define LEVEL_ERROR 0x00
@@ -55,10 +56,34 @@ void peer_log(char* level_tag, const char* file_name, int line_number, const cha
 
 #define ALIGN32(num) ((num + 3) & ~3)
 
+/**
+ * @brief mbedtls f_rng over one CTR-DRBG shared by the process, seeded on first use, thread safe
+ * @param[in] ctx unused
+ */
+int utils_random(void* ctx, unsigned char* buf, size_t len);
+
+uint32_t utils_random_u32();
+
 void utils_random_string(char* s, const int len);
 
 void utils_get_hmac_sha1(const char* input, size_t input_len, const char* key, size_t key_len, unsigned char* output);
 
+/**
+ * HMAC-SHA1 with the key schedule done once, the inner and outer hashes are kept
+ * right after absorbing ipad and opad so each message only costs hashing its body
+ */
+typedef struct UtilsHmacSha1 {
+  mbedtls_sha1_context inner;
+  mbedtls_sha1_context outer;
+
+} UtilsHmacSha1;
+
+void utils_hmac_sha1_init(UtilsHmacSha1* hmac, const char* key, size_t key_len);
+
+void utils_hmac_sha1_compute(const UtilsHmacSha1* hmac, const char* input, size_t input_len, unsigned char* output);
+
+void utils_hmac_sha1_free(UtilsHmacSha1* hmac);
+
 void utils_get_md5(const char* input, size_t input_len, unsigned char* output);
 
 #endif  // UTILS_H_
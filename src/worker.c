@@ -0,0 +1,170 @@
+#include "utils.h"
+#include "worker.h"
+
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+#include <pthread.h>
+
+static pthread_mutex_t g_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_worker_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t* g_workers = NULL;
+static int g_worker_count = 0;
+static int g_worker_stopping = 0;
+static WorkerJob* g_worker_head = NULL;
+static WorkerJob* g_worker_tail = NULL;
+
+static void* worker_thread(void* arg) {
+  WorkerJob* job;
+
+  pthread_mutex_lock(&g_worker_mutex);
+  while (1) {
+    while (g_worker_head == NULL && !g_worker_stopping) {
+      pthread_cond_wait(&g_worker_cond, &g_worker_mutex);
+    }
+
+    // stopping drains the queue first, owners may be waiting on those jobs
+    if ((job = g_worker_head) == NULL) {
+      break;
+    }
+
+    if ((g_worker_head = job->next) == NULL) {
+      g_worker_tail = NULL;
+    }
+    job->next = NULL;
+
+    pthread_mutex_unlock(&g_worker_mutex);
+    job->run(job);
+    pthread_mutex_lock(&g_worker_mutex);
+  }
+  pthread_mutex_unlock(&g_worker_mutex);
+  return NULL;
+}
+
+int worker_pool_start(int workers) {
+  int i;
+
+  if (workers <= 0) {
+    return 0;
+  } else if (g_worker_count > 0) {
+    LOGE("Workers already running");
+    return -1;
+  }
+
+  if ((g_workers = (pthread_t*)calloc(workers, sizeof(pthread_t))) == NULL) {
+    return -1;
+  }
+
+  g_worker_stopping = 0;
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&g_workers[i], NULL, worker_thread, NULL) != 0) {
+      LOGE("Failed to start worker %d", i);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&g_worker_mutex);
+  g_worker_count = i;
+  pthread_mutex_unlock(&g_worker_mutex);
+
+  if (i == 0) {
+    free(g_workers);
+    g_workers = NULL;
+    return -1;
+  }
+
+  LOGI("Started %d workers", i);
+  return 0;
+}
+
+void worker_pool_stop() {
+  int i, count;
+
+  pthread_mutex_lock(&g_worker_mutex);
+  count = g_worker_count;
+  g_worker_stopping = 1;
+  pthread_cond_broadcast(&g_worker_cond);
+  pthread_mutex_unlock(&g_worker_mutex);
+
+  for (i = 0; i < count; i++) {
+    pthread_join(g_workers[i], NULL);
+  }
+
+  pthread_mutex_lock(&g_worker_mutex);
+  g_worker_count = 0;
+  pthread_mutex_unlock(&g_worker_mutex);
+
+  free(g_workers);
+  g_workers = NULL;
+}
+
+int worker_pool_size() {
+  int count;
+
+  pthread_mutex_lock(&g_worker_mutex);
+  count = g_worker_stopping ? 0 : g_worker_count;
+  pthread_mutex_unlock(&g_worker_mutex);
+  return count;
+}
+
+int worker_pool_submit(WorkerJob* job) {
+  int ret = -1;
+
+  pthread_mutex_lock(&g_worker_mutex);
+  if (g_worker_count > 0 && !g_worker_stopping) {
+    job->next = NULL;
+    if (g_worker_tail) {
+      g_worker_tail->next = job;
+    } else {
+      g_worker_head = job;
+    }
+    g_worker_tail = job;
+    pthread_cond_signal(&g_worker_cond);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&g_worker_mutex);
+  return ret;
+}
+
+int worker_pool_cancel(WorkerJob* job) {
+  int ret = -1;
+  WorkerJob** link;
+  WorkerJob* prev = NULL;
+
+  pthread_mutex_lock(&g_worker_mutex);
+  for (link = &g_worker_head; *link; prev = *link, link = &(*link)->next) {
+    if (*link == job) {
+      *link = job->next;
+      if (g_worker_tail == job) {
+        g_worker_tail = prev;
+      }
+      job->next = NULL;
+      ret = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_worker_mutex);
+  return ret;
+}
+#else
+int worker_pool_start(int workers) {
+  if (workers > 0) {
+    LOGE("Workers are not built in, set CONFIG_DTLS_HANDSHAKE_WORKERS");
+    return -1;
+  }
+  return 0;
+}
+
+void worker_pool_stop() {
+}
+
+int worker_pool_size() {
+  return 0;
+}
+
+int worker_pool_submit(WorkerJob* job) {
+  return -1;
+}
+
+int worker_pool_cancel(WorkerJob* job) {
+  return -1;
+}
+#endif
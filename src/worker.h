@@ -0,0 +1,43 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+typedef struct WorkerJob WorkerJob;
+
+// embedded in whatever the job works on, the owner keeps it alive until run returns
+struct WorkerJob {
+  WorkerJob* next;
+  void (*run)(WorkerJob* job);
+};
+
+/**
+ * @brief start threads that run submitted jobs in order, 0 workers leaves the pool stopped.
+ * The pool is only built with CONFIG_DTLS_HANDSHAKE_WORKERS > 0, otherwise starting workers fails
+ */
+int worker_pool_start(int workers);
+
+/**
+ * @brief run the jobs still queued and join the threads
+ */
+void worker_pool_stop();
+
+/**
+ * @return the number of running workers, 0 when callers should do the work themselves
+ */
+int worker_pool_size();
+
+/**
+ * @return -1 if the pool is not running
+ */
+int worker_pool_submit(WorkerJob* job);
+
+/**
+ * @return 0 if the job was still queued and is now removed, -1 if it already started or finished
+ */
+int worker_pool_cancel(WorkerJob* job);
+
+#endif  // WORKER_H_
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+
+// a STUN binding request, an SCTP DATA chunk and a full datagram
+static const size_t sizes[] = {108, 512, 1200};
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char* name, uint32_t (*update)(uint32_t, const uint8_t*, size_t), const uint8_t* buf, size_t size) {
+  // about 256 MB per run
+  long iterations = (256L << 20) / size;
+  volatile uint32_t sink = 0;
+  double start, elapsed;
+  long i;
+
+  start = now_seconds();
+  for (i = 0; i < iterations; i++) {
+    sink ^= update(0, buf, size);
+  }
+  elapsed = now_seconds() - start;
+
+  printf("  %-7s %5zu bytes  %8.1f MB/s  %6.1f ns/packet\n", name, size,
+         iterations * size / elapsed / 1e6, elapsed * 1e9 / iterations);
+  (void)sink;
+}
+
+int main(int argc, char* argv[]) {
+  static uint8_t buf[2048];
+  CrcBackend backends[] = {CRC_BACKEND_TABLE, CRC_BACKEND_SLICING_BY_8, CRC_BACKEND_HARDWARE};
+  int i, j;
+
+  srand(1);
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = rand() & 0xff;
+  }
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (crc_set_backend(backends[i]) != 0) {
+      continue;
+    }
+    printf("%s\n", crc_backend_to_string(backends[i]));
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+      // odd offset so the unaligned head is part of the measurement
+      bench("crc32", crc32_update, buf + 1, sizes[j]);
+      bench("crc32c", crc32c_update, buf + 1, sizes[j]);
+    }
+  }
+
+  return 0;
+}
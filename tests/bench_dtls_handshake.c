@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dtls_srtp.h"
+#include "peer.h"
+
+#define HANDSHAKES 50
+
+typedef struct Endpoint {
+  DtlsSrtp dtls_srtp;
+  int fd;
+  int datagrams;
+  size_t bytes;
+  size_t largest;
+  int ret;
+
+} Endpoint;
+
+static double now_seconds(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the two ends talk over a datagram socketpair instead of UDP
+static int endpoint_send(void* ctx, const uint8_t* buf, size_t len) {
+  Endpoint* endpoint = (Endpoint*)((DtlsSrtp*)ctx)->user_data;
+
+  endpoint->datagrams++;
+  endpoint->bytes += len;
+  if (len > endpoint->largest) {
+    endpoint->largest = len;
+  }
+  return send(endpoint->fd, buf, len, 0);
+}
+
+static int endpoint_recv(void* ctx, uint8_t* buf, size_t len) {
+  Endpoint* endpoint = (Endpoint*)((DtlsSrtp*)ctx)->user_data;
+  return recv(endpoint->fd, buf, len, 0);
+}
+
+static void* endpoint_handshake(void* arg) {
+  Endpoint* endpoint = (Endpoint*)arg;
+  endpoint->ret = dtls_srtp_handshake(&endpoint->dtls_srtp, NULL);
+  return NULL;
+}
+
+static int endpoint_init(Endpoint* endpoint, DtlsSrtpRole role, int fd) {
+  if (dtls_srtp_init(&endpoint->dtls_srtp, role, endpoint) != 0) {
+    return -1;
+  }
+  endpoint->fd = fd;
+  endpoint->dtls_srtp.udp_send = endpoint_send;
+  endpoint->dtls_srtp.udp_recv = endpoint_recv;
+  // both ends share the process identity
+  strcpy(endpoint->dtls_srtp.remote_fingerprint, endpoint->dtls_srtp.local_fingerprint);
+  return 0;
+}
+
+static void bench(const char* name, PeerIdentityKey key) {
+  static Endpoint client, server;
+  pthread_t thread;
+  double wall, cpu;
+  int fds[2];
+  int i;
+
+  // a fresh identity so key generation is not part of the first handshake
+  if (peer_set_identity_key(key) != 0 || peer_rotate_identity() != 0) {
+    printf("%s: key generation failed\n", name);
+    return;
+  }
+
+  memset(&client, 0, sizeof(client));
+  memset(&server, 0, sizeof(server));
+  wall = now_seconds(CLOCK_MONOTONIC);
+  cpu = now_seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+  for (i = 0; i < HANDSHAKES; i++) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0 ||
+        endpoint_init(&server, DTLS_SRTP_ROLE_SERVER, fds[0]) != 0 ||
+        endpoint_init(&client, DTLS_SRTP_ROLE_CLIENT, fds[1]) != 0) {
+      printf("%s: setup failed\n", name);
+      exit(1);
+    }
+
+    pthread_create(&thread, NULL, endpoint_handshake, &server);
+    endpoint_handshake(&client);
+    pthread_join(thread, NULL);
+
+    if (client.ret != 0 || server.ret != 0) {
+      printf("%s: handshake failed client %d server %d\n", name, client.ret, server.ret);
+      exit(1);
+    }
+
+    dtls_srtp_deinit(&client.dtls_srtp);
+    dtls_srtp_deinit(&server.dtls_srtp);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  wall = now_seconds(CLOCK_MONOTONIC) - wall;
+  cpu = now_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+  // both ends run here, a real peer only pays for one of them
+  printf("%-10s %7.1f handshakes/s per core  %7.1f handshakes/s\n", name, HANDSHAKES / cpu, HANDSHAKES / wall);
+  // with the cookie exchange one datagram per flight is 3 from each side
+  printf("           client %.1f datagrams %zu bytes, server %.1f datagrams %zu bytes, largest %zu bytes\n",
+         (double)client.datagrams / HANDSHAKES, client.bytes / HANDSHAKES,
+         (double)server.datagrams / HANDSHAKES, server.bytes / HANDSHAKES,
+         client.largest > server.largest ? client.largest : server.largest);
+}
+
+int main(int argc, char* argv[]) {
+  peer_init();
+
+  bench("ecdsa-p256", PEER_IDENTITY_KEY_ECDSA_P256);
+  bench("rsa", PEER_IDENTITY_KEY_RSA);
+
+  peer_deinit();
+  return 0;
+}
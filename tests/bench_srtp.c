@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <srtp2/srtp.h>
+
+#define PACKETS 200000
+
+typedef struct BenchProfile {
+  const char* name;
+  void (*set_policy)(srtp_crypto_policy_t* policy);
+
+} BenchProfile;
+
+static const BenchProfile profiles[] = {
+    {"AEAD_AES_128_GCM", srtp_crypto_policy_set_aes_gcm_128_16_auth},
+    {"AEAD_AES_256_GCM", srtp_crypto_policy_set_aes_gcm_256_16_auth},
+    {"AES_CM_128_HMAC_SHA1_80", srtp_crypto_policy_set_rtp_default},
+    {"AES_CM_128_HMAC_SHA1_32", srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32},
+};
+
+// an audio frame, a small and a full video packet
+static const int sizes[] = {160, 500, 1200};
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int session_create(srtp_t* srtp, const BenchProfile* profile, srtp_ssrc_type_t type, unsigned char* key) {
+  srtp_policy_t policy;
+
+  memset(&policy, 0, sizeof(policy));
+  profile->set_policy(&policy.rtp);
+  profile->set_policy(&policy.rtcp);
+  policy.ssrc.type = type;
+  policy.key = key;
+  return srtp_create(srtp, &policy) == srtp_err_status_ok ? 0 : -1;
+}
+
+static void bench(const BenchProfile* profile, int payload_size, unsigned char* key) {
+  static unsigned char packet[1500];
+  static unsigned char buf[1500];
+  double protect_time = 0, unprotect_time = 0, start;
+  srtp_t out, in;
+  int i, size, overhead = 0;
+
+  if (session_create(&out, profile, ssrc_any_outbound, key) != 0 || session_create(&in, profile, ssrc_any_inbound, key) != 0) {
+    printf("  %-24s not available in this libsrtp build\n", profile->name);
+    return;
+  }
+
+  memset(packet, 0xab, sizeof(packet));
+  // V=2, PT 96, SSRC 1
+  packet[0] = 0x80;
+  packet[1] = 96;
+  packet[8] = packet[9] = packet[10] = 0;
+  packet[11] = 1;
+
+  for (i = 0; i < PACKETS; i++) {
+    packet[2] = (i >> 8) & 0xff;
+    packet[3] = i & 0xff;
+    memcpy(buf, packet, 12 + payload_size);
+    size = 12 + payload_size;
+
+    start = now_seconds();
+    srtp_protect(out, buf, &size);
+    protect_time += now_seconds() - start;
+    overhead = size - 12 - payload_size;
+
+    start = now_seconds();
+    if (srtp_unprotect(in, buf, &size) != srtp_err_status_ok) {
+      printf("  %-24s unprotect failed\n", profile->name);
+      break;
+    }
+    unprotect_time += now_seconds() - start;
+  }
+
+  printf("  %-24s %5d bytes  protect %7.1f MB/s %6.1f ns  unprotect %7.1f MB/s %6.1f ns  +%d bytes\n",
+         profile->name, payload_size,
+         (double)PACKETS * payload_size / protect_time / 1e6, protect_time * 1e9 / PACKETS,
+         (double)PACKETS * payload_size / unprotect_time / 1e6, unprotect_time * 1e9 / PACKETS,
+         overhead);
+
+  srtp_dealloc(out);
+  srtp_dealloc(in);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned char key[46];
+  int i, j;
+
+  srand(1);
+  for (i = 0; i < sizeof(key); i++) {
+    key[i] = rand() & 0xff;
+  }
+
+  if (srtp_init() != srtp_err_status_ok) {
+    printf("srtp_init failed\n");
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (j = 0; j < sizeof(profiles) / sizeof(profiles[0]); j++) {
+      bench(&profiles[j], sizes[i], key);
+    }
+  }
+
+  srtp_shutdown();
+  return 0;
+}
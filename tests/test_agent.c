@@ -24,6 +24,7 @@ int main(int argc, char* argv[]) {
   char username[] = "";
   char credential[] = "";
   char description[1024];
+  char buf[1400];
   memset(&description, 0, sizeof(description));
 
   agent_create(&agent);
@@ -31,6 +32,13 @@ int main(int argc, char* argv[]) {
   test_gather_host(&agent);
   test_gather_stun(&agent, stunserver);
   test_gather_turn(&agent, turnserver, username, credential);
+
+  // requests to all servers are in flight, wait for the responses or timeouts
+  while (agent.state == AGENT_STATE_GATHERING_STARTED) {
+    agent_update_gathering(&agent);
+    agent_recv(&agent, (uint8_t*)buf, sizeof(buf));
+  }
+
   agent_get_local_description(&agent, description, sizeof(description));
 
   printf("sdp:\n%s\n", description);
@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#define TEST_BUFFER_SIZE 4096
+
+// one bit at a time, the definition the STUN and SCTP lookup tables were generated from
+static uint32_t reference_crc(uint32_t poly, const uint8_t* data, size_t len) {
+  uint32_t c = 0xffffffff;
+  size_t i;
+  int j;
+
+  for (i = 0; i < len; i++) {
+    c ^= data[i];
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+    }
+  }
+  return c ^ 0xffffffff;
+}
+
+static void test_check_values() {
+  const uint8_t check[] = "123456789";
+
+  assert(crc32_update(0, check, 9) == 0xcbf43926);
+  assert(crc32c_update(0, check, 9) == 0xe3069283);
+  assert(crc32_update(0, check, 0) == 0);
+  assert(crc32c_update(0, check, 0) == 0);
+}
+
+static void test_lengths_and_offsets(const uint8_t* buf) {
+  size_t len, offset;
+
+  // unaligned heads, the 8 and 64 byte loops and every tail length
+  for (offset = 0; offset < 16; offset++) {
+    for (len = 0; len < 300; len++) {
+      assert(crc32_update(0, buf + offset, len) == reference_crc(0xedb88320, buf + offset, len));
+      assert(crc32c_update(0, buf + offset, len) == reference_crc(0x82f63b78, buf + offset, len));
+    }
+  }
+
+  for (len = 300; len <= TEST_BUFFER_SIZE - 16; len += 97) {
+    assert(crc32_update(0, buf + 3, len) == reference_crc(0xedb88320, buf + 3, len));
+    assert(crc32c_update(0, buf + 3, len) == reference_crc(0x82f63b78, buf + 3, len));
+  }
+}
+
+static void test_chaining(const uint8_t* buf) {
+  size_t split;
+  uint32_t whole32 = crc32_update(0, buf, 1500);
+  uint32_t whole32c = crc32c_update(0, buf, 1500);
+
+  for (split = 0; split <= 1500; split += 37) {
+    assert(crc32_update(crc32_update(0, buf, split), buf + split, 1500 - split) == whole32);
+    assert(crc32c_update(crc32c_update(0, buf, split), buf + split, 1500 - split) == whole32c);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  static uint8_t buf[TEST_BUFFER_SIZE];
+  CrcBackend backends[] = {CRC_BACKEND_TABLE, CRC_BACKEND_SLICING_BY_8, CRC_BACKEND_HARDWARE};
+  CrcBackend best = crc_get_backend();
+  int i;
+
+  srand(1);
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = rand() & 0xff;
+  }
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (crc_set_backend(backends[i]) != 0) {
+      printf("skip %s crc, not supported\n", crc_backend_to_string(backends[i]));
+      continue;
+    }
+    test_check_values();
+    test_lengths_and_offsets(buf);
+    test_chaining(buf);
+  }
+
+  assert(crc_set_backend(best) == 0);
+  printf("test_crc32 passed (%s)\n", crc_backend_to_string(best));
+  return 0;
+}
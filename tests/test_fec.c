@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "address.h"
+#include "fec.h"
+
+#define TEST_GROUP_SIZE 5
+
+static uint8_t repair_packet[CONFIG_MTU + 128];
+static size_t repair_size = 0;
+
+static void on_repair_packet(uint8_t* packet, size_t bytes, void* user_data) {
+  memcpy(repair_packet, packet, bytes);
+  repair_size = bytes;
+}
+
+static size_t create_media_packet(uint8_t* packet, uint16_t seq_number, size_t size) {
+  RtpHeader* rtp_header = (RtpHeader*)packet;
+  size_t i;
+
+  memset(packet, 0, sizeof(RtpHeader));
+  rtp_header->version = 2;
+  rtp_header->type = PT_H264;
+  rtp_header->markerbit = (seq_number % TEST_GROUP_SIZE) == TEST_GROUP_SIZE - 1;
+  rtp_header->seq_number = htons(seq_number);
+  rtp_header->timestamp = htonl(seq_number * 3000);
+  rtp_header->ssrc = htonl(SSRC_H264);
+
+  for (i = sizeof(RtpHeader); i < size; i++) {
+    packet[i] = rand() & 0xff;
+  }
+
+  return size;
+}
+
+static void test_xor() {
+  uint8_t a[67], b[67], c[67];
+  int i;
+
+  for (i = 0; i < sizeof(a); i++) {
+    a[i] = rand() & 0xff;
+    b[i] = rand() & 0xff;
+    c[i] = a[i] ^ b[i];
+  }
+
+  fec_xor(a, b, sizeof(a));
+  assert(memcmp(a, c, sizeof(a)) == 0);
+}
+
+static void test_recover(int lost, int extension) {
+  uint8_t packets[TEST_GROUP_SIZE][CONFIG_MTU + RTP_TWCC_EXTENSION_SIZE];
+  size_t sizes[TEST_GROUP_SIZE];
+  FecEncoder fec_encoder;
+  FecDecoder fec_decoder;
+  int i, ret;
+
+  fec_encoder_init(&fec_encoder, PT_FLEXFEC, SSRC_FLEXFEC, on_repair_packet, NULL);
+  fec_encoder_set_loss(&fec_encoder, 256 / (2 * TEST_GROUP_SIZE));
+  ret = fec_decoder_init(&fec_decoder, SSRC_H264, FEC_DECODER_HISTORY_SIZE);
+  assert(ret == 0);
+
+  repair_size = 0;
+  for (i = 0; i < TEST_GROUP_SIZE; i++) {
+    sizes[i] = create_media_packet(packets[i], 65533 + i, 100 + rand() % (CONFIG_MTU - 100));
+    // the sender adds transport-cc before protecting and the receiver keeps it
+    if (extension) {
+      sizes[i] = rtp_set_transport_cc(packets[i], sizes[i], 3, i);
+    }
+    ret = fec_encoder_put(&fec_encoder, packets[i], sizes[i]);
+    assert(ret == (i == TEST_GROUP_SIZE - 1));
+    if (ret) {
+      fec_encoder_flush(&fec_encoder);
+    }
+    if (i != lost) {
+      ret = fec_decoder_put(&fec_decoder, packets[i], sizes[i], 0);
+      assert(ret == 0);
+    }
+  }
+
+  assert(repair_size > 0);
+  ret = fec_decoder_recover(&fec_decoder, repair_packet, repair_size, 0);
+  assert(ret == sizes[lost]);
+  assert(memcmp(fec_decoder.buf, packets[lost], sizes[lost]) == 0);
+  assert(((RtpHeader*)fec_decoder.buf)->extension == extension);
+
+  // the recovered packet is remembered
+  ret = fec_decoder_recover(&fec_decoder, repair_packet, repair_size, 0);
+  assert(ret == 0);
+  ret = fec_decoder_put(&fec_decoder, packets[lost], sizes[lost], 0);
+  assert(ret < 0);
+
+  fec_decoder_deinit(&fec_decoder);
+}
+
+int main(int argc, char* argv[]) {
+  int i;
+
+  srand(1);
+  test_xor();
+
+  for (i = 0; i < TEST_GROUP_SIZE; i++) {
+    test_recover(i, 0);
+    test_recover(i, 1);
+  }
+
+  printf("test_fec passed\n");
+  return 0;
+}
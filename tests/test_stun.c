@@ -1,8 +1,131 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "stun.h"
 
+// RFC 5769 2.1, sample request with SOFTWARE, PRIORITY, ICE-CONTROLLED and USERNAME
+static const uint8_t sample_request[] = {
+    0x00, 0x01, 0x00, 0x58, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+    0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x10,
+    0x53, 0x54, 0x55, 0x4e, 0x20, 0x74, 0x65, 0x73, 0x74, 0x20, 0x63, 0x6c,
+    0x69, 0x65, 0x6e, 0x74, 0x00, 0x24, 0x00, 0x04, 0x6e, 0x00, 0x01, 0xff,
+    0x80, 0x29, 0x00, 0x08, 0x93, 0x2f, 0xf9, 0xb1, 0x51, 0x26, 0x3b, 0x36,
+    0x00, 0x06, 0x00, 0x09, 0x65, 0x76, 0x74, 0x6a, 0x3a, 0x68, 0x36, 0x76,
+    0x59, 0x20, 0x20, 0x20, 0x00, 0x08, 0x00, 0x14, 0x9a, 0xea, 0xa7, 0x0c,
+    0xbf, 0xd8, 0xcb, 0x56, 0x78, 0x1e, 0xf2, 0xb5, 0xb2, 0xd3, 0xf2, 0x49,
+    0xc1, 0xb5, 0x71, 0xa2, 0x80, 0x28, 0x00, 0x04, 0xe5, 0x7a, 0x3b, 0xcf};
+
+// RFC 5769 2.2, sample IPv4 response with SOFTWARE and XOR-MAPPED-ADDRESS 192.0.2.1:32853
+static const uint8_t sample_response[] = {
+    0x01, 0x01, 0x00, 0x3c, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+    0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x0b,
+    0x74, 0x65, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x20,
+    0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xa1, 0x47, 0xe1, 0x12, 0xa6, 0x43,
+    0x00, 0x08, 0x00, 0x14, 0x2b, 0x91, 0xf5, 0x99, 0xfd, 0x9e, 0x90, 0xc3,
+    0x8c, 0x74, 0x89, 0xf9, 0x2a, 0xf9, 0xba, 0x53, 0xf0, 0x6b, 0xe7, 0xd7,
+    0x80, 0x28, 0x00, 0x04, 0xc0, 0x7d, 0x4c, 0x96};
+
+static const char sample_password[] = "VOkJxbRl1RmTxUk/WvJxBt";
+
+// offsets into sample_response
+#define RESPONSE_INTEGRITY_POS 48
+#define RESPONSE_FINGERPRINT_POS 72
+
+static void test_sample_messages(const UtilsHmacSha1* key) {
+  uint8_t buf[sizeof(sample_request)];
+  int ret;
+
+  memcpy(buf, sample_request, sizeof(sample_request));
+  ret = stun_msg_is_valid(buf, sizeof(sample_request), key);
+  assert(ret == 0);
+
+  memcpy(buf, sample_response, sizeof(sample_response));
+  ret = stun_msg_is_valid(buf, sizeof(sample_response), key);
+  assert(ret == 0);
+
+  // one flipped bit in an attribute breaks both checks
+  memcpy(buf, sample_request, sizeof(sample_request));
+  buf[30] ^= 0x01;
+  ret = stun_msg_is_valid(buf, sizeof(sample_request), key);
+  assert(ret == -1);
+}
+
+static void test_truncated_attribute(const UtilsHmacSha1* key) {
+  uint8_t buf[sizeof(sample_request)];
+  int ret;
+
+  // SOFTWARE claims more bytes than the message holds
+  memcpy(buf, sample_request, sizeof(sample_request));
+  buf[22] = 0x00;
+  buf[23] = 0xff;
+  ret = stun_msg_is_valid(buf, sizeof(sample_request), key);
+  assert(ret == -1);
+}
+
+static void test_length_past_buffer(const UtilsHmacSha1* key) {
+  uint8_t buf[sizeof(sample_request)];
+  int ret;
+
+  // the header length covers bytes that were never received
+  memcpy(buf, sample_request, sizeof(sample_request));
+  ret = stun_msg_is_valid(buf, sizeof(sample_request) - 4, key);
+  assert(ret == -1);
+
+  ret = stun_msg_is_valid(buf, 12, key);
+  assert(ret == -1);
+}
+
+static void test_fingerprint_not_last(const UtilsHmacSha1* key) {
+  uint8_t buf[sizeof(sample_response) + 8];
+  uint32_t crc32;
+  int ret;
+
+  // a SOFTWARE attribute after FINGERPRINT, both checks would pass on their own
+  memcpy(buf, sample_response, sizeof(sample_response));
+  memcpy(buf + sizeof(sample_response), "\x80\x22\x00\x04test", 8);
+  buf[3] += 8;
+  stun_calculate_fingerprint((char*)buf, RESPONSE_FINGERPRINT_POS, &crc32);
+  memcpy(buf + RESPONSE_FINGERPRINT_POS + 4, &crc32, sizeof(crc32));
+
+  ret = stun_msg_is_valid(buf, sizeof(buf), key);
+  assert(ret == -1);
+}
+
+static void test_second_integrity(const UtilsHmacSha1* key) {
+  uint8_t buf[sizeof(sample_response) + 24];
+  size_t fingerprint_pos = RESPONSE_FINGERPRINT_POS + 24;
+  uint32_t crc32;
+  int ret;
+
+  // MESSAGE-INTEGRITY twice, the second one and FINGERPRINT are correct so only the duplicate is wrong
+  memcpy(buf, sample_response, RESPONSE_FINGERPRINT_POS);
+  memcpy(buf + RESPONSE_FINGERPRINT_POS, sample_response + RESPONSE_INTEGRITY_POS, 4);
+  // the HMAC covers a header whose length ends right after the second MESSAGE-INTEGRITY
+  buf[3] += 16;
+  utils_hmac_sha1_compute(key, (char*)buf, RESPONSE_FINGERPRINT_POS, buf + RESPONSE_FINGERPRINT_POS + 4);
+  buf[3] += 8;
+  memcpy(buf + fingerprint_pos, sample_response + RESPONSE_FINGERPRINT_POS, 4);
+  stun_calculate_fingerprint((char*)buf, fingerprint_pos, &crc32);
+  memcpy(buf + fingerprint_pos + 4, &crc32, sizeof(crc32));
+
+  ret = stun_msg_is_valid(buf, sizeof(buf), key);
+  assert(ret == -1);
+}
+
 int main(int argc, char* argv[]) {
+  UtilsHmacSha1 key;
+
+  stun_key_init(&key, STUN_CREDENTIAL_SHORT_TERM, NULL, NULL, sample_password);
+
+  test_sample_messages(&key);
+  test_truncated_attribute(&key);
+  test_length_past_buffer(&key);
+  test_fingerprint_not_last(&key);
+  test_second_integrity(&key);
+
+  utils_hmac_sha1_free(&key);
+  printf("test_stun passed\n");
+  return 0;
 }
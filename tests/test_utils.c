@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define TEST_THREADS 4
+
+static void* test_random_thread(void* arg) {
+  unsigned char buf[2048];
+  int i, ret;
+
+  // larger than one CTR-DRBG request so it is split
+  for (i = 0; i < 100; i++) {
+    ret = utils_random(NULL, buf, sizeof(buf));
+    assert(ret == 0);
+  }
+  return NULL;
+}
+
+static void test_random_string() {
+  char a[25], b[25];
+  int i;
+
+  utils_random_string(a, 24);
+  utils_random_string(b, 24);
+  assert(strlen(a) == 24);
+  assert(strlen(b) == 24);
+  assert(strcmp(a, b) != 0);
+
+  for (i = 0; i < 24; i++) {
+    assert(isalnum((unsigned char)a[i]));
+  }
+}
+
+static void test_hmac_sha1_vector(const char* key, size_t key_len, const char* input, const char* expected) {
+  UtilsHmacSha1 hmac;
+  unsigned char output[20];
+  char hex[41];
+  int i;
+
+  utils_hmac_sha1_init(&hmac, key, key_len);
+  utils_hmac_sha1_compute(&hmac, input, strlen(input), output);
+  utils_hmac_sha1_free(&hmac);
+
+  for (i = 0; i < 20; i++) {
+    sprintf(hex + 2 * i, "%02x", output[i]);
+  }
+  assert(strcmp(hex, expected) == 0);
+}
+
+static void test_hmac_sha1() {
+  // RFC 5769 2.1, MESSAGE-INTEGRITY of the sample request with the header length ending after it
+  static const unsigned char request[] = {
+      0x00, 0x01, 0x00, 0x50, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01,
+      0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x10,
+      0x53, 0x54, 0x55, 0x4e, 0x20, 0x74, 0x65, 0x73, 0x74, 0x20, 0x63, 0x6c,
+      0x69, 0x65, 0x6e, 0x74, 0x00, 0x24, 0x00, 0x04, 0x6e, 0x00, 0x01, 0xff,
+      0x80, 0x29, 0x00, 0x08, 0x93, 0x2f, 0xf9, 0xb1, 0x51, 0x26, 0x3b, 0x36,
+      0x00, 0x06, 0x00, 0x09, 0x65, 0x76, 0x74, 0x6a, 0x3a, 0x68, 0x36, 0x76,
+      0x59, 0x20, 0x20, 0x20};
+  static const unsigned char integrity[] = {
+      0x9a, 0xea, 0xa7, 0x0c, 0xbf, 0xd8, 0xcb, 0x56, 0x78, 0x1e,
+      0xf2, 0xb5, 0xb2, 0xd3, 0xf2, 0x49, 0xc1, 0xb5, 0x71, 0xa2};
+  const char password[] = "VOkJxbRl1RmTxUk/WvJxBt";
+  char long_key[80];
+  UtilsHmacSha1 hmac;
+  unsigned char output[20];
+
+  // RFC 2202 3 and the empty key
+  test_hmac_sha1_vector("", 0, "", "fbdb1d1b18aa6c08324b7d64b71fb76370690e1d");
+  test_hmac_sha1_vector("\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 20,
+                        "Hi There", "b617318655057264e28bc0b6fb378c8ef146be00");
+  test_hmac_sha1_vector("Jefe", 4, "what do ya want for nothing?", "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79");
+
+  // longer than a block, hashed first
+  memset(long_key, 0xaa, sizeof(long_key));
+  test_hmac_sha1_vector(long_key, sizeof(long_key), "Test Using Larger Than Block-Size Key - Hash Key First",
+                        "aa4ae5e15272d00e95705637ce8a3b55ed402112");
+
+  // one keyed context serves several messages
+  utils_hmac_sha1_init(&hmac, password, strlen(password));
+  utils_hmac_sha1_compute(&hmac, (const char*)request, sizeof(request), output);
+  assert(memcmp(output, integrity, sizeof(integrity)) == 0);
+  utils_hmac_sha1_compute(&hmac, (const char*)request, sizeof(request), output);
+  assert(memcmp(output, integrity, sizeof(integrity)) == 0);
+  utils_hmac_sha1_free(&hmac);
+}
+
+static void test_random_threads() {
+  pthread_t threads[TEST_THREADS];
+  uint32_t values[4];
+  int i;
+
+  for (i = 0; i < TEST_THREADS; i++) {
+    pthread_create(&threads[i], NULL, test_random_thread, NULL);
+  }
+  for (i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < 4; i++) {
+    values[i] = utils_random_u32();
+  }
+  assert(values[0] != values[1] || values[2] != values[3]);
+}
+
+int main(int argc, char* argv[]) {
+  test_random_string();
+  test_hmac_sha1();
+  test_random_threads();
+  printf("test_utils passed\n");
+  return 0;
+}
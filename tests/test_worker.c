@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+#define TEST_JOBS 64
+
+typedef struct TestJob {
+  WorkerJob job;
+  int runs;
+
+} TestJob;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int total = 0;
+
+static void test_job_run(WorkerJob* job) {
+  TestJob* test_job = (TestJob*)job;
+
+  usleep(1000);
+  pthread_mutex_lock(&mutex);
+  test_job->runs++;
+  total++;
+  pthread_mutex_unlock(&mutex);
+}
+
+static void test_stopped_pool() {
+  TestJob job = {.job = {.run = test_job_run}};
+  int ret;
+
+  assert(worker_pool_size() == 0);
+  ret = worker_pool_start(0);
+  assert(ret == 0);
+  assert(worker_pool_size() == 0);
+  ret = worker_pool_submit(&job.job);
+  assert(ret == -1);
+}
+
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+static void test_run_and_drain() {
+  static TestJob jobs[TEST_JOBS];
+  int i, ret, cancelled = 0;
+
+  total = 0;
+  ret = worker_pool_start(4);
+  assert(ret == 0);
+  assert(worker_pool_size() == 4);
+  ret = worker_pool_start(4);
+  assert(ret == -1);
+
+  for (i = 0; i < TEST_JOBS; i++) {
+    jobs[i].job.run = test_job_run;
+    jobs[i].runs = 0;
+    ret = worker_pool_submit(&jobs[i].job);
+    assert(ret == 0);
+  }
+
+  // the tail is still queued behind the sleeping workers
+  for (i = TEST_JOBS - 1; i >= TEST_JOBS - 8; i--) {
+    if (worker_pool_cancel(&jobs[i].job) == 0) {
+      cancelled++;
+    }
+  }
+  assert(cancelled > 0);
+
+  // stopping runs what is left in the queue
+  worker_pool_stop();
+  assert(worker_pool_size() == 0);
+  assert(total == TEST_JOBS - cancelled);
+
+  for (i = 0; i < TEST_JOBS; i++) {
+    assert(jobs[i].runs == (i < TEST_JOBS - cancelled ? 1 : 0));
+    ret = worker_pool_cancel(&jobs[i].job);
+    assert(ret == -1);
+  }
+}
+#endif
+
+int main(int argc, char* argv[]) {
+  test_stopped_pool();
+#if CONFIG_DTLS_HANDSHAKE_WORKERS > 0
+  test_run_and_drain();
+  test_stopped_pool();
+#else
+  printf("test_worker: pool not built, configure with -DDTLS_HANDSHAKE_WORKERS=N to run it\n");
+#endif
+  printf("test_worker passed\n");
+  return 0;
+}